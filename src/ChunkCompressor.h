@@ -0,0 +1,218 @@
+#ifndef CHUNKCOMPRESSOR_H
+#define CHUNKCOMPRESSOR_H
+
+#ifdef HAVE_ZLIB
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <unistd.h>
+#include <zlib.h>
+
+// 文件数据块压缩（FEATURE_FILE_DEFLATE）。文本日志、CSV 导出能压到几分之一，图片、视频、压缩包本身已经压过，
+// 再压只是白费 CPU，所以每一块先抽几段算一下字节分布的熵，估计压得动才用 deflate 最快的一档压，
+// 压完省不到 1/16 的也照原样发。压过的块用 MSG_FILE_DATA_Z 发，每块单独压、单独解，和分到哪条连接、
+// 到达的先后无关；没压的块还是 MSG_FILE_DATA，零拷贝的路径照旧走 sendfile。
+// deflate 最快一档每核每秒也只能压几十到一两百 MB，比局域网、本机回环慢，链路比压缩快时压了反而更慢，
+// 所以发送方按窗口量实际发出去的原始字节速度：先不压量一段，再压一段，哪种快用哪种，隔一阵再试另一种，
+// 试了还是慢就隔得更久。压缩的那一段里 deflate 本身的速度就比不压时发得慢的话，不用量完马上停
+
+const size_t SAMPLE_SLICES = 4;            // 抽样段数，均匀分布在数据块里
+const size_t SAMPLE_SLICE = 1024;          // 每段的字节数
+const double ENTROPY_LIMIT = 7.2;          // 每字节的估计熵（位）超过它就不压，压过的数据接近 8
+const size_t COMPRESS_WINDOW = 8 << 20;    // 每个窗口的原始字节数，要比发送队列能压的数据（2MB）多不少
+const size_t COMPRESS_PROBE = 512 * 1024;  // 压了这么多就能判断 deflate 跟不跟得上
+const int EXPLORE_WINDOWS = 8;             // 另一种方式隔这么多个窗口再试一次
+const int MAX_EXPLORE_WINDOWS = 64;
+
+// 发送方用的压缩器，一个发送线程一个
+class ChunkCompressor {
+public:
+    ChunkCompressor() {
+        stream_ = z_stream();
+        ok_ = deflateInit2(&stream_, Z_BEST_SPEED, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+        window_start_ = Clock::now();
+    }
+
+    ~ChunkCompressor() {
+        deflateEnd(&stream_);
+    }
+
+    // 禁止拷贝
+    ChunkCompressor(const ChunkCompressor& other) = delete;
+    ChunkCompressor& operator=(const ChunkCompressor& other) = delete;
+
+    // 试着压缩一块数据：正在压缩的那一段、抽样估计压得动、压完省下至少 1/16 才返回 true，压好的数据放进 out。
+    // 返回 false 时照原样发
+    bool compress(const char* data, size_t length, std::vector<char>& out) {
+        return compressing_ && looks_compressible(data, length) && deflate_chunk(data, length, out);
+    }
+
+    // 零拷贝路径用：数据块还在文件里，先只读抽样的几段，估计压得动才把整块读出来压
+    bool compress(int fd, uint64_t offset, size_t length, std::vector<char>& out) {
+        if (!compressing_ || !looks_compressible(fd, offset, length)) {
+            return false;
+        }
+        chunk_.resize(length);
+        for (size_t done = 0; done < length;) {
+            ssize_t got = pread(fd, chunk_.data() + done, length - done, offset + done);
+            if (got <= 0) {
+                return false; // 读不出来的交给 sendfile 去报错
+            }
+            done += got;
+        }
+        return deflate_chunk(chunk_.data(), length, out);
+    }
+
+    // 每发完一块调用一次，bytes 是原始数据的长度。一个窗口结束时记下这种方式的速度，决定下一个窗口用哪种
+    void on_sent(size_t bytes) {
+        window_bytes_ += bytes;
+        double deflate_rate = deflate_seconds_ > 0 ? deflate_bytes_ / deflate_seconds_ : 0;
+        bool behind = compressing_ && deflate_bytes_ >= COMPRESS_PROBE && deflate_rate < rate_[0];
+        if (window_bytes_ < COMPRESS_WINDOW && !behind) {
+            return;
+        }
+        double seconds = std::chrono::duration<double>(Clock::now() - window_start_).count();
+        rate_[compressing_ ? 1 : 0] = behind ? deflate_rate : window_bytes_ / std::max(seconds, 1e-6);
+        bool compress_better = rate_[1] > rate_[0];
+        if (exploring_) {
+            // 试的那种还是慢，下次隔得更久再试
+            bool lost = compressing_ != compress_better;
+            explore_every_ = lost ? std::min(std::max(explore_every_ * 2, EXPLORE_WINDOWS), MAX_EXPLORE_WINDOWS)
+                                  : EXPLORE_WINDOWS;
+            exploring_ = false;
+        } else if (++windows_ >= explore_every_) {
+            exploring_ = true;
+            windows_ = 0;
+        }
+        compressing_ = ok_ && (exploring_ ? !compress_better : compress_better);
+        window_start_ = Clock::now();
+        window_bytes_ = 0;
+        deflate_bytes_ = 0;
+        deflate_seconds_ = 0;
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    // 抽样估计数据块压不压得动
+    static bool looks_compressible(const char* data, size_t length) {
+        if (length <= SAMPLE_SLICES * SAMPLE_SLICE) {
+            return entropy(data, length) <= ENTROPY_LIMIT;
+        }
+        char sample[SAMPLE_SLICES * SAMPLE_SLICE];
+        size_t step = (length - SAMPLE_SLICE) / (SAMPLE_SLICES - 1);
+        for (size_t i = 0; i < SAMPLE_SLICES; ++i) {
+            std::memcpy(sample + i * SAMPLE_SLICE, data + i * step, SAMPLE_SLICE);
+        }
+        return entropy(sample, sizeof(sample)) <= ENTROPY_LIMIT;
+    }
+
+    // 零拷贝路径用：数据块还在文件里，只读抽样的几段
+    static bool looks_compressible(int fd, uint64_t offset, size_t length) {
+        char sample[SAMPLE_SLICES * SAMPLE_SLICE];
+        size_t slice = std::min(SAMPLE_SLICE, length / SAMPLE_SLICES);
+        size_t step = slice > 0 ? (length - slice) / (SAMPLE_SLICES - 1) : 0;
+        size_t size = 0;
+        for (size_t i = 0; i < SAMPLE_SLICES && slice > 0; ++i) {
+            if (pread(fd, sample + size, slice, offset + i * step) != (ssize_t)slice) {
+                return false;
+            }
+            size += slice;
+        }
+        return entropy(sample, size) <= ENTROPY_LIMIT;
+    }
+
+    // 用 deflate 最快的一档压一整块，输出只给到原长的 15/16，压不到这么小就停下返回 false
+    bool deflate_chunk(const char* data, size_t length, std::vector<char>& out) {
+        auto start = Clock::now();
+        size_t limit = length - length / 16;
+        out.resize(limit);
+        deflateReset(&stream_);
+        stream_.next_in = (Bytef*)data;
+        stream_.avail_in = length;
+        stream_.next_out = (Bytef*)out.data();
+        stream_.avail_out = limit;
+        bool ok = deflate(&stream_, Z_FINISH) == Z_STREAM_END; // 压不到 limit 以内时停在 Z_OK
+        deflate_bytes_ += length;
+        deflate_seconds_ += std::chrono::duration<double>(Clock::now() - start).count();
+        out.resize(ok ? limit - stream_.avail_out : 0);
+        return ok;
+    }
+
+    // 字节分布的香农熵，单位是每字节多少位
+    static double entropy(const char* data, size_t length) {
+        if (length == 0) {
+            return 0;
+        }
+        uint32_t counts[256] = {};
+        for (size_t i = 0; i < length; ++i) {
+            ++counts[(uint8_t)data[i]];
+        }
+        double sum = 0;
+        for (uint32_t count : counts) {
+            if (count > 0) {
+                sum += count * std::log2((double)count);
+            }
+        }
+        return std::log2((double)length) - sum / length;
+    }
+
+    z_stream stream_;
+    bool ok_;
+    std::vector<char> chunk_; // 零拷贝路径读出来的数据块
+    bool compressing_ = false; // 先不压，量出链路的速度
+    bool exploring_ = false;   // 这个窗口在试不占优的那种方式
+    int windows_ = 0;          // 上次试过之后过了几个窗口
+    int explore_every_ = 1;    // 第一个窗口之后就试压缩
+    double rate_[2] = {0, 0};  // 不压、压缩时最近一次量出的原始字节速度，0 表示还没量过
+    Clock::time_point window_start_;
+    size_t window_bytes_ = 0;
+    size_t deflate_bytes_ = 0; // 这个窗口里 deflate 压过的原始字节数和用的时间
+    double deflate_seconds_ = 0;
+};
+
+// 收方用的解压器，一个收数据的线程一个
+class ChunkDecompressor {
+public:
+    ChunkDecompressor() {
+        stream_ = z_stream();
+        ok_ = inflateInit2(&stream_, -MAX_WBITS) == Z_OK;
+    }
+
+    ~ChunkDecompressor() {
+        inflateEnd(&stream_);
+    }
+
+    // 禁止拷贝
+    ChunkDecompressor(const ChunkDecompressor& other) = delete;
+    ChunkDecompressor& operator=(const ChunkDecompressor& other) = delete;
+
+    // 解开一个 MSG_FILE_DATA_Z 的数据放进 out，最多 capacity 字节，length 返回解出的长度。
+    // 数据不完整、解出来超过 capacity 时返回 false
+    bool decompress(const char* data, size_t size, char* out, size_t capacity, size_t& length) {
+        if (!ok_ || inflateReset(&stream_) != Z_OK) {
+            return false;
+        }
+        stream_.next_in = (Bytef*)data;
+        stream_.avail_in = size;
+        stream_.next_out = (Bytef*)out;
+        stream_.avail_out = capacity;
+        if (inflate(&stream_, Z_FINISH) != Z_STREAM_END || stream_.avail_in != 0) {
+            return false;
+        }
+        length = capacity - stream_.avail_out;
+        return true;
+    }
+
+private:
+    z_stream stream_;
+    bool ok_;
+};
+
+#endif // HAVE_ZLIB
+
+#endif // CHUNKCOMPRESSOR_H
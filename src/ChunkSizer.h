@@ -0,0 +1,104 @@
+#ifndef CHUNKSIZER_H
+#define CHUNKSIZER_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "Protocol.h"
+
+// 文件数据块大小的上下限。都是 2 的幂，能整除 FILE_PIECE_SIZE，数据块不会跨片
+const uint32_t MIN_CHUNK_SIZE = 16 * 1024;
+const uint32_t MAX_CHUNK_SIZE = FILE_PIECE_SIZE;
+const uint32_t INITIAL_CHUNK_SIZE = 64 * 1024;
+
+// 运行时调整数据块大小：每发一段时间测一次吞吐量，变快了就继续往同一个方向调（翻倍或减半），
+// 变慢了就掉头。测量窗口至少覆盖几个 RTT，高延迟链路上不会被单次往返的抖动带偏。
+// 上限是双方协商好的 max_chunk；fixed 不为 0 时固定用这个大小，方便对比不同块大小的速度。
+// 两者都向下取到 2 的幂，调整出来的每个大小都是 MIN_CHUNK_SIZE 的倍数，数据块和分片、位图的块对得齐。
+class ChunkSizer {
+public:
+    explicit ChunkSizer(uint32_t max_chunk, uint32_t fixed = 0) {
+        max_ = MAX_CHUNK_SIZE; // clamp 先按最大的上限取整，得到的就是不超过 max_chunk 的 2 的幂
+        max_ = clamp(max_chunk ? max_chunk : INITIAL_CHUNK_SIZE);
+        size_ = clamp(fixed ? fixed : INITIAL_CHUNK_SIZE);
+        fixed_ = fixed != 0;
+        window_start_ = Clock::now();
+    }
+
+    uint32_t size() const { return size_; }
+
+    // 每发完一个数据块调用一次
+    void on_sent(int sock, size_t bytes) {
+        window_bytes_ += bytes;
+        ++window_chunks_;
+        double seconds = std::chrono::duration<double>(Clock::now() - window_start_).count();
+        if (fixed_ || window_chunks_ < MIN_WINDOW_CHUNKS || seconds < MIN_WINDOW_SECONDS) {
+            return;
+        }
+        if (seconds < rtt_seconds(sock) * WINDOW_RTTS) {
+            return;
+        }
+
+        double throughput = window_bytes_ / seconds;
+        if (last_throughput_ > 0 && throughput < last_throughput_ * 0.95) {
+            grow_ = !grow_; // 变慢了，往回调
+        }
+        if (last_throughput_ == 0 || throughput > last_throughput_ * 1.05 || throughput < last_throughput_ * 0.95) {
+            size_ = clamp(grow_ ? size_ * 2 : size_ / 2);
+        }
+        last_throughput_ = throughput;
+
+        window_start_ = Clock::now();
+        window_bytes_ = 0;
+        window_chunks_ = 0;
+    }
+
+    // 从 TCP 协议栈取平滑后的 RTT，取不到返回 0
+    static double rtt_seconds(int sock) {
+#if defined(__linux__)
+        struct tcp_info info;
+        socklen_t len = sizeof(info);
+        if (getsockopt(sock, IPPROTO_TCP, TCP_INFO, &info, &len) == 0) {
+            return info.tcpi_rtt / 1e6; // 微秒
+        }
+#elif defined(__APPLE__)
+        struct tcp_connection_info info;
+        socklen_t len = sizeof(info);
+        if (getsockopt(sock, IPPROTO_TCP, TCP_CONNECTION_INFO, &info, &len) == 0) {
+            return info.tcpi_srtt / 1e3; // 毫秒
+        }
+#else
+        (void)sock;
+#endif
+        return 0;
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+    static const uint32_t MIN_WINDOW_CHUNKS = 8;
+    static const int WINDOW_RTTS = 4;
+    static constexpr double MIN_WINDOW_SECONDS = 0.05;
+
+    // 取不超过 size、也不超过 max_ 的 2 的幂，最小 MIN_CHUNK_SIZE
+    uint32_t clamp(uint32_t size) const {
+        uint32_t result = MIN_CHUNK_SIZE;
+        while (result * 2 <= size && result * 2 <= max_) {
+            result *= 2;
+        }
+        return result;
+    }
+
+    uint32_t max_;
+    uint32_t size_;
+    bool fixed_;
+    bool grow_ = true;
+    double last_throughput_ = 0;
+    Clock::time_point window_start_;
+    size_t window_bytes_ = 0;
+    uint32_t window_chunks_ = 0;
+};
+
+#endif // CHUNKSIZER_H
@@ -6,14 +6,10 @@
 #include <sys/socket.h>
 #include <vector>
 #include "Protocol.h"
+#include "MessageCodec.h"
 
 void send_package(int sock, int type, const std::string& data) {
-    Header header;
-    header.length = data.length();
-    header.type = type;
-    std::vector<char> buffer(sizeof(header) + data.length());
-    std::memcpy(buffer.data(), &header, sizeof(header));
-    std::memcpy(buffer.data() + sizeof(header), data.c_str(), data.length());
+    std::vector<char> buffer = make_text_package(type, data);
     
     ssize_t sent_bytes = send(sock, buffer.data(), buffer.size(), 0);
     if(sent_bytes < 0) {
@@ -22,7 +18,7 @@ void send_package(int sock, int type, const std::string& data) {
     }else{
         // 不要输出type值，根据枚举类型输出不同的信息
         std::cout << "[Client]: Sent packet Type=" << (type == MSG_LOGIN ? "LOGIN" : type == MSG_CHAT ? "CHAT" : type == MSG_FILE ? "FILE" : type == MSG_PROGRESS ? "PROGRESS" : "UNKNOWN")
-                  << ", Length=" << header.length 
+                  << ", Length=" << data.length() 
                   << ", Body='" << data << "'" << std::endl;
 
     }
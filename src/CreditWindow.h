@@ -0,0 +1,74 @@
+#ifndef CREDITWINDOW_H
+#define CREDITWINDOW_H
+
+#include <cstdint>
+#include <mutex>
+#include <condition_variable>
+
+// 一个传输的发送额度（字节）。收数据的一方在接受传输时给出初始额度，之后每写完一部分数据
+// 就用 MSG_CREDIT 把这部分额度还给发送方；发送方每发一个数据块先扣额度，不够就等。
+// 这样一个传输在路上（对方的 socket 缓冲区、写盘队列里）最多压着 window 字节，
+// 同一条连接上的其他传输不会被一个写不动的传输堵住，每一跳占用的内存都有上限。
+// window 要大于 带宽 × RTT，否则链路跑不满
+class CreditWindow {
+public:
+    explicit CreditWindow(uint64_t initial) : available_(initial) {}
+
+    // 禁止拷贝
+    CreditWindow(const CreditWindow& other) = delete;
+    CreditWindow& operator=(const CreditWindow& other) = delete;
+
+    void grant(uint64_t bytes) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        available_ += bytes;
+        changed_.notify_all();
+    }
+
+    // 扣掉 bytes 字节的额度，不够就等对方还回来。关闭后返回 false
+    bool acquire(uint64_t bytes) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        changed_.wait(lock, [this, bytes] { return closed_ || available_ >= bytes; });
+        if (closed_) {
+            return false;
+        }
+        available_ -= bytes;
+        return true;
+    }
+
+    // 连接断开时调用，叫醒所有在等额度的发送线程
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+        changed_.notify_all();
+    }
+
+private:
+    uint64_t available_;
+    bool closed_ = false;
+    std::mutex mutex_;
+    std::condition_variable changed_;
+};
+
+// 收数据的一方：累计已经写完的字节数，攒够 step 才还一次额度，不用每个数据块都回一个包。
+// step 加上最大数据块要小于 window，否则发送方可能在等一笔还没攒够的额度
+class CreditReturn {
+public:
+    explicit CreditReturn(uint32_t step) : step_(step) {}
+
+    // 返回这次要还给发送方的字节数，0 表示还没攒够
+    uint32_t add(uint64_t bytes) {
+        pending_ += bytes;
+        if (pending_ < step_) {
+            return 0;
+        }
+        uint32_t grant = (uint32_t)pending_;
+        pending_ = 0;
+        return grant;
+    }
+
+private:
+    uint32_t step_;
+    uint64_t pending_ = 0;
+};
+
+#endif // CREDITWINDOW_H
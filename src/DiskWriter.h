@@ -0,0 +1,102 @@
+#ifndef DISKWRITER_H
+#define DISKWRITER_H
+
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <functional>
+#include <condition_variable>
+
+// 接收文件用的写盘线程：网络线程把收到的数据块放进队列后马上回去收包，
+// 磁盘慢的时候也不会耽误聊天消息，TCP 接收窗口也不会因此缩小。
+// 缓冲区写完后放回池里复用，不用每个数据块都重新分配内存。
+// 队列里待写的字节数超过 budget 时 submit 才会阻塞，这时的背压是有意的：磁盘确实跟不上了。
+class DiskWriter {
+public:
+    using Buffer = std::vector<char>;
+    using Handler = std::function<void(Buffer& buffer)>;
+
+    DiskWriter(size_t budget, Handler handler)
+        : budget_(budget), handler_(std::move(handler)), thread_(&DiskWriter::run, this) {}
+
+    ~DiskWriter() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        not_empty_.notify_one();
+        thread_.join(); // 队列里剩下的数据先写完
+    }
+
+    // 禁止拷贝
+    DiskWriter(const DiskWriter& other) = delete;
+    DiskWriter& operator=(const DiskWriter& other) = delete;
+
+    // 从池里取一个空缓冲区，池空了就新建
+    Buffer acquire() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (pool_.empty()) {
+            return Buffer();
+        }
+        Buffer buffer = std::move(pool_.back());
+        pool_.pop_back();
+        return buffer;
+    }
+
+    // 交给写盘线程。超过预算时等写盘线程腾出空间；单个缓冲区比预算还大时也能放进去
+    void submit(Buffer&& buffer) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_full_.wait(lock, [this, &buffer] {
+            return queue_.empty() || pending_bytes_ + buffer.size() <= budget_;
+        });
+        pending_bytes_ += buffer.size();
+        queue_.push_back(std::move(buffer));
+        not_empty_.notify_one();
+    }
+
+    size_t pending_bytes() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return pending_bytes_;
+    }
+
+private:
+    static const size_t MAX_POOLED = 64; // 池里最多留多少个缓冲区
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            not_empty_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+            if (queue_.empty()) {
+                return; // stop_ 且已经写完
+            }
+            Buffer buffer = std::move(queue_.front());
+            queue_.pop_front();
+            size_t size = buffer.size();
+
+            lock.unlock();
+            handler_(buffer); // 写盘时不持有锁，网络线程可以继续放数据
+            lock.lock();
+
+            pending_bytes_ -= size;
+            if (pool_.size() < MAX_POOLED) {
+                buffer.clear(); // 保留容量
+                pool_.push_back(std::move(buffer));
+            }
+            not_full_.notify_all();
+        }
+    }
+
+    std::deque<Buffer> queue_;
+    std::vector<Buffer> pool_;
+    size_t pending_bytes_ = 0;
+    size_t budget_;
+    bool stop_ = false;
+    Handler handler_;
+    mutable std::mutex mutex_;
+    std::condition_variable not_empty_;
+    std::condition_variable not_full_;
+    std::thread thread_; // 放在最后，保证其他成员先初始化好再启动线程
+};
+
+#endif // DISKWRITER_H
@@ -0,0 +1,368 @@
+#ifndef FILESTORE_H
+#define FILESTORE_H
+
+#include <map>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "Sha256.h"
+#include "PieceMap.h"
+
+// 服务器端的内容寻址存储：
+//   root/objects/ab/<block hash>  数据块，按内容的 SHA-256 命名，相同内容只存一份
+//   root/files/<file hash>        清单：文件大小 + 按顺序排列的数据块哈希
+//   root/uploads/<file hash>.part 上传中的文件（spill 文件），收齐并校验后再切块入库
+//   root/uploads/<file hash>.map  上传中文件的分片位图，上传者断线重连后只补传缺少的分片
+// 数据块和断点续传的分片一样大，都是 FILE_PIECE_SIZE。
+// 上传数据只落盘一次，每个接收方各自从 .part 里按自己的进度读取，不用等上传结束。
+
+// wait_piece 的结果
+enum PieceState {
+    PIECE_READY,  // 这一片已经在 .part 里了
+    PIECE_STORED, // 整个文件已入库，改从清单读取
+    PIECE_GONE,   // 上传中断或校验失败
+};
+
+struct StoreManifest {
+    uint64_t file_size = 0;
+    std::vector<std::string> blocks;
+};
+
+class FileStore {
+public:
+    explicit FileStore(const std::string& root) : root_(root) {
+        mkdir(root_.c_str(), 0755);
+        mkdir((root_ + "/objects").c_str(), 0755);
+        mkdir((root_ + "/files").c_str(), 0755);
+        mkdir((root_ + "/uploads").c_str(), 0755);
+    }
+
+    FileStore(const FileStore& other) = delete;
+    FileStore& operator=(const FileStore& other) = delete;
+
+    bool has_file(const std::string& file_hash) const {
+        struct stat st;
+        return stat(manifest_path(file_hash).c_str(), &st) == 0;
+    }
+
+    // 同一份内容同时只允许一个上传者。have 返回之前已经收齐的分片位图
+    bool begin_upload(const std::string& file_hash, uint64_t file_size, std::vector<uint8_t>& have) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (uploads_.count(file_hash)) {
+            return false;
+        }
+        uint8_t digest[Sha256::DIGEST_SIZE];
+        if (!Sha256::from_hex(file_hash, digest)) {
+            return false;
+        }
+        Upload upload;
+        upload.fd = open(part_path(file_hash).c_str(), O_RDWR | O_CREAT, 0644);
+        if (upload.fd < 0) {
+            return false;
+        }
+        if (!upload.pieces.open(map_path(file_hash), digest, file_size)) {
+            close(upload.fd);
+            return false;
+        }
+        upload.file_size = file_size;
+        have = upload.pieces.bits();
+        uploads_[file_hash] = std::move(upload);
+        return true;
+    }
+
+    // complete 置为 true 表示整个文件已经收齐，可以调用 finish_upload。
+    // pwrite 不持锁，各个连接（和同一文件的几条并行连接）的上传同时写盘；
+    // 写的过程中 writers 不为 0，release_upload、finish_upload 等它归零再关闭 fd
+    bool write_chunk(const std::string& file_hash, uint64_t offset, const char* data, size_t len, bool& complete) {
+        complete = false;
+        int fd;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = uploads_.find(file_hash);
+            if (it == uploads_.end() || it->second.finishing || it->second.closing || len > it->second.file_size ||
+                offset > it->second.file_size - len) {
+                return false;
+            }
+            fd = it->second.fd;
+            ++it->second.writers;
+        }
+        bool written = pwrite(fd, data, len, offset) == (ssize_t)len;
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = uploads_.find(file_hash); // writers 不为 0 时不会被删掉
+        if (--it->second.writers == 0) {
+            writes_done_.notify_all();
+        }
+        if (!written || it->second.finishing || it->second.closing) {
+            return false;
+        }
+        bool piece_done = it->second.pieces.add(offset, len);
+        if (piece_done) {
+            piece_ready_.notify_all();
+        }
+        // 多条连接同时上传时，只有补齐最后一片的那次调用报告完成，入库只做一次
+        complete = piece_done && it->second.pieces.complete();
+        return true;
+    }
+
+    // 等待上传中的第 index 片收齐
+    PieceState wait_piece(const std::string& file_hash, uint32_t index) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            auto it = uploads_.find(file_hash);
+            if (it == uploads_.end()) {
+                return has_file(file_hash) ? PIECE_STORED : PIECE_GONE;
+            }
+            if (it->second.pieces.has_piece(index)) {
+                return PIECE_READY;
+            }
+            piece_ready_.wait(lock);
+        }
+    }
+
+    // 从 .part 读出一整片。上传刚好结束、.part 已删除时返回 false，改读清单即可
+    bool read_spill(const std::string& file_hash, uint32_t index, uint64_t file_size, std::vector<char>& data) const {
+        int fd = open(part_path(file_hash).c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        data.resize(PieceMap::piece_length(file_size, index));
+        bool ok = pread(fd, data.data(), data.size(), (uint64_t)index * FILE_PIECE_SIZE) == (ssize_t)data.size();
+        close(fd);
+        return ok;
+    }
+
+    bool upload_complete(const std::string& file_hash) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = uploads_.find(file_hash);
+        return it != uploads_.end() && it->second.pieces.complete();
+    }
+
+    // 校验整个文件的哈希，然后切块写入 objects 并生成清单。
+    // 清单写好之前上传一直留在 uploads_ 里，正在读 .part 的接收方不会中断
+    bool finish_upload(const std::string& file_hash, size_t* new_blocks = nullptr) {
+        int fd;
+        uint64_t file_size;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            auto it = uploads_.find(file_hash);
+            if (it == uploads_.end() || it->second.finishing || it->second.closing) {
+                return false;
+            }
+            it->second.finishing = true;
+            // 并行连接上还在写的重复数据块写完再开始读
+            writes_done_.wait(lock, [&it] { return it->second.writers == 0; });
+            fd = it->second.fd;
+            file_size = it->second.file_size;
+        }
+
+        StoreManifest manifest;
+        manifest.file_size = file_size;
+        Sha256 file_hasher;
+        std::vector<char> block(FILE_PIECE_SIZE);
+        size_t stored = 0;
+        bool ok = true;
+        for (uint64_t offset = 0; offset < file_size && ok; offset += FILE_PIECE_SIZE) {
+            size_t len = (size_t)std::min<uint64_t>(FILE_PIECE_SIZE, file_size - offset);
+            if (pread(fd, block.data(), len, offset) != (ssize_t)len) {
+                ok = false;
+                break;
+            }
+            file_hasher.update(block.data(), len);
+
+            Sha256 block_hasher;
+            block_hasher.update(block.data(), len);
+            uint8_t digest[Sha256::DIGEST_SIZE];
+            block_hasher.final(digest);
+            std::string block_hash = Sha256::to_hex(digest);
+            manifest.blocks.push_back(block_hash);
+
+            // 已经存在的块直接复用，这就是去重
+            struct stat st;
+            if (stat(object_path(block_hash).c_str(), &st) != 0) {
+                ok = write_file_atomic(object_path(block_hash), block.data(), len);
+                ++stored;
+            }
+        }
+
+        uint8_t digest[Sha256::DIGEST_SIZE];
+        file_hasher.final(digest);
+        ok = ok && Sha256::to_hex(digest) == file_hash; // 内容和声明的哈希对不上就丢弃
+        if (ok) {
+            std::string text = std::to_string(manifest.file_size) + "\n";
+            for (const auto& block_hash : manifest.blocks) {
+                text += block_hash + "\n";
+            }
+            ok = write_file_atomic(manifest_path(file_hash), text.data(), text.size());
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = uploads_.find(file_hash);
+            close(it->second.fd);
+            it->second.pieces.remove();
+            unlink(part_path(file_hash).c_str());
+            uploads_.erase(it);
+        }
+        piece_ready_.notify_all();
+        if (ok && new_blocks) {
+            *new_blocks = stored;
+        }
+        return ok;
+    }
+
+    // 上传前不知道内容哈希的文件（老客户端发来的）先写进 uploads/ 下的临时文件，收完算出哈希后交给 import_file
+    int create_temp(std::string& path) const {
+        std::string pattern = root_ + "/uploads/legacy-XXXXXX";
+        std::vector<char> name(pattern.begin(), pattern.end());
+        name.push_back('\0');
+        int fd = mkstemp(name.data());
+        if (fd >= 0) {
+            path = name.data();
+        }
+        return fd;
+    }
+
+    // 把写好的临时文件当成一次完整的上传入库，然后删掉临时文件。
+    // 已经有这份内容，或者别人正在上传同样的内容时什么都不做，也返回 true
+    bool import_file(const std::string& path, const std::string& file_hash, uint64_t file_size,
+                     size_t* new_blocks = nullptr) {
+        std::vector<uint8_t> have;
+        bool ok = true;
+        if (!has_file(file_hash) && begin_upload(file_hash, file_size, have)) {
+            int fd = open(path.c_str(), O_RDONLY);
+            ok = fd >= 0;
+            std::vector<char> piece(FILE_PIECE_SIZE);
+            for (uint64_t offset = 0; offset < file_size && ok; offset += FILE_PIECE_SIZE) {
+                size_t len = (size_t)std::min<uint64_t>(FILE_PIECE_SIZE, file_size - offset);
+                bool complete = false;
+                ok = pread(fd, piece.data(), len, offset) == (ssize_t)len &&
+                     write_chunk(file_hash, offset, piece.data(), len, complete);
+            }
+            if (fd >= 0) {
+                close(fd);
+            }
+            // 之前断线留下的分片也算，所以不看 write_chunk 的 complete
+            if (ok && upload_complete(file_hash)) {
+                ok = finish_upload(file_hash, new_blocks);
+            } else {
+                release_upload(file_hash);
+                ok = false;
+            }
+        } else if (new_blocks) {
+            *new_blocks = 0;
+        }
+        unlink(path.c_str());
+        return ok;
+    }
+
+    // 上传者断线时关闭上传，.part 和 .map 留在磁盘上等待续传
+    void release_upload(const std::string& file_hash) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        auto it = uploads_.find(file_hash);
+        if (it == uploads_.end() || it->second.closing) {
+            return;
+        }
+        if (it->second.finishing) {
+            return; // 已经收齐了，finish_upload 会收尾
+        }
+        it->second.closing = true; // 不再接受新的数据块，等正在写的写完
+        writes_done_.wait(lock, [&it] { return it->second.writers == 0; });
+        close(it->second.fd);
+        uploads_.erase(it);
+        piece_ready_.notify_all();
+    }
+
+    bool load_manifest(const std::string& file_hash, StoreManifest& manifest) const {
+        FILE* fp = fopen(manifest_path(file_hash).c_str(), "r");
+        if (!fp) {
+            return false;
+        }
+        manifest = StoreManifest();
+        unsigned long long size = 0;
+        bool ok = fscanf(fp, "%llu", &size) == 1;
+        manifest.file_size = size;
+        char line[Sha256::DIGEST_SIZE * 2 + 1];
+        while (ok && fscanf(fp, "%64s", line) == 1) {
+            manifest.blocks.push_back(line);
+        }
+        fclose(fp);
+        return ok;
+    }
+
+    bool read_block(const std::string& block_hash, std::vector<char>& data) const {
+        int fd = open(object_path(block_hash).c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        bool ok = fstat(fd, &st) == 0;
+        if (ok) {
+            data.resize(st.st_size);
+            ok = pread(fd, data.data(), data.size(), 0) == (ssize_t)data.size();
+        }
+        close(fd);
+        return ok;
+    }
+
+private:
+    struct Upload {
+        int fd = -1;
+        uint64_t file_size = 0;
+        PieceMap pieces;
+        bool finishing = false; // 已收齐，正在校验入库
+        bool closing = false;   // release_upload 正在等写盘结束
+        int writers = 0;        // 正在不持锁 pwrite 的 write_chunk 个数
+    };
+
+    std::string manifest_path(const std::string& file_hash) const {
+        return root_ + "/files/" + file_hash;
+    }
+
+    std::string part_path(const std::string& file_hash) const {
+        return root_ + "/uploads/" + file_hash + ".part";
+    }
+
+    std::string map_path(const std::string& file_hash) const {
+        return root_ + "/uploads/" + file_hash + ".map";
+    }
+
+    std::string object_path(const std::string& block_hash) const {
+        std::string dir = root_ + "/objects/" + block_hash.substr(0, 2);
+        mkdir(dir.c_str(), 0755);
+        return dir + "/" + block_hash;
+    }
+
+    // 先写临时文件再 rename，保证别的线程不会读到写了一半的块
+    static bool write_file_atomic(const std::string& path, const char* data, size_t len) {
+        // 两个上传同时入库、里面有相同的块时会写同一个路径，各用各的临时文件，谁后改名都一样
+        static std::atomic<uint64_t> tmp_counter{0};
+        std::string tmp = path + ".tmp" + std::to_string(tmp_counter++);
+        int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            return false;
+        }
+        bool ok = write(fd, data, len) == (ssize_t)len;
+        close(fd);
+        if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+            unlink(tmp.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    std::string root_;
+    std::map<std::string, Upload> uploads_;
+    std::mutex mutex_;
+    std::condition_variable piece_ready_; // 有分片收齐、或上传结束时通知等待的接收方
+    std::condition_variable writes_done_; // 某个上传正在写的数据块都写完了
+};
+
+#endif // FILESTORE_H
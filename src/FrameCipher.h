@@ -0,0 +1,196 @@
+#ifndef FRAMECIPHER_H
+#define FRAMECIPHER_H
+
+#ifdef HAVE_OPENSSL
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+
+// 传输加密（FEATURE_ENCRYPT）。HELLO 协商好之后双方各发一个 MSG_KEY_EXCHANGE，带上这条连接临时生成的
+// X25519 公钥，算出共享密钥后用 HKDF-SHA256 派生两个方向各自的 AES-128-GCM 密钥和 IV，双方的 HELLO 作为 salt。
+// 之后每个方向写出去的字节都是一个个记录：4 字节小端的内容长度、原地加密的内容、16 字节校验码，长度也参与校验。
+// 发送队列每次写出的一个包、合并发送的一批包就是一个记录，文件数据按 SEAL_CHUNK 分成几个记录；
+// nonce 是 IV 异或记录序号，不随记录发送，记录被改、被删、被重放、换了顺序都会校验失败，连接断开。
+// 收方整个记录校验通过后才把内容交给解包的代码。
+// OpenSSL 会按 CPU 选 AES-NI + PCLMUL（有 VAES 时用 VAES）的实现，每核每秒能加密几个 GB，比回环上的传输快。
+// 密钥用完就丢，事后拿到哪一方的数据也解不开以前的连接；但没有证书，防窃听和篡改，不防冒充服务器的中间人
+
+const size_t RECORD_HEADER = 4;
+const size_t RECORD_TAG = 16;
+const size_t RECORD_LIMIT = 16 << 20;  // 一个记录的内容最长这么多，收到更长的就是数据不对
+const size_t SEAL_CHUNK = 256 * 1024;  // 文件数据每次读出来加密这么多
+const size_t KEY_EXCHANGE_SIZE = 32;   // X25519 公钥的长度
+const size_t CIPHER_KEY_SIZE = 16;
+const size_t CIPHER_IV_SIZE = 12;
+
+// 一个方向的记录加密或解密，一个写线程或读线程一个。记录按 begin、update、finish 的顺序处理，
+// update 可以分几次调用，数据都是原地加解密
+class RecordCipher {
+public:
+    // encrypt 为 true 时加密本方发出的记录，为 false 时解密收到的
+    RecordCipher(const uint8_t* key, const uint8_t* iv, bool encrypt) : encrypt_(encrypt) {
+        std::memcpy(iv_, iv, sizeof(iv_));
+        ctx_ = EVP_CIPHER_CTX_new();
+        ok_ = ctx_ && EVP_CipherInit_ex(ctx_, EVP_aes_128_gcm(), nullptr, key, nullptr, encrypt) == 1;
+    }
+
+    ~RecordCipher() {
+        EVP_CIPHER_CTX_free(ctx_);
+    }
+
+    // 禁止拷贝
+    RecordCipher(const RecordCipher& other) = delete;
+    RecordCipher& operator=(const RecordCipher& other) = delete;
+
+    bool ok() const { return ok_; }
+
+    // 加密：开始一个内容为 length 字节的记录，记录头写进 header
+    bool begin_seal(size_t length, char* header) {
+        if (length > RECORD_LIMIT) {
+            return false;
+        }
+        for (size_t i = 0; i < RECORD_HEADER; ++i) {
+            header[i] = (char)(length >> (8 * i));
+        }
+        return start(header);
+    }
+
+    // 解密：读到记录头之后调用，length 返回内容的长度（后面还有校验码）
+    bool begin_open(const char* header, size_t& length) {
+        length = 0;
+        for (size_t i = 0; i < RECORD_HEADER; ++i) {
+            length |= (size_t)(uint8_t)header[i] << (8 * i);
+        }
+        return length <= RECORD_LIMIT && start(header);
+    }
+
+    bool update(char* data, size_t length) {
+        while (length > 0) {
+            int piece = (int)std::min<size_t>(length, 1 << 30);
+            int out = 0;
+            if (EVP_CipherUpdate(ctx_, (unsigned char*)data, &out, (const unsigned char*)data, piece) != 1) {
+                return false;
+            }
+            data += piece;
+            length -= piece;
+        }
+        return true;
+    }
+
+    // 加密时把校验码写进 tag；解密时核对 tag，对不上返回 false
+    bool finish(char* tag) {
+        unsigned char rest[16];
+        int out = 0;
+        if (encrypt_) {
+            return EVP_CipherFinal_ex(ctx_, rest, &out) == 1 &&
+                   EVP_CIPHER_CTX_ctrl(ctx_, EVP_CTRL_GCM_GET_TAG, RECORD_TAG, tag) == 1;
+        }
+        return EVP_CIPHER_CTX_ctrl(ctx_, EVP_CTRL_GCM_SET_TAG, RECORD_TAG, tag) == 1 &&
+               EVP_CipherFinal_ex(ctx_, rest, &out) == 1;
+    }
+
+private:
+    // 换上这个记录的 nonce，记录头作为附加数据参与校验
+    bool start(const char* header) {
+        unsigned char nonce[CIPHER_IV_SIZE];
+        std::memcpy(nonce, iv_, sizeof(nonce));
+        for (int i = 0; i < 8; ++i) {
+            nonce[CIPHER_IV_SIZE - 1 - i] ^= (unsigned char)(sequence_ >> (8 * i));
+        }
+        ++sequence_;
+        int out = 0;
+        return ok_ && EVP_CipherInit_ex(ctx_, nullptr, nullptr, nullptr, nonce, -1) == 1 &&
+               EVP_CipherUpdate(ctx_, nullptr, &out, (const unsigned char*)header, RECORD_HEADER) == 1;
+    }
+
+    EVP_CIPHER_CTX* ctx_;
+    bool encrypt_;
+    bool ok_;
+    unsigned char iv_[CIPHER_IV_SIZE];
+    uint64_t sequence_ = 0; // 这个方向的记录序号
+};
+
+// 一次 X25519 密钥交换：构造时生成临时密钥对，公钥发给对方，收到对方的公钥后派生两个方向的 RecordCipher
+class KeyExchange {
+public:
+    KeyExchange() {
+        EVP_PKEY_CTX* ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_X25519, nullptr);
+        size_t size = sizeof(public_key_);
+        ok_ = ctx && EVP_PKEY_keygen_init(ctx) == 1 && EVP_PKEY_keygen(ctx, &key_) == 1 &&
+              EVP_PKEY_get_raw_public_key(key_, public_key_, &size) == 1 && size == sizeof(public_key_);
+        EVP_PKEY_CTX_free(ctx);
+    }
+
+    ~KeyExchange() {
+        EVP_PKEY_free(key_);
+    }
+
+    // 禁止拷贝
+    KeyExchange(const KeyExchange& other) = delete;
+    KeyExchange& operator=(const KeyExchange& other) = delete;
+
+    bool ok() const { return ok_; }
+    const uint8_t* public_key() const { return public_key_; }
+
+    // 用对方的公钥算出共享密钥，派生密钥。client 表示本方是客户端；salt 是双方都看到的握手内容（HELLO），
+    // 两边的不一样时派生出的密钥也不一样；send 加密本方发出的数据，receive 解密收到的。
+    // 对方的公钥不对（比如算出全 0 的共享密钥）时返回 false
+    bool derive(const uint8_t* peer_key, bool client, const void* salt, size_t salt_size,
+                std::unique_ptr<RecordCipher>& send, std::unique_ptr<RecordCipher>& receive) {
+        uint8_t secret[32];
+        size_t secret_size = sizeof(secret);
+        EVP_PKEY* peer = EVP_PKEY_new_raw_public_key(EVP_PKEY_X25519, nullptr, peer_key, KEY_EXCHANGE_SIZE);
+        EVP_PKEY_CTX* ctx = ok_ && peer ? EVP_PKEY_CTX_new(key_, nullptr) : nullptr;
+        bool ok = ctx && EVP_PKEY_derive_init(ctx) == 1 && EVP_PKEY_derive_set_peer(ctx, peer) == 1 &&
+                  EVP_PKEY_derive(ctx, secret, &secret_size) == 1;
+        EVP_PKEY_CTX_free(ctx);
+        EVP_PKEY_free(peer);
+
+        // 双方的公钥（客户端的在前）放进 info，两个方向的密钥、IV 依次派生出来
+        static const char LABEL[] = "SocketChatSystem transport";
+        uint8_t info[sizeof(LABEL) - 1 + 2 * KEY_EXCHANGE_SIZE];
+        std::memcpy(info, LABEL, sizeof(LABEL) - 1);
+        std::memcpy(info + sizeof(LABEL) - 1, client ? public_key_ : peer_key, KEY_EXCHANGE_SIZE);
+        std::memcpy(info + sizeof(LABEL) - 1 + KEY_EXCHANGE_SIZE, client ? peer_key : public_key_, KEY_EXCHANGE_SIZE);
+        uint8_t keys[2 * (CIPHER_KEY_SIZE + CIPHER_IV_SIZE)];
+        ok = ok && hkdf(secret, secret_size, salt, salt_size, info, sizeof(info), keys, sizeof(keys));
+        if (ok) {
+            const uint8_t* to_server = keys;
+            const uint8_t* to_client = keys + CIPHER_KEY_SIZE + CIPHER_IV_SIZE;
+            const uint8_t* out = client ? to_server : to_client;
+            const uint8_t* in = client ? to_client : to_server;
+            send.reset(new RecordCipher(out, out + CIPHER_KEY_SIZE, true));
+            receive.reset(new RecordCipher(in, in + CIPHER_KEY_SIZE, false));
+            ok = send->ok() && receive->ok();
+        }
+        OPENSSL_cleanse(secret, sizeof(secret));
+        OPENSSL_cleanse(keys, sizeof(keys));
+        return ok;
+    }
+
+private:
+    static bool hkdf(const uint8_t* secret, size_t secret_size, const void* salt, size_t salt_size,
+                     const uint8_t* info, size_t info_size, uint8_t* out, size_t out_size) {
+        EVP_PKEY_CTX* ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, nullptr);
+        bool ok = ctx && EVP_PKEY_derive_init(ctx) == 1 && EVP_PKEY_CTX_set_hkdf_md(ctx, EVP_sha256()) == 1 &&
+                  EVP_PKEY_CTX_set1_hkdf_salt(ctx, (const unsigned char*)salt, (int)salt_size) == 1 &&
+                  EVP_PKEY_CTX_set1_hkdf_key(ctx, secret, secret_size) == 1 &&
+                  EVP_PKEY_CTX_add1_hkdf_info(ctx, info, info_size) == 1 &&
+                  EVP_PKEY_derive(ctx, out, &out_size) == 1;
+        EVP_PKEY_CTX_free(ctx);
+        return ok;
+    }
+
+    EVP_PKEY* key_ = nullptr;
+    uint8_t public_key_[KEY_EXCHANGE_SIZE] = {};
+    bool ok_;
+};
+
+#endif // HAVE_OPENSSL
+
+#endif // FRAMECIPHER_H
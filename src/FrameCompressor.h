@@ -0,0 +1,170 @@
+#ifndef FRAMECOMPRESSOR_H
+#define FRAMECOMPRESSOR_H
+
+#ifdef HAVE_ZLIB
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <zlib.h>
+#include "Protocol.h"
+#include "MessageCodec.h"
+
+// 小包压缩（FEATURE_DEFLATE）。聊天消息很短，重复的多是用户名、表情、常用语，一条一条单独压几乎压不小，
+// 所以两边先装入同一份预置字典，每个方向一个 deflate 流，跨包保留上下文：后面的消息可以引用字典和前面发过的内容。
+// 压缩的是按连接版本编码好的完整帧，结果放进一个 MSG_COMPRESSED 帧；每个包用 Z_SYNC_FLUSH 收尾，
+// 接收方收到一个就能解一个，收尾固定的 00 00 ff ff 不发，解的时候补上。
+// 短于 COMPRESS_MIN 的帧不压、也不进上下文。两边的上下文要按同样的顺序喂数据，
+// 所以压缩放在发送线程里，按包真正写出去的顺序做（见 SendQueue::set_filter）
+
+const size_t COMPRESS_MIN = 16;          // 再短的帧压缩后省下的还不够 MSG_COMPRESSED 的帧头
+const int COMPRESS_WINDOW_BITS = 13;     // 8KB 的历史窗口，字典也要放得进去
+const int COMPRESS_MEM_LEVEL = 5;        // 每个方向的压缩流大约 48KB 内存，解压流 8KB 多
+const size_t DECOMPRESS_LIMIT = 1 << 20; // 一个帧解出来最多这么大，防止压缩炸弹
+
+// 预置字典：按聊天里常见的内容整理，越常见的放得越靠后（距离近，编码更短）。
+// 两边必须一字不差，内容改了就是另一种格式，要换一个功能位
+const char COMPRESS_DICTIONARY[] =
+    ".txt.pdf.doc.docx.xls.xlsx.ppt.pptx.zip.rar.7z.tar.gz.mp3.mp4.mov.avi.jpg.jpeg.png.gif.heic"
+    "https://http://www.github.com/ .com .cn "
+    "error failed crash bug fix build test release deploy server client network connection "
+    "meeting tomorrow today tonight morning afternoon weekend lunch dinner coffee "
+    "please could you can you would you let me know when where what why how "
+    "I think I don't know I'm not sure I will I'll I've I'd we're you're it's that's there's "
+    "the file the server the message the link check it out take a look sounds good "
+    "no problem of course got it see you later talk later good night good morning "
+    "thank you thanks a lot thx sorry yes no ok okay sure lol haha hahaha "
+    "文件 图片 链接 服务器 客户端 发送 接收 下载 上传 连接 断开 失败 成功 错误 "
+    "明天 今天 晚上 早上 下午 周末 开会 吃饭 "
+    "可以 不行 没问题 好的 收到 知道了 谢谢 不客气 对不起 没关系 怎么了 为什么 什么时候 "
+    "我觉得 你看一下 等一下 马上 稍等 辛苦了 哈哈哈 哈哈 嗯嗯 好 "
+    "\xF0\x9F\x98\x82\xF0\x9F\x98\x8A\xF0\x9F\x98\x8D\xF0\x9F\x98\x85\xF0\x9F\x98\xAD\xF0\x9F\xA4\x94"
+    "\xF0\x9F\x99\x8F\xF0\x9F\x8E\x89\xF0\x9F\x94\xA5\xE2\x9D\xA4\xEF\xB8\x8F\xF0\x9F\x91\x8D "
+    " connected disconnected: ";
+
+// 一个方向的压缩流，只在发送线程里用
+class FrameCompressor {
+public:
+    explicit FrameCompressor(int version) : version_(version) {
+        stream_ = z_stream();
+        ok_ = deflateInit2(&stream_, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -COMPRESS_WINDOW_BITS, COMPRESS_MEM_LEVEL,
+                           Z_DEFAULT_STRATEGY) == Z_OK;
+        ok_ = ok_ && deflateSetDictionary(&stream_, (const Bytef*)COMPRESS_DICTIONARY,
+                                          sizeof(COMPRESS_DICTIONARY) - 1) == Z_OK;
+    }
+
+    ~FrameCompressor() {
+        deflateEnd(&stream_);
+    }
+
+    // 禁止拷贝
+    FrameCompressor(const FrameCompressor& other) = delete;
+    FrameCompressor& operator=(const FrameCompressor& other) = delete;
+
+    // 把一个完整帧换成 MSG_COMPRESSED 帧，短于 COMPRESS_MIN 的原样不动。
+    // 出错时返回 false，流已经坏了，连接不能再用
+    bool compress(std::vector<char>& frame) {
+        if (frame.size() < COMPRESS_MIN) {
+            return true;
+        }
+        if (!ok_) {
+            return false;
+        }
+        buffer_.resize(V2_MAX_HEADER + frame.size() + frame.size() / 8 + 64);
+        stream_.next_in = (Bytef*)frame.data();
+        stream_.avail_in = frame.size();
+        size_t produced = V2_MAX_HEADER;
+        // 输出缓冲区装不下时（不可压缩的数据）加大再接着压
+        do {
+            if (produced == buffer_.size()) {
+                buffer_.resize(buffer_.size() * 2);
+            }
+            stream_.next_out = (Bytef*)buffer_.data() + produced;
+            stream_.avail_out = buffer_.size() - produced;
+            int result = deflate(&stream_, Z_SYNC_FLUSH);
+            if (result != Z_OK && result != Z_BUF_ERROR) { // Z_BUF_ERROR：上一轮正好写满，已经没有要输出的了
+                ok_ = false;
+                return false;
+            }
+            produced = buffer_.size() - stream_.avail_out;
+        } while (stream_.avail_out == 0);
+        produced -= 4; // Z_SYNC_FLUSH 结尾固定是 00 00 ff ff
+        char header[V2_MAX_HEADER];
+        size_t header_size = put_frame_header(version_, MSG_COMPRESSED, produced - V2_MAX_HEADER, header);
+        size_t start = V2_MAX_HEADER - header_size;
+        std::memcpy(buffer_.data() + start, header, header_size);
+        frame.assign(buffer_.begin() + start, buffer_.begin() + produced);
+        return true;
+    }
+
+private:
+    int version_;
+    z_stream stream_;
+    bool ok_;
+    std::vector<char> buffer_;
+};
+
+// 一个方向的解压流，只在读这条连接的线程里用
+class FrameDecompressor {
+public:
+    FrameDecompressor() {
+        stream_ = z_stream();
+        ok_ = inflateInit2(&stream_, -COMPRESS_WINDOW_BITS) == Z_OK;
+        ok_ = ok_ && inflateSetDictionary(&stream_, (const Bytef*)COMPRESS_DICTIONARY,
+                                          sizeof(COMPRESS_DICTIONARY) - 1) == Z_OK;
+    }
+
+    ~FrameDecompressor() {
+        inflateEnd(&stream_);
+    }
+
+    // 禁止拷贝
+    FrameDecompressor(const FrameDecompressor& other) = delete;
+    FrameDecompressor& operator=(const FrameDecompressor& other) = delete;
+
+    // body 是 MSG_COMPRESSED 的包体，解出原来的完整帧放进 frame。
+    // 数据不对时返回 false，流已经坏了，之后的压缩包都解不出来
+    bool decompress(const char* body, size_t length, std::vector<char>& frame) {
+        static const char SYNC_TAIL[] = {0, 0, (char)0xff, (char)0xff};
+        if (!ok_) {
+            return false;
+        }
+        frame.resize(std::max<size_t>(length * 4, 256));
+        size_t produced = 0;
+        const char* inputs[] = {body, SYNC_TAIL};
+        size_t lengths[] = {length, sizeof(SYNC_TAIL)};
+        for (int i = 0; i < 2; ++i) {
+            stream_.next_in = (Bytef*)inputs[i];
+            stream_.avail_in = lengths[i];
+            // 输入没喂完、或者输出缓冲区满了（可能还有没吐出来的）就接着解
+            do {
+                if (produced == frame.size()) {
+                    if (frame.size() >= DECOMPRESS_LIMIT) {
+                        ok_ = false;
+                        return false;
+                    }
+                    frame.resize(std::min(frame.size() * 2, DECOMPRESS_LIMIT));
+                }
+                stream_.next_out = (Bytef*)frame.data() + produced;
+                stream_.avail_out = frame.size() - produced;
+                int result = inflate(&stream_, Z_SYNC_FLUSH);
+                produced = frame.size() - stream_.avail_out;
+                if (result != Z_OK && result != Z_BUF_ERROR) {
+                    ok_ = false;
+                    return false;
+                }
+            } while (stream_.avail_in > 0 || stream_.avail_out == 0);
+        }
+        frame.resize(produced);
+        return true;
+    }
+
+private:
+    z_stream stream_;
+    bool ok_;
+};
+
+#endif // HAVE_ZLIB
+
+#endif // FRAMECOMPRESSOR_H
@@ -0,0 +1,567 @@
+#ifndef MESSAGECODEC_H
+#define MESSAGECODEC_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "Protocol.h"
+
+// 消息编解码。每种消息在 MessageLayout 里按 v2 的顺序把字段描述一次，
+// v1（结构体原样）和 v2（逐个字段紧凑编码，见 ProtocolV2.h）的编码、解码都由模板按描述生成，
+// 直接写进调用方给的缓冲区，需要多大在编译期就能算出来（v2_frame_capacity）。
+// 描述漏了字段、结构体里有填充、变长字段不在最后，都会编译失败。
+
+// v1 直接发送内存里的结构体，线路上约定是小端
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "v1 的结构体按小端原样发送，大端机器要先加字节序转换");
+static_assert(sizeof(Header) == 5, "Header 必须是紧凑的 5 字节");
+static_assert(MSG_TYPE_COUNT <= 0x80, "v2 的消息类型要能放进一个字节的 varint");
+
+const size_t V2_MAX_HEADER = 1 + 5; // 类型 1 字节，包体长度最多 5 字节的 varint
+
+constexpr size_t varint_size(uint64_t value) {
+    size_t size = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        ++size;
+    }
+    return size;
+}
+
+// bytes 字节的整数写成 varint 最多占几个字节
+constexpr size_t varint_max_size(size_t bytes) {
+    return (bytes * 8 + 6) / 7;
+}
+
+inline char* put_varint(char* out, uint64_t value) {
+    while (value >= 0x80) {
+        *out++ = (char)(value | 0x80);
+        value >>= 7;
+    }
+    *out++ = (char)value;
+    return out;
+}
+
+// 定长整数按小端写，不依赖本机字节序
+inline char* put_fixed(char* out, uint64_t value, size_t bytes) {
+    for (size_t i = 0; i < bytes; ++i) {
+        *out++ = (char)(value >> (8 * i));
+    }
+    return out;
+}
+
+// 解码的数据来源：内存里的包体。流式的来源（比如直接从 socket 读）提供同样的 read/remaining/rest
+class BufferSource {
+public:
+    BufferSource(const char* data, size_t length) : data_(data), end_(data + length) {}
+
+    bool read(void* out, size_t length) {
+        if (length > remaining()) {
+            return false;
+        }
+        std::memcpy(out, data_, length);
+        data_ += length;
+        return true;
+    }
+
+    bool skip(size_t length) {
+        if (length > remaining()) {
+            return false;
+        }
+        data_ += length;
+        return true;
+    }
+
+    size_t remaining() const { return end_ - data_; }
+    const char* rest() const { return data_; } // 流式来源返回 nullptr，剩下的由调用方自己读
+
+private:
+    const char* data_;
+    const char* end_;
+};
+
+template <typename Source>
+bool get_varint(Source& in, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        uint8_t byte;
+        if (!in.read(&byte, 1)) {
+            return false;
+        }
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// 帧头写进 out（至少 V2_MAX_HEADER 字节）：v1 是 Header，v2 是 varint 类型 + varint 包体长度。返回帧头的字节数
+inline size_t put_frame_header(int version, uint8_t type, size_t length, char* out) {
+    if (version != 2) {
+        Header header;
+        header.length = length;
+        header.type = type;
+        std::memcpy(out, &header, sizeof(header));
+        return sizeof(header);
+    }
+    char* end = put_varint(out, type);
+    end = put_varint(end, length);
+    return end - out;
+}
+
+// 按版本读一个帧头，length 是包体长度
+template <typename Source>
+bool get_frame_header(Source& in, int version, uint8_t& type, uint32_t& length) {
+    if (version != 2) {
+        Header header;
+        if (!in.read(&header, sizeof(header))) {
+            return false;
+        }
+        type = header.type;
+        length = header.length;
+        return true;
+    }
+    uint64_t raw_type = 0;
+    uint64_t raw_length = 0;
+    if (!get_varint(in, raw_type) || !get_varint(in, raw_length) || raw_type > 0xff || raw_length > UINT32_MAX) {
+        return false;
+    }
+    type = (uint8_t)raw_type;
+    length = (uint32_t)raw_length;
+    return true;
+}
+
+// 编解码时结构体以外的信息
+struct CodecContext {
+    uint32_t user_id = 0;       // Sender 字段：v2 里用户名换成服务器分配的用户编号，客户端发出的填 0
+    const char* tail = nullptr; // Tail 字段：跟在结构体后面的数据（位图、文件数据），为空时由调用方接着发
+};
+
+template <typename T>
+struct MemberOf;
+template <typename C, typename T>
+struct MemberOf<T C::*> {
+    using Type = T;
+};
+template <auto Member>
+using MemberType = typename MemberOf<decltype(Member)>::Type;
+
+// 字段描述。v1_size 是它在结构体里占的字节数，v2_max 是 v2 里最多占的字节数（不含 Tail 的数据）
+struct FieldBase {
+    static constexpr bool is_tail = false; // 变长字段，只能放在最后
+    template <typename Msg>
+    static size_t tail_length(const Msg&) { return 0; }
+};
+
+// 无符号整数，v2 里写成 varint
+template <auto Member>
+struct Varint : FieldBase {
+    using Type = MemberType<Member>;
+    static_assert(std::is_unsigned<Type>::value, "varint 字段必须是无符号整数");
+    static constexpr size_t v1_size = sizeof(Type);
+    static constexpr size_t v2_max = varint_max_size(sizeof(Type));
+
+    template <typename Msg>
+    static size_t v2_size(const Msg& msg, const CodecContext&) { return varint_size(msg.*Member); }
+    template <typename Msg>
+    static char* encode(const Msg& msg, const CodecContext&, char* out) { return put_varint(out, msg.*Member); }
+    template <typename Msg, typename Source>
+    static bool decode(Msg& msg, CodecContext&, Source& in) {
+        uint64_t value;
+        if (!get_varint(in, value) || value > std::numeric_limits<Type>::max()) {
+            return false;
+        }
+        msg.*Member = (Type)value;
+        return true;
+    }
+};
+
+// 定长的无符号整数（标志位、令牌这种不会变小的），v2 里按小端写
+template <auto Member>
+struct Fixed : FieldBase {
+    using Type = MemberType<Member>;
+    static_assert(std::is_unsigned<Type>::value, "定长字段必须是无符号整数");
+    static constexpr size_t v1_size = sizeof(Type);
+    static constexpr size_t v2_max = sizeof(Type);
+
+    template <typename Msg>
+    static size_t v2_size(const Msg&, const CodecContext&) { return sizeof(Type); }
+    template <typename Msg>
+    static char* encode(const Msg& msg, const CodecContext&, char* out) { return put_fixed(out, msg.*Member, sizeof(Type)); }
+    template <typename Msg, typename Source>
+    static bool decode(Msg& msg, CodecContext&, Source& in) {
+        uint8_t raw[sizeof(Type)];
+        if (!in.read(raw, sizeof(raw))) {
+            return false;
+        }
+        uint64_t value = 0;
+        for (size_t i = sizeof(Type); i > 0; --i) {
+            value = value << 8 | raw[i - 1];
+        }
+        msg.*Member = (Type)value;
+        return true;
+    }
+};
+
+// 原样拷贝的字节：哈希，还有本来就是网络字节序的地址和端口
+template <auto Member>
+struct Raw : FieldBase {
+    static constexpr size_t v1_size = sizeof(MemberType<Member>);
+    static constexpr size_t v2_max = v1_size;
+
+    template <typename Msg>
+    static size_t v2_size(const Msg&, const CodecContext&) { return v1_size; }
+    template <typename Msg>
+    static char* encode(const Msg& msg, const CodecContext&, char* out) {
+        std::memcpy(out, &(msg.*Member), v1_size);
+        return out + v1_size;
+    }
+    template <typename Msg, typename Source>
+    static bool decode(Msg& msg, CodecContext&, Source& in) { return in.read(&(msg.*Member), v1_size); }
+};
+
+// 发送者的名字（长度 + 定长数组），v2 里换成 ctx.user_id；解码时名字留空，编号放回 ctx.user_id
+template <auto LenMember, auto NameMember>
+struct Sender : FieldBase {
+    static constexpr size_t v1_size = sizeof(MemberType<LenMember>) + sizeof(MemberType<NameMember>);
+    static constexpr size_t v2_max = varint_max_size(sizeof(uint32_t));
+
+    template <typename Msg>
+    static size_t v2_size(const Msg&, const CodecContext& ctx) { return varint_size(ctx.user_id); }
+    template <typename Msg>
+    static char* encode(const Msg&, const CodecContext& ctx, char* out) { return put_varint(out, ctx.user_id); }
+    template <typename Msg, typename Source>
+    static bool decode(Msg&, CodecContext& ctx, Source& in) {
+        uint64_t value;
+        if (!get_varint(in, value) || value > UINT32_MAX) {
+            return false;
+        }
+        ctx.user_id = (uint32_t)value;
+        return true;
+    }
+};
+
+// 结构体里的字符串（长度 + 定长数组），v2 里放在包体最后，不带长度也不补零
+template <auto LenMember, auto TextMember>
+struct Text : FieldBase {
+    static constexpr bool is_tail = true;
+    static constexpr size_t capacity = sizeof(MemberType<TextMember>) - 1; // 留一个字节给结尾的 0
+    static constexpr size_t v1_size = sizeof(MemberType<LenMember>) + sizeof(MemberType<TextMember>);
+    static constexpr size_t v2_max = capacity;
+
+    template <typename Msg>
+    static size_t v2_size(const Msg& msg, const CodecContext&) { return length(msg); }
+    template <typename Msg>
+    static char* encode(const Msg& msg, const CodecContext&, char* out) {
+        size_t size = length(msg);
+        std::memcpy(out, msg.*TextMember, size);
+        return out + size;
+    }
+    template <typename Msg, typename Source>
+    static bool decode(Msg& msg, CodecContext&, Source& in) {
+        size_t size = std::min(in.remaining(), capacity);
+        msg.*LenMember = size;
+        return in.read(msg.*TextMember, size);
+    }
+
+private:
+    template <typename Msg>
+    static size_t length(const Msg& msg) { return std::min<size_t>(msg.*LenMember, capacity); }
+};
+
+// 跟在结构体后面的数据，LenMember 是它的长度。v2 里就是包体剩下的部分，长度由帧长度算出
+template <auto LenMember>
+struct Tail : FieldBase {
+    using Type = MemberType<LenMember>;
+    static constexpr bool is_tail = true;
+    static constexpr size_t v1_size = sizeof(Type);
+    static constexpr size_t v2_max = 0;
+
+    template <typename Msg>
+    static size_t tail_length(const Msg& msg) { return msg.*LenMember; }
+    template <typename Msg>
+    static size_t v2_size(const Msg& msg, const CodecContext&) { return msg.*LenMember; }
+    template <typename Msg>
+    static char* encode(const Msg& msg, const CodecContext& ctx, char* out) {
+        if (!ctx.tail) {
+            return out; // 数据由调用方接在后面发（比如 sendfile）
+        }
+        std::memcpy(out, ctx.tail, msg.*LenMember);
+        return out + msg.*LenMember;
+    }
+    template <typename Msg, typename Source>
+    static bool decode(Msg& msg, CodecContext& ctx, Source& in) {
+        if (in.remaining() > std::numeric_limits<Type>::max()) {
+            return false;
+        }
+        msg.*LenMember = (Type)in.remaining();
+        ctx.tail = in.rest();
+        return true;
+    }
+};
+
+template <typename... Fields>
+struct Layout {
+    static constexpr size_t v1_size = (Fields::v1_size + ...);
+    static constexpr size_t v2_max = (Fields::v2_max + ...);
+
+    static constexpr bool tail_last() {
+        constexpr bool is_tail[] = {Fields::is_tail...};
+        for (size_t i = 0; i + 1 < sizeof...(Fields); ++i) {
+            if (is_tail[i]) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    template <typename Msg>
+    static size_t v2_size(const Msg& msg, const CodecContext& ctx) { return (Fields::v2_size(msg, ctx) + ...); }
+    template <typename Msg>
+    static size_t tail_length(const Msg& msg) { return (Fields::tail_length(msg) + ...); }
+    template <typename Msg>
+    static char* encode(const Msg& msg, const CodecContext& ctx, char* out) {
+        ((out = Fields::encode(msg, ctx, out)), ...);
+        return out;
+    }
+    template <typename Msg, typename Source>
+    static bool decode(Msg& msg, CodecContext& ctx, Source& in) { return (Fields::decode(msg, ctx, in) && ...); }
+};
+
+// 每种消息的字段，按 v2 里的顺序
+template <typename Msg>
+struct MessageLayout;
+
+template <>
+struct MessageLayout<FileMsg> : Layout<Sender<&FileMsg::sender_len, &FileMsg::sender>, Varint<&FileMsg::file_size>,
+                                       Raw<&FileMsg::file_hash>, Text<&FileMsg::filename_len, &FileMsg::filename>> {};
+template <>
+struct MessageLayout<FileDataMsg>
+    : Layout<Varint<&FileDataMsg::transfer_id>, Varint<&FileDataMsg::offset>, Tail<&FileDataMsg::data_len>> {};
+template <>
+struct MessageLayout<ProgressMsg> : Layout<Sender<&ProgressMsg::sender_len, &ProgressMsg::sender>,
+                                           Varint<&ProgressMsg::total_size>, Varint<&ProgressMsg::received_size>> {};
+template <>
+struct MessageLayout<FileStatusMsg>
+    : Layout<Raw<&FileStatusMsg::file_hash>, Fixed<&FileStatusMsg::need_upload>, Varint<&FileStatusMsg::max_chunk>,
+             Varint<&FileStatusMsg::transfer_id>, Varint<&FileStatusMsg::window>, Tail<&FileStatusMsg::bitmap_len>> {};
+template <>
+struct MessageLayout<FileRequestMsg>
+    : Layout<Raw<&FileRequestMsg::file_hash>, Varint<&FileRequestMsg::p2p_port>, Fixed<&FileRequestMsg::token>,
+             Varint<&FileRequestMsg::max_chunk>, Fixed<&FileRequestMsg::streams>, Varint<&FileRequestMsg::transfer_id>,
+             Varint<&FileRequestMsg::window>, Tail<&FileRequestMsg::bitmap_len>> {};
+template <>
+struct MessageLayout<P2PConnectMsg>
+    : Layout<Raw<&P2PConnectMsg::file_hash>, Raw<&P2PConnectMsg::peer_ip>, Raw<&P2PConnectMsg::peer_port>,
+             Fixed<&P2PConnectMsg::token>, Varint<&P2PConnectMsg::max_chunk>, Varint<&P2PConnectMsg::transfer_id>,
+             Tail<&P2PConnectMsg::bitmap_len>> {};
+template <>
+struct MessageLayout<P2PHelloMsg> : Layout<Raw<&P2PHelloMsg::file_hash>, Fixed<&P2PHelloMsg::token>> {};
+template <>
+struct MessageLayout<P2PResultMsg>
+    : Layout<Raw<&P2PResultMsg::file_hash>, Fixed<&P2PResultMsg::token>, Fixed<&P2PResultMsg::success>> {};
+template <>
+struct MessageLayout<SessionMsg> : Layout<Fixed<&SessionMsg::token>> {};
+template <>
+struct MessageLayout<CreditMsg> : Layout<Varint<&CreditMsg::transfer_id>, Varint<&CreditMsg::bytes>> {};
+template <>
+struct MessageLayout<HelloMsg> : Layout<Fixed<&HelloMsg::version>, Varint<&HelloMsg::features>> {};
+template <>
+struct MessageLayout<KeyExchangeMsg> : Layout<Raw<&KeyExchangeMsg::public_key>> {};
+
+// 没有结构体的包体，分派时指向收到的包体（见 MessageDispatch.h）。v1、v2 都原样发送
+struct RawBody {
+    const char* data = nullptr;
+    size_t length = 0;
+};
+
+// LOGIN 和 CHAT 的包体是纯文本：v1 原样发送，v2 前面加上用户编号
+struct TextBody : RawBody {};
+
+// 消息类型 -> 包体的结构体，没有包体定义的类型是 void
+template <uint8_t Type>
+struct MessageOf {
+    using type = void;
+};
+template <> struct MessageOf<MSG_LOGIN> { using type = TextBody; };
+template <> struct MessageOf<MSG_CHAT> { using type = TextBody; };
+template <> struct MessageOf<MSG_FILE> { using type = FileMsg; };
+template <> struct MessageOf<MSG_FILE_DATA> { using type = FileDataMsg; };
+template <> struct MessageOf<MSG_PROGRESS> { using type = ProgressMsg; };
+template <> struct MessageOf<MSG_FILE_STATUS> { using type = FileStatusMsg; };
+template <> struct MessageOf<MSG_FILE_ACCEPT> { using type = FileRequestMsg; };
+template <> struct MessageOf<MSG_P2P_CONNECT> { using type = P2PConnectMsg; };
+template <> struct MessageOf<MSG_P2P_HELLO> { using type = P2PHelloMsg; };
+template <> struct MessageOf<MSG_P2P_RESULT> { using type = P2PResultMsg; };
+template <> struct MessageOf<MSG_SESSION> { using type = SessionMsg; };
+template <> struct MessageOf<MSG_DATA_ATTACH> { using type = SessionMsg; };
+template <> struct MessageOf<MSG_CREDIT> { using type = CreditMsg; };
+template <> struct MessageOf<MSG_HELLO> { using type = HelloMsg; };
+template <> struct MessageOf<MSG_BUNDLE> { using type = RawBody; };
+template <> struct MessageOf<MSG_COMPRESSED> { using type = RawBody; };
+template <> struct MessageOf<MSG_FILE_DATA_Z> { using type = FileDataMsg; };
+template <> struct MessageOf<MSG_KEY_EXCHANGE> { using type = KeyExchangeMsg; };
+
+// 编解码入口都经过这里，描述和结构体对不上时编译失败
+template <typename Msg>
+struct CheckedLayout : MessageLayout<Msg> {
+    static_assert(std::is_trivially_copyable<Msg>::value, "消息结构体要能按字节拷贝");
+    static_assert(MessageLayout<Msg>::v1_size == sizeof(Msg), "MessageLayout 漏了字段，或者结构体里有填充");
+    static_assert(MessageLayout<Msg>::tail_last(), "变长字段（Text、Tail）只能放在最后");
+};
+
+// 一个 v2 帧最多多大，tail_length 是 Tail 字段的数据长度（不含时传 0）
+template <typename Msg>
+constexpr size_t v2_frame_capacity(size_t tail_length = 0) {
+    return V2_MAX_HEADER + CheckedLayout<Msg>::v2_max + tail_length;
+}
+
+// 编码一个 v2 帧写进 out，返回写了多少字节。out 至少要 v2_frame_capacity<Msg>(Tail 的长度)。
+// ctx.tail 为空时只写到 Tail 的数据之前，帧头里的长度照样算上数据，由调用方接着发
+template <typename Msg>
+size_t encode_v2(uint8_t type, const Msg& msg, const CodecContext& ctx, char* out) {
+    using L = CheckedLayout<Msg>;
+    char* end = put_varint(out, type);
+    end = put_varint(end, L::v2_size(msg, ctx));
+    end = L::encode(msg, ctx, end);
+    return end - out;
+}
+
+// 从 v2 包体（或者流式来源）解出 msg。ctx.user_id 是 Sender 字段的用户编号，
+// ctx.tail 指向 Tail 的数据（流式来源为空，数据还没读）
+template <typename Msg, typename Source>
+bool decode_v2(Source& in, Msg& msg, CodecContext& ctx) {
+    msg = Msg();
+    return CheckedLayout<Msg>::decode(msg, ctx, in);
+}
+
+template <typename Msg>
+bool decode_v2(const char* body, size_t length, Msg& msg, CodecContext& ctx) {
+    BufferSource in(body, length);
+    return decode_v2(in, msg, ctx);
+}
+
+// 一个 v1 包多大（Header + 结构体 + Tail 的数据）
+template <typename Msg>
+size_t v1_frame_size(const Msg& msg) {
+    return sizeof(Header) + sizeof(Msg) + CheckedLayout<Msg>::tail_length(msg);
+}
+
+// 编码一个 v1 包写进 out（至少 v1_frame_size 字节），tail 为空时只写到 Tail 的数据之前
+template <typename Msg>
+size_t encode_v1(uint8_t type, const Msg& msg, const void* tail, char* out) {
+    size_t tail_length = CheckedLayout<Msg>::tail_length(msg);
+    Header header;
+    header.length = sizeof(Msg) + tail_length;
+    header.type = type;
+    std::memcpy(out, &header, sizeof(header));
+    std::memcpy(out + sizeof(header), &msg, sizeof(msg));
+    if (!tail) {
+        return sizeof(header) + sizeof(msg);
+    }
+    std::memcpy(out + sizeof(header) + sizeof(msg), tail, tail_length);
+    return sizeof(header) + sizeof(msg) + tail_length;
+}
+
+// 从 v1 包体解出 msg，包体太短或 Tail 的长度超出包体时返回 false。tail 不为空时指向 Tail 的数据
+template <typename Msg>
+bool decode_v1(const char* body, size_t length, Msg& msg, const char** tail = nullptr) {
+    if (length < sizeof(Msg)) {
+        return false;
+    }
+    std::memcpy(&msg, body, sizeof(msg));
+    if (length - sizeof(Msg) < CheckedLayout<Msg>::tail_length(msg)) {
+        return false;
+    }
+    if (tail) {
+        *tail = body + sizeof(Msg);
+    }
+    return true;
+}
+
+template <typename Msg>
+bool decode_v1(const std::vector<char>& body, Msg& msg, const char** tail = nullptr) {
+    return decode_v1(body.data(), body.size(), msg, tail);
+}
+
+// 完整的 v1 包，tail 是 Tail 字段的数据
+template <typename Msg>
+std::vector<char> make_package(uint8_t type, const Msg& msg, const void* tail = nullptr) {
+    std::vector<char> package(v1_frame_size(msg));
+    package.resize(encode_v1(type, msg, tail, package.data()));
+    return package;
+}
+
+// 纯文本的 v1 包（LOGIN、CHAT）
+inline std::vector<char> make_text_package(uint8_t type, const std::string& text) {
+    Header header;
+    header.length = text.size();
+    header.type = type;
+    std::vector<char> package(sizeof(header) + text.size());
+    std::memcpy(package.data(), &header, sizeof(header));
+    std::memcpy(package.data() + sizeof(header), text.data(), text.size());
+    return package;
+}
+
+// 纯文本的 v2 帧：用户编号 + 文本。out 至少 V2_MAX_HEADER + varint_max_size(4) + length
+inline size_t encode_text_v2(uint8_t type, uint32_t user_id, const char* text, size_t length, char* out) {
+    char* end = put_varint(out, type);
+    end = put_varint(end, varint_size(user_id) + length);
+    end = put_varint(end, user_id);
+    std::memcpy(end, text, length);
+    return end + length - out;
+}
+
+inline bool decode_text_v2(const char* body, size_t length, uint32_t& user_id, const char*& text, size_t& text_length) {
+    BufferSource in(body, length);
+    uint64_t value;
+    if (!get_varint(in, value) || value > UINT32_MAX) {
+        return false;
+    }
+    user_id = (uint32_t)value;
+    text = in.rest();
+    text_length = in.remaining();
+    return true;
+}
+
+// 按版本把一条消息编码成完整的包，不经过 v1 包体中转。用户编号填 0，给客户端往服务器发用
+template <typename Msg>
+std::vector<char> encode_package(int version, uint8_t type, const Msg& msg, const void* tail = nullptr) {
+    if (version != 2) {
+        return make_package(type, msg, tail);
+    }
+    CodecContext ctx;
+    ctx.tail = (const char*)tail;
+    std::vector<char> package(v2_frame_capacity<Msg>(CheckedLayout<Msg>::tail_length(msg)));
+    package.resize(encode_v2(type, msg, ctx, package.data()));
+    return package;
+}
+
+inline std::vector<char> encode_text_package(int version, uint8_t type, const std::string& text) {
+    if (version != 2) {
+        return make_text_package(type, text);
+    }
+    std::vector<char> package(V2_MAX_HEADER + varint_max_size(sizeof(uint32_t)) + text.size());
+    package.resize(encode_text_v2(type, 0, text.data(), text.size(), package.data()));
+    return package;
+}
+
+// 按消息类型编号生成的函数表，table[type] 是 Entry<type>::call。
+// 分派就是查一次表，新加消息类型只要补上 MessageOf 和 MessageLayout
+template <typename Fn, template <uint8_t> class Entry, size_t... Types>
+constexpr std::array<Fn, sizeof...(Types)> make_message_table(std::index_sequence<Types...>) {
+    return {{&Entry<(uint8_t)Types>::call...}};
+}
+
+template <typename Fn, template <uint8_t> class Entry, size_t Size = MSG_TYPE_COUNT>
+constexpr std::array<Fn, Size> make_message_table() {
+    return make_message_table<Fn, Entry>(std::make_index_sequence<Size>());
+}
+
+#endif // MESSAGECODEC_H
@@ -0,0 +1,141 @@
+#ifndef MESSAGEDISPATCH_H
+#define MESSAGEDISPATCH_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include "Protocol.h"
+#include "MessageCodec.h"
+
+// 按消息类型查表分派收到的 v1 包体，服务器和客户端共用。处理类为它关心的每种消息写一个重载：
+//     void handle(MessageTag<MSG_CHAT>, TextBody& text, const char* tail);
+// msg 是解出来的结构体（可以就地修改），tail 指向 Tail 字段的数据（位图、文件数据），没有时为空。
+// 分派表在编译期按 MessageType 生成，256 项覆盖一个字节的所有取值，分派就是一次查表加一次间接调用，
+// 新加消息类型不会多出分支。没有对应重载的类型（包括不认识的）调 unhandled(type)，
+// 包体太短、位图长度不对调 invalid(type)，包体已经读完，连接上的下一个包不受影响。
+// 编译时定义 MESSAGE_STATS 才统计每种消息的个数、字节数和处理时间（见 MessageStats）
+
+template <uint8_t Type>
+using MessageTag = std::integral_constant<uint8_t, Type>;
+
+// 日志和统计里用的消息名
+inline const char* message_name(uint8_t type) {
+    static const char* const names[] = {
+        "UNKNOWN", "LOGIN", "CHAT", "FILE", "FILE_DATA", "PROGRESS", "FILE_STATUS", "FILE_ACCEPT",
+        "P2P_CONNECT", "P2P_HELLO", "P2P_RESULT", "SESSION", "DATA_ATTACH", "CREDIT", "HELLO",
+        "BUNDLE", "COMPRESSED", "FILE_DATA_Z", "KEY_EXCHANGE",
+    };
+    static_assert(sizeof(names) / sizeof(names[0]) == MSG_TYPE_COUNT, "新加的消息类型要在这里补上名字");
+    return type < MSG_TYPE_COUNT ? names[type] : "UNKNOWN";
+}
+
+#ifdef MESSAGE_STATS
+// 每种消息收到的个数、包体字节数和处理耗时，所有连接的线程一起累加
+class MessageStats {
+public:
+    static MessageStats& instance() {
+        static MessageStats stats;
+        return stats;
+    }
+
+    void record(uint8_t type, size_t bytes, uint64_t nanos) {
+        Counter& counter = counters_[type];
+        counter.count.fetch_add(1, std::memory_order_relaxed);
+        counter.bytes.fetch_add(bytes, std::memory_order_relaxed);
+        counter.nanos.fetch_add(nanos, std::memory_order_relaxed);
+    }
+
+    // 收到过的类型，一种一行：个数、字节数、平均处理时间
+    std::string report() const {
+        std::string result;
+        for (size_t type = 0; type < counters_.size(); ++type) {
+            uint64_t count = counters_[type].count.load(std::memory_order_relaxed);
+            if (count == 0) {
+                continue;
+            }
+            uint64_t bytes = counters_[type].bytes.load(std::memory_order_relaxed);
+            uint64_t nanos = counters_[type].nanos.load(std::memory_order_relaxed);
+            result += std::string(message_name(type)) + "(" + std::to_string(type) + "): " + std::to_string(count) +
+                      " msgs, " + std::to_string(bytes) + " bytes, " + std::to_string(nanos / count) + " ns avg\n";
+        }
+        return result;
+    }
+
+private:
+    struct Counter {
+        std::atomic<uint64_t> count{0};
+        std::atomic<uint64_t> bytes{0};
+        std::atomic<uint64_t> nanos{0};
+    };
+    std::array<Counter, 256> counters_;
+};
+#endif
+
+template <typename Handler, uint8_t Type, typename = void>
+struct HasHandler : std::false_type {};
+
+template <typename Handler, uint8_t Type>
+struct HasHandler<Handler, Type,
+                  std::void_t<decltype(std::declval<Handler&>().handle(
+                      MessageTag<Type>(), std::declval<typename MessageOf<Type>::type&>(), (const char*)nullptr))>>
+    : std::true_type {};
+
+template <typename Handler>
+class MessageDispatcher {
+public:
+    static void dispatch(Handler& handler, uint8_t type, const char* body, size_t length) {
+#ifdef MESSAGE_STATS
+        auto start = std::chrono::steady_clock::now();
+        table_[type](handler, body, length);
+        auto nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+        MessageStats::instance().record(type, length, nanos.count());
+#else
+        table_[type](handler, body, length);
+#endif
+    }
+
+private:
+    using Fn = void (*)(Handler&, const char*, size_t);
+
+    template <uint8_t Type>
+    struct Entry {
+        static void call(Handler& handler, const char* body, size_t length) {
+            using Msg = typename MessageOf<Type>::type;
+            if constexpr (!HasHandler<Handler, Type>::value) {
+                handler.unhandled(Type);
+            } else if constexpr (std::is_base_of<RawBody, Msg>::value) {
+                Msg raw;
+                raw.data = body;
+                raw.length = length;
+                handler.handle(MessageTag<Type>(), raw, nullptr);
+            } else {
+                Msg msg;
+                const char* tail = nullptr;
+                if (!decode_v1(body, length, msg, &tail)) {
+                    handler.invalid(Type);
+                    return;
+                }
+                handler.handle(MessageTag<Type>(), msg, tail);
+            }
+        }
+    };
+
+    static constexpr std::array<Fn, 256> table_ = make_message_table<Fn, Entry, 256>();
+};
+
+// 把一个 v1 包体交给 handler 里对应类型的 handle
+template <typename Handler>
+void dispatch_message(Handler& handler, uint8_t type, const char* body, size_t length) {
+    MessageDispatcher<Handler>::dispatch(handler, type, body, length);
+}
+
+template <typename Handler>
+void dispatch_message(Handler& handler, uint8_t type, const std::vector<char>& body) {
+    dispatch_message(handler, type, body.data(), body.size());
+}
+
+#endif // MESSAGEDISPATCH_H
@@ -0,0 +1,215 @@
+#ifndef PIECEMAP_H
+#define PIECEMAP_H
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include "Protocol.h"
+
+// 断点续传用的分片位图：文件按 FILE_PIECE_SIZE 切片，每收齐一片就把对应的位写回磁盘。
+// 磁盘格式：MapHeader + 位图（第 i 片对应第 i/8 个字节的第 i%8 位）
+// 片内按 PIECE_BLOCK_SIZE 记录收到了哪些小块，同一段数据收到两次（比如直连和中转都发了）不会重复计数。
+// 数据块的起止位置要按 PIECE_BLOCK_SIZE 对齐（文件末尾除外）
+class PieceMap {
+public:
+    PieceMap() = default;
+    ~PieceMap() { close(); }
+
+    PieceMap(const PieceMap& other) = delete;
+    PieceMap& operator=(const PieceMap& other) = delete;
+
+    PieceMap(PieceMap&& other) noexcept { *this = std::move(other); }
+    PieceMap& operator=(PieceMap&& other) noexcept {
+        if (this != &other) {
+            close();
+            fd_ = other.fd_;
+            path_ = std::move(other.path_);
+            std::memcpy(hash_, other.hash_, sizeof(hash_));
+            size_ = other.size_;
+            bits_ = std::move(other.bits_);
+            pending_ = std::move(other.pending_);
+            done_count_ = other.done_count_;
+            received_ = other.received_;
+            other.fd_ = -1;
+        }
+        return *this;
+    }
+
+    static const uint32_t PIECE_BLOCK_SIZE = FILE_PIECE_SIZE / 64;
+
+    static uint32_t piece_count(uint64_t file_size) {
+        return (uint32_t)((file_size + FILE_PIECE_SIZE - 1) / FILE_PIECE_SIZE);
+    }
+
+    static uint32_t piece_length(uint64_t file_size, uint32_t index) {
+        uint64_t start = (uint64_t)index * FILE_PIECE_SIZE;
+        return (uint32_t)std::min<uint64_t>(FILE_PIECE_SIZE, file_size - start);
+    }
+
+    static bool test_bit(const std::vector<uint8_t>& bits, uint32_t index) {
+        return index / 8 < bits.size() && (bits[index / 8] >> (index % 8)) & 1;
+    }
+
+    // 并行传输时第 stripe 条连接（共 count 条）要跳过的分片：对方已有的，加上不归它发的。
+    // 分片轮流分给各条连接，第 k 条负责 index % count == k 的分片
+    static std::vector<uint8_t> stripe_skip(const std::vector<uint8_t>& have, uint64_t file_size,
+                                            uint32_t stripe, uint32_t count) {
+        uint32_t pieces = piece_count(file_size);
+        std::vector<uint8_t> skip(have);
+        skip.resize(std::max<size_t>(skip.size(), (pieces + 7) / 8), 0);
+        for (uint32_t index = 0; index < pieces && count > 1; ++index) {
+            if (index % count != stripe) {
+                skip[index / 8] |= 1 << (index % 8);
+            }
+        }
+        return skip;
+    }
+
+    // 打开位图；磁盘上已有同一文件的位图就沿用，否则从头开始
+    bool open(const std::string& path, const uint8_t file_hash[32], uint64_t file_size) {
+        close();
+        if (file_size > MAX_FILE_SIZE) {
+            return false;
+        }
+        if (load(path) && std::memcmp(hash_, file_hash, sizeof(hash_)) == 0 && size_ == file_size) {
+            return true;
+        }
+        close();
+        fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd_ < 0) {
+            return false;
+        }
+        path_ = path;
+        std::memcpy(hash_, file_hash, sizeof(hash_));
+        size_ = file_size;
+        reset_counters();
+        bits_.assign((piece_count(size_) + 7) / 8, 0);
+
+        MapHeader map_header = {};
+        std::memcpy(map_header.magic, "SCPM", 4);
+        std::memcpy(map_header.file_hash, hash_, sizeof(hash_));
+        map_header.file_size = size_;
+        std::vector<char> data(sizeof(map_header) + bits_.size(), 0);
+        std::memcpy(data.data(), &map_header, sizeof(map_header));
+        return pwrite(fd_, data.data(), data.size(), 0) == (ssize_t)data.size();
+    }
+
+    // 只加载已有的位图，客户端启动时用它找出没传完的文件
+    bool load(const std::string& path) {
+        close();
+        fd_ = ::open(path.c_str(), O_RDWR);
+        if (fd_ < 0) {
+            return false;
+        }
+        MapHeader map_header;
+        if (pread(fd_, &map_header, sizeof(map_header), 0) != (ssize_t)sizeof(map_header) ||
+            std::memcmp(map_header.magic, "SCPM", 4) != 0 || map_header.file_size > MAX_FILE_SIZE) {
+            close();
+            return false;
+        }
+        path_ = path;
+        std::memcpy(hash_, map_header.file_hash, sizeof(hash_));
+        size_ = map_header.file_size;
+        reset_counters();
+        bits_.assign((piece_count(size_) + 7) / 8, 0);
+        if (pread(fd_, bits_.data(), bits_.size(), sizeof(map_header)) != (ssize_t)bits_.size()) {
+            close();
+            return false;
+        }
+        for (uint32_t i = 0; i < piece_count(size_); ++i) {
+            if (has_piece(i)) {
+                ++done_count_;
+                received_ += piece_length(size_, i);
+            }
+        }
+        return true;
+    }
+
+    void close() {
+        if (fd_ >= 0) {
+            ::close(fd_);
+            fd_ = -1;
+        }
+    }
+
+    // 关闭并删除磁盘上的位图，传输完成后调用
+    void remove() {
+        close();
+        if (!path_.empty()) {
+            unlink(path_.c_str());
+        }
+    }
+
+    // 记录收到了 [offset, offset + len)，数据块不能跨片。返回 true 表示这一片刚好收齐
+    bool add(uint64_t offset, size_t len) {
+        if (len > size_ || offset > size_ - len) {
+            return false;
+        }
+        uint32_t index = (uint32_t)(offset / FILE_PIECE_SIZE);
+        if (index >= piece_count(size_) || has_piece(index)) {
+            return false;
+        }
+        uint32_t piece_len = piece_length(size_, index);
+        uint32_t begin = (uint32_t)(offset % FILE_PIECE_SIZE);
+        uint32_t end = (uint32_t)std::min<uint64_t>(begin + len, piece_len);
+        for (uint32_t block = (begin + PIECE_BLOCK_SIZE - 1) / PIECE_BLOCK_SIZE; block * PIECE_BLOCK_SIZE < end; ++block) {
+            uint32_t block_end = std::min(block * PIECE_BLOCK_SIZE + PIECE_BLOCK_SIZE, piece_len);
+            uint64_t mask = (uint64_t)1 << block;
+            if (block_end > end || (pending_[index] & mask)) {
+                continue; // 只收到一部分，或者之前已经收到过
+            }
+            pending_[index] |= mask;
+            received_ += block_end - block * PIECE_BLOCK_SIZE;
+        }
+        uint32_t block_count = (piece_len + PIECE_BLOCK_SIZE - 1) / PIECE_BLOCK_SIZE;
+        uint64_t full = block_count >= 64 ? ~(uint64_t)0 : ((uint64_t)1 << block_count) - 1;
+        if (pending_[index] == full) {
+            bits_[index / 8] |= (uint8_t)(1 << (index % 8));
+            pending_[index] = 0;
+            ++done_count_;
+            if (fd_ >= 0) {
+                pwrite(fd_, &bits_[index / 8], 1, sizeof(MapHeader) + index / 8);
+            }
+            return true;
+        }
+        return false;
+    }
+
+    bool has_piece(uint32_t index) const { return test_bit(bits_, index); }
+    bool complete() const { return done_count_ >= piece_count(size_); }
+    uint64_t file_size() const { return size_; }
+    const uint8_t* file_hash() const { return hash_; }
+    const std::vector<uint8_t>& bits() const { return bits_; }
+
+    // 已收到的字节数（含收了一半的分片），用于显示进度
+    uint64_t received_bytes() const { return received_; }
+
+private:
+#pragma pack(push, 1)
+    struct MapHeader {
+        char magic[4];
+        uint8_t file_hash[32];
+        uint64_t file_size;
+    };
+#pragma pack(pop)
+
+    void reset_counters() {
+        pending_.assign(piece_count(size_), 0);
+        done_count_ = 0;
+        received_ = 0;
+    }
+
+    int fd_ = -1;
+    std::string path_;
+    uint8_t hash_[32] = {};
+    uint64_t size_ = 0;
+    std::vector<uint8_t> bits_;
+    std::vector<uint64_t> pending_; // 每一片里已经收到的小块，还没收齐的片才有意义
+    uint32_t done_count_ = 0;
+    uint64_t received_ = 0;
+};
+
+#endif // PIECEMAP_H
@@ -3,6 +3,13 @@
 
 #include <cstdint>
 
+// 断点续传的最小单位：文件按 1MB 切片，用位图记录收齐了哪些分片。
+// 数据块不能跨片；服务器存储也按同样的大小切块。
+const uint32_t FILE_PIECE_SIZE = 1024 * 1024;
+
+// 能传的最大文件。大小来自对方的邀约，不设上限的话分片位图能把内存耗光
+const uint64_t MAX_FILE_SIZE = (uint64_t)1 << 40;
+
 #pragma pack(push, 1)
 
 struct Header {
@@ -16,7 +23,48 @@ enum MessageType {
     MSG_FILE = 3,        // 文件元信息（文件名、大小）
     MSG_FILE_DATA = 4,   // 文件数据块
     MSG_PROGRESS = 5,    // 进度更新
+    MSG_FILE_STATUS = 6, // 服务器回复发送方：是否需要上传文件内容
+    MSG_FILE_ACCEPT = 7, // 接收方接受文件邀约，服务器开始发送数据
+    MSG_P2P_CONNECT = 8, // 服务器让发送方直连接收方
+    MSG_P2P_HELLO = 9,   // 直连建立后发送方发的第一个包，带上一次性令牌
+    MSG_P2P_RESULT = 10, // 发送方告诉服务器直连是否成功，失败时服务器改为中转
+    MSG_SESSION = 11,    // 登录后服务器下发的会话令牌，开数据连接时用
+    MSG_DATA_ATTACH = 12, // 数据连接的第一个包，带上会话令牌；服务器原样回一个表示已绑定
+    MSG_CREDIT = 13,     // 收数据的一方还给发送方的发送额度
+    MSG_HELLO = 14,      // 连接上的第一个包，协商线路格式版本和功能
+    MSG_BUNDLE = 15,     // 几个小包合成的一帧，包体是按连接版本编码的完整帧首尾相接
+    MSG_COMPRESSED = 16, // 压缩过的一个完整帧（见 FrameCompressor.h）
+    MSG_FILE_DATA_Z = 17, // 压缩过的文件数据块，包体和 MSG_FILE_DATA 一样，数据是 deflate 压缩的（见 ChunkCompressor.h）
+    MSG_KEY_EXCHANGE = 18, // 协商了 FEATURE_ENCRYPT 时 HELLO 之后双方交换的临时公钥（见 FrameCipher.h）
+    MSG_TYPE_COUNT       // 类型的个数，新类型加在它前面（MessageCodec.h 按它生成分派表）
+};
+
+// 线路格式版本：1 是本文件里的结构体原样发送，2 见 ProtocolV2.h
+const uint8_t PROTOCOL_VERSION = 2; // 支持的最高版本
+
+// 可选功能，MSG_HELLO 里按位协商，双方都支持才用
+enum ProtocolFeature {
+    FEATURE_CREDIT = 1 << 0, // 文件数据按发送额度流控（MSG_CREDIT、window 字段）
+    FEATURE_BUNDLE = 1 << 1, // 可以收 MSG_BUNDLE（几个小包合成的一帧）
+    FEATURE_DEFLATE = 1 << 2, // 小包用预置字典的 deflate 流压缩（MSG_COMPRESSED），要编译时找到 zlib
+    FEATURE_FILE_DEFLATE = 1 << 3, // 可以收 MSG_FILE_DATA_Z（压缩过的文件数据块），要编译时找到 zlib
+    FEATURE_ENCRYPT = 1 << 4, // 交换密钥后整条连接加密（见 FrameCipher.h），要编译时找到 OpenSSL
 };
+#ifdef HAVE_ZLIB
+const uint32_t ZLIB_FEATURES = FEATURE_DEFLATE | FEATURE_FILE_DEFLATE;
+#else
+const uint32_t ZLIB_FEATURES = 0;
+#endif
+#ifdef HAVE_OPENSSL
+const uint32_t OPENSSL_FEATURES = FEATURE_ENCRYPT;
+#else
+const uint32_t OPENSSL_FEATURES = 0;
+#endif
+const uint32_t SUPPORTED_FEATURES = FEATURE_CREDIT | FEATURE_BUNDLE | ZLIB_FEATURES | OPENSSL_FEATURES;
+
+// 每个传输的发送额度（见 CreditWindow.h）：收方接受传输时给出，写完 CREDIT_STEP 字节还一次
+const uint32_t TRANSFER_WINDOW = 8 * 1024 * 1024;
+const uint32_t CREDIT_STEP = 1024 * 1024;
 
 struct LoginMsg {
     uint32_t username_len;
@@ -36,14 +84,14 @@ struct FileMsg {
     uint32_t filename_len;
     char filename[100];
     uint64_t file_size;
+    uint8_t file_hash[32]; // 文件内容的 SHA-256，服务器按它去重，接收方按它接受邀约
 };
 
-// 文件数据块消息
+// 文件数据块消息。每个数据块都带着它，所以只用一个编号指明属于哪个传输，不再重复文件名和哈希。
+// 编号由收数据的一方分配：上传时是服务器（MSG_FILE_STATUS），下载时是接收方（MSG_FILE_ACCEPT），
+// 只在收方自己那里唯一，收方按它直接查到接收中的文件
 struct FileDataMsg {
-    uint32_t sender_len;
-    char sender[20];
-    uint32_t filename_len;
-    char filename[100];
+    uint32_t transfer_id;
     uint64_t offset;      // 当前数据块在文件中的偏移量
     uint32_t data_len;    // 本次传输的数据长度
     // 后面跟随实际的数据（不在结构体中，动态分配）
@@ -57,6 +105,122 @@ struct ProgressMsg {
     uint64_t received_size;
 };
 
+// 服务器收到 MSG_FILE 后的回复，已有相同内容时发送方不必再上传
+// need_upload 为 1 时后面跟随服务器已有分片的位图，发送方只补传缺少的分片
+struct FileStatusMsg {
+    uint8_t file_hash[32];
+    uint8_t need_upload;
+    uint32_t max_chunk; // 服务器能接收的最大数据块，发送方在这个范围内自己调整块大小
+    uint32_t transfer_id; // 服务器给这次上传分配的编号，发送方填在每个数据块里
+    uint32_t window;      // 初始发送额度，之后服务器每写完一部分就用 MSG_CREDIT 补上；为 0 表示不限
+    uint32_t bitmap_len;
+};
+
+// 接收方接受 MSG_FILE 邀约，重连后也用它续传。
+// 后面跟随接收方已有分片的位图，bitmap_len 为 0 表示从头开始。
+// p2p_port 不为 0 时接收方在这个端口等待发送方直连，token 用来确认连过来的是谁。
+// max_chunk 是接收方能接收的最大数据块。
+// streams 是接收方已经开好的数据连接数，服务器把分片分到这几条连接上并行发送；为 0 时只能走登录连接。
+// transfer_id 是接收方给这个文件分配的编号，发给它的数据块都带上。
+// window 是给服务器的初始发送额度，之后接收方写完一部分就用 MSG_CREDIT 补上；为 0 表示不限
+struct FileRequestMsg {
+    uint8_t file_hash[32];
+    uint16_t p2p_port;
+    uint64_t token;
+    uint32_t max_chunk;
+    uint8_t streams;
+    uint32_t transfer_id;
+    uint32_t window;
+    uint32_t bitmap_len;
+};
+
+// 服务器转给发送方的直连请求，后面跟随接收方已有分片的位图
+struct P2PConnectMsg {
+    uint8_t file_hash[32];
+    uint32_t peer_ip;   // 接收方地址，网络字节序
+    uint16_t peer_port; // 网络字节序
+    uint64_t token;
+    uint32_t max_chunk; // 接收方能接收的最大数据块
+    uint32_t transfer_id; // 接收方分配的编号，直连发的数据块都带上
+    uint32_t bitmap_len;
+};
+
+// 直连上之后发送方先发这个包，之后都是 MSG_FILE_DATA
+struct P2PHelloMsg {
+    uint8_t file_hash[32];
+    uint64_t token;
+};
+
+struct P2PResultMsg {
+    uint8_t file_hash[32];
+    uint64_t token;
+    uint8_t success;
+};
+
+// MSG_SESSION 和 MSG_DATA_ATTACH 的包体
+struct SessionMsg {
+    uint64_t token;
+};
+
+// 客户端连上后先发这个包（总是 v1 格式），报出自己支持的最高版本和功能；
+// 服务器回一个同样的包，填上双方都支持的版本和功能，之后两边都换成这个版本。
+// 老服务器不认识 MSG_HELLO 会断开连接，客户端重连后不发 HELLO，按 v1 收发，不用任何可选功能。
+// 不发 HELLO 的老客户端在服务器看来就是 v1、没有可选功能。以后加字段只能加在末尾
+struct HelloMsg {
+    uint8_t version;
+    uint32_t features;
+};
+
+// 不发 HELLO 的老客户端能原样收发的消息，结构体一直没改过。
+// 它的 MSG_FILE、MSG_FILE_DATA 按下面的 LegacyFileMsg、LegacyFileDataMsg 排布，由服务器单独转换
+inline bool legacy_message(uint8_t type) {
+    return type == MSG_LOGIN || type == MSG_CHAT || type == MSG_HELLO || type == MSG_PROGRESS;
+}
+
+// 老客户端的文件元信息：没有内容哈希。老客户端发完它不等回复，紧接着按顺序发完所有数据块；
+// 收到它就打开 downloads/ 下的同名文件，之后的数据块按顺序追加，收够 file_size 字节算完
+struct LegacyFileMsg {
+    uint32_t sender_len;
+    char sender[20];
+    uint32_t filename_len;
+    char filename[100];
+    uint64_t file_size;
+};
+
+// 老客户端的文件数据块，每块都带着发送者和文件名，后面跟随数据。
+// 只有 v1 格式，两个变长字段没法用 MessageLayout 描述，服务器直接按结构体拷贝
+struct LegacyFileDataMsg {
+    uint32_t sender_len;
+    char sender[20];
+    uint32_t filename_len;
+    char filename[100];
+    uint64_t offset;
+    uint32_t data_len;
+};
+
+// 服务器推给老客户端的数据块大小，和老客户端自己发的一样。老客户端一次 recv 读包体，包不能太大
+const uint32_t LEGACY_CHUNK_SIZE = 4096;
+
+// 发送额度：transfer_id 这个传输又可以多发 bytes 字节。
+// bytes 为 0 表示收方不要这个传输了（建不了文件、磁盘不够），发送方停下，不用再等额度
+struct CreditMsg {
+    uint32_t transfer_id;
+    uint32_t bytes;
+};
+
+// 本方这条连接临时生成的 X25519 公钥。HELLO 协商了 FEATURE_ENCRYPT 时客户端紧接着发（还是明文），
+// 服务器回一个自己的；服务器的回复之后、客户端的这个包之后，各自方向上的数据都是加密的记录
+struct KeyExchangeMsg {
+    uint8_t public_key[32];
+};
+
+// 这条连接上双方的 HELLO，客户端的在前。加密时作为派生密钥的 salt，
+// 中间人改了 HELLO 里的版本、功能时两边算出的密钥不同，第一个记录就校验失败
+struct HelloTranscript {
+    HelloMsg client;
+    HelloMsg server;
+};
+
 #pragma pack(pop)
 
 #endif // PROTOCOL_H
\ No newline at end of file
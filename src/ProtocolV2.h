@@ -0,0 +1,281 @@
+#ifndef PROTOCOLV2_H
+#define PROTOCOLV2_H
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <type_traits>
+#include <memory>
+#include <sys/socket.h>
+#include "Protocol.h"
+#include "MessageCodec.h"
+#include "FrameCipher.h"
+
+// v2 线路格式。连接建立时用 MSG_HELLO 协商（见 Protocol.h），双方都支持才换成 v2 帧；
+// 不发 HELLO 的老客户端、不认识 HELLO 的老服务器照常用原来的 v1 格式。
+// v2 帧：varint 类型 + varint 包体长度 + 包体，一个聊天包的帧头 2 个字节。
+// 包体里的整数都是 varint（小端 base-128）或定长小端，不随机器字节序变化；
+// 没有定长的名字字段，字符串放在包体最后，长度由帧长度算出。
+// 用户用服务器分配的编号表示：上线通知带上编号和名字，之后聊天、邀约、进度只带编号，客户端发出的填 0；
+// 传输用收方分配的 transfer_id。
+// 每种消息的字段编码见 MessageCodec.h。程序内部仍然用 Protocol.h 的结构体，v2 只是线路上的编码，
+// 收发时用这里的函数互相转换。
+// 点对点直连仍是 v1 格式。
+
+// v1 包体 -> 完整的 v2 帧，直接写进 frame。user_id 是 LOGIN/CHAT/FILE/PROGRESS 里的用户编号；
+// LOGIN 和 CHAT 的 body 只含名字/聊天内容，v1 里拼在前面的用户名由调用方先去掉
+template <uint8_t Type>
+struct V1ToV2 {
+    static bool call(const char* body, size_t length, uint32_t user_id, std::vector<char>& frame) {
+        using Msg = typename MessageOf<Type>::type;
+        if constexpr (std::is_void<Msg>::value) {
+            return false;
+        } else if constexpr (std::is_same<Msg, TextBody>::value) {
+            frame.resize(V2_MAX_HEADER + varint_max_size(sizeof(user_id)) + length);
+            frame.resize(encode_text_v2(Type, user_id, body, length, frame.data()));
+            return true;
+        } else if constexpr (std::is_same<Msg, RawBody>::value) {
+            frame.resize(V2_MAX_HEADER + length);
+            size_t head = put_frame_header(2, Type, length, frame.data());
+            std::memcpy(frame.data() + head, body, length);
+            frame.resize(head + length);
+            return true;
+        } else {
+            Msg msg;
+            CodecContext ctx;
+            if (!decode_v1(body, length, msg, &ctx.tail)) {
+                return false;
+            }
+            ctx.user_id = user_id;
+            frame.resize(v2_frame_capacity<Msg>(CheckedLayout<Msg>::tail_length(msg)));
+            frame.resize(encode_v2(Type, msg, ctx, frame.data()));
+            return true;
+        }
+    }
+};
+
+// v2 包体 -> v1 包体。user_id 返回 LOGIN/CHAT/FILE/PROGRESS 里的用户编号，
+// 这几种消息的用户名字段留空，由调用方按编号或连接填上。
+// 不认识的类型原样交出去，由分派表当作没有处理的类型跳过（见 MessageDispatch.h）
+template <uint8_t Type>
+struct V2ToV1 {
+    static bool call(const char* body, size_t length, std::vector<char>& out, uint32_t& user_id) {
+        using Msg = typename MessageOf<Type>::type;
+        if constexpr (std::is_void<Msg>::value || std::is_same<Msg, RawBody>::value) {
+            out.assign(body, body + length);
+            return true;
+        } else if constexpr (std::is_same<Msg, TextBody>::value) {
+            const char* text;
+            size_t text_length;
+            if (!decode_text_v2(body, length, user_id, text, text_length)) {
+                return false;
+            }
+            out.assign(text, text + text_length);
+            return true;
+        } else {
+            Msg msg;
+            CodecContext ctx;
+            if (!decode_v2(body, length, msg, ctx)) {
+                return false;
+            }
+            size_t tail_length = CheckedLayout<Msg>::tail_length(msg);
+            out.resize(sizeof(msg) + tail_length);
+            std::memcpy(out.data(), &msg, sizeof(msg));
+            if (tail_length > 0) {
+                std::memcpy(out.data() + sizeof(msg), ctx.tail, tail_length);
+            }
+            user_id = ctx.user_id;
+            return true;
+        }
+    }
+};
+
+using V1ToV2Fn = bool (*)(const char*, size_t, uint32_t, std::vector<char>&);
+using V2ToV1Fn = bool (*)(const char*, size_t, std::vector<char>&, uint32_t&);
+
+// v1 包体编码成一个完整的 v2 帧。类型未知或包体太短时返回 false
+inline bool v2_encode_frame(uint8_t type, const char* body, size_t length, uint32_t user_id, std::vector<char>& frame) {
+    static constexpr auto table = make_message_table<V1ToV2Fn, V1ToV2>();
+    return type < table.size() && table[type](body, length, user_id, frame);
+}
+
+// v2 包体解码成 v1 包体。格式不对时返回 false
+inline bool v2_decode_body(uint8_t type, const char* body, size_t length, std::vector<char>& out, uint32_t& user_id) {
+    static constexpr auto table = make_message_table<V2ToV1Fn, V2ToV1, 256>();
+    user_id = 0;
+    return table[type](body, length, out, user_id);
+}
+
+// v1、v2 文件数据帧头部的最大长度
+constexpr size_t FILE_DATA_HEAD_MAX = std::max(v2_frame_capacity<FileDataMsg>(), sizeof(Header) + sizeof(FileDataMsg));
+
+// 按连接的版本把文件数据帧的头部（帧头 + 传输编号 + 偏移量）写进 out，至少 FILE_DATA_HEAD_MAX 字节；
+// 数据由调用方接在后面或者用 sendfile 发出。type 是 MSG_FILE_DATA 或 MSG_FILE_DATA_Z。返回头部的字节数
+inline size_t encode_file_data_head(int version, const FileDataMsg& data_msg, char* out,
+                                    uint8_t type = MSG_FILE_DATA) {
+    if (version == 2) {
+        return encode_v2(type, data_msg, CodecContext(), out);
+    }
+    return encode_v1(type, data_msg, nullptr, out);
+}
+
+// 从 socket 读帧，v1 和 v2 都行，协商完 HELLO 后用 set_version 切换。
+// 带一个小缓冲区，连着到达的几个小帧一次 recv 读进来；
+// 大的包体先取走缓冲区里的部分，剩下的直接读进调用方的缓冲区，不多拷贝一次
+class FrameReader {
+public:
+    explicit FrameReader(int fd) : fd_(fd) {}
+
+    FrameReader(const FrameReader& other) = delete;
+    FrameReader& operator=(const FrameReader& other) = delete;
+
+    int version() const { return version_; }
+    void set_version(int version) { version_ = version; }
+
+#ifdef HAVE_OPENSSL
+    // 之后收到的都是加密的记录（见 FrameCipher.h），已经读进缓冲区还没用到的字节是第一个记录的开头。
+    // read 要的数据从一个记录的开头起时，这部分直接收进调用方的缓冲区原地解密，不经过 record_；
+    // 涉及的记录都整个收下、校验通过后 read 才返回 true，返回 false 时缓冲区里的内容不能用
+    void set_cipher(std::unique_ptr<RecordCipher> cipher) { cipher_ = std::move(cipher); }
+#endif
+
+    // 读一个帧头。length 是包体长度
+    bool read_header(uint8_t& type, uint32_t& length) {
+        return get_frame_header(*this, version_, type, length);
+    }
+
+    bool read(void* out, size_t length) {
+#ifdef HAVE_OPENSSL
+        if (cipher_) {
+            return read_records((char*)out, length);
+        }
+#endif
+        return read_raw((char*)out, length);
+    }
+
+private:
+    bool read_raw(char* ptr, size_t length) {
+        size_t buffered = std::min(length, end_ - pos_);
+        std::memcpy(ptr, buffer_ + pos_, buffered);
+        pos_ += buffered;
+        ptr += buffered;
+        length -= buffered;
+        if (length >= sizeof(buffer_)) {
+            return recv_all(ptr, length); // 大块数据直接读到目的地
+        }
+        while (length > 0) {
+            ssize_t result = recv(fd_, buffer_, sizeof(buffer_), 0);
+            if (result <= 0) {
+                return false;
+            }
+            pos_ = 0;
+            end_ = result;
+            buffered = std::min(length, end_);
+            std::memcpy(ptr, buffer_, buffered);
+            pos_ = buffered;
+            ptr += buffered;
+            length -= buffered;
+        }
+        return true;
+    }
+
+#ifdef HAVE_OPENSSL
+    bool read_records(char* ptr, size_t length) {
+        while (length > 0) {
+            if (record_pos_ == record_size_) {
+                size_t direct = 0;
+                if (!read_record(ptr, length, direct)) {
+                    return false;
+                }
+                ptr += direct;
+                length -= direct;
+                continue;
+            }
+            size_t size = std::min(length, record_size_ - record_pos_);
+            std::memcpy(ptr, record_.data() + record_pos_, size);
+            record_pos_ += size;
+            ptr += size;
+            length -= size;
+        }
+        return true;
+    }
+
+    // 收下一个完整的记录并解密：内容的前 direct 字节（最多 capacity）直接收进 out，剩下的放进 record_。
+    // 校验码不对时返回 false
+    bool read_record(char* out, size_t capacity, size_t& direct) {
+        char header[RECORD_HEADER];
+        size_t size = 0;
+        if (!read_raw(header, sizeof(header)) || !cipher_->begin_open(header, size)) {
+            return false;
+        }
+        direct = std::min(size, capacity);
+        size_t rest = size - direct;
+        record_.resize(std::max(record_.size(), rest + RECORD_TAG));
+        if (!read_raw(out, direct) || !read_raw(record_.data(), rest + RECORD_TAG) || !cipher_->update(out, direct) ||
+            !cipher_->update(record_.data(), rest) || !cipher_->finish(record_.data() + rest)) {
+            return false;
+        }
+        record_pos_ = 0;
+        record_size_ = rest;
+        return true;
+    }
+#endif
+
+    bool recv_all(char* ptr, size_t length) {
+        while (length > 0) {
+            ssize_t result = recv(fd_, ptr, length, 0);
+            if (result <= 0) {
+                return false;
+            }
+            ptr += result;
+            length -= result;
+        }
+        return true;
+    }
+
+    int fd_;
+    int version_ = 1;
+    char buffer_[4096];
+    size_t pos_ = 0;
+    size_t end_ = 0;
+#ifdef HAVE_OPENSSL
+    std::unique_ptr<RecordCipher> cipher_;
+    std::vector<char> record_; // 当前记录没有直接交给调用方的内容，各个记录复用
+    size_t record_pos_ = 0;
+    size_t record_size_ = 0;
+#endif
+};
+
+// 解码时直接从 FrameReader 读，最多读 left 个字节（一个包体）
+class FrameSource {
+public:
+    FrameSource(FrameReader& reader, size_t length) : reader_(reader), left_(length) {}
+
+    bool read(void* out, size_t length) {
+        if (length > left_) {
+            return false;
+        }
+        left_ -= length;
+        return reader_.read(out, length);
+    }
+
+    size_t remaining() const { return left_; }
+    const char* rest() const { return nullptr; }
+
+private:
+    FrameReader& reader_;
+    size_t left_;
+};
+
+// 直接从 socket 读一个 v2 帧的定长部分，Tail 的数据留给调用方读（长度在 Tail 字段里）。
+// length 是帧头里的包体长度。文件数据帧用它，数据不经过中间缓冲区
+template <typename Msg>
+bool v2_read_head(FrameReader& reader, uint32_t length, Msg& msg) {
+    FrameSource in(reader, length);
+    CodecContext ctx;
+    return decode_v2(in, msg, ctx);
+}
+
+#endif // PROTOCOLV2_H
@@ -0,0 +1,124 @@
+#ifndef READAHEAD_H
+#define READAHEAD_H
+
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <unistd.h>
+#include "PieceMap.h"
+
+// 发送文件时的预读：读线程按分片顺序提前把数据读进几个大缓冲区，发送线程只管从里面取数据发出去。
+// 读盘和发网络同时进行，速度接近两者中较慢的一个，而不是两者时间之和。
+// skip 中标记的分片（对方已经有了）不读。
+class ReadAhead {
+public:
+    struct Block {
+        uint32_t piece = 0;
+        uint64_t offset = 0;
+        std::vector<char> data;
+    };
+
+    // depth 是同时在用的缓冲区个数，每个缓冲区一个分片大小
+    ReadAhead(int fd, uint64_t file_size, const std::vector<uint8_t>& skip, size_t depth)
+        : fd_(fd), file_size_(file_size), skip_(skip), free_(depth > 0 ? depth : 1),
+          thread_(&ReadAhead::run, this) {}
+
+    ~ReadAhead() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        can_read_.notify_one();
+        thread_.join();
+    }
+
+    // 禁止拷贝
+    ReadAhead(const ReadAhead& other) = delete;
+    ReadAhead& operator=(const ReadAhead& other) = delete;
+
+    // 取下一个读好的分片，没有了（或读失败）返回 false，用 failed() 区分
+    bool next(Block& block) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        can_take_.wait(lock, [this] { return !ready_.empty() || done_; });
+        if (ready_.empty()) {
+            return false;
+        }
+        block = std::move(ready_.front());
+        ready_.pop_front();
+        return true;
+    }
+
+    // 发完之后把缓冲区还回来，读线程接着往里读
+    void release(Block&& block) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            free_.push_back(std::move(block.data));
+        }
+        can_read_.notify_one();
+    }
+
+    bool failed() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return failed_;
+    }
+
+private:
+    void run() {
+        uint32_t piece_count = PieceMap::piece_count(file_size_);
+        for (uint32_t piece = 0; piece < piece_count; ++piece) {
+            if (PieceMap::test_bit(skip_, piece)) {
+                continue;
+            }
+            Block block;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                can_read_.wait(lock, [this] { return stop_ || !free_.empty(); });
+                if (stop_) {
+                    break;
+                }
+                block.data = std::move(free_.back());
+                free_.pop_back();
+            }
+
+            block.piece = piece;
+            block.offset = (uint64_t)piece * FILE_PIECE_SIZE;
+            block.data.resize(PieceMap::piece_length(file_size_, piece));
+            size_t done = 0;
+            while (done < block.data.size()) {
+                ssize_t result = pread(fd_, block.data.data() + done, block.data.size() - done, block.offset + done);
+                if (result <= 0) {
+                    break;
+                }
+                done += result;
+            }
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (done < block.data.size()) {
+                failed_ = true;
+                break;
+            }
+            ready_.push_back(std::move(block));
+            can_take_.notify_one();
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        done_ = true;
+        can_take_.notify_one();
+    }
+
+    int fd_;
+    uint64_t file_size_;
+    std::vector<uint8_t> skip_;
+    std::vector<std::vector<char>> free_; // 空闲的缓冲区
+    std::deque<Block> ready_;             // 读好、等待发送的分片
+    bool stop_ = false;
+    bool done_ = false;
+    bool failed_ = false;
+    mutable std::mutex mutex_;
+    std::condition_variable can_read_;
+    std::condition_variable can_take_;
+    std::thread thread_; // 放在最后，保证其他成员先初始化好再启动线程
+};
+
+#endif // READAHEAD_H
@@ -0,0 +1,644 @@
+#ifndef SENDQUEUE_H
+#define SENDQUEUE_H
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/uio.h>
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#endif
+#include "Protocol.h"
+#include "MessageCodec.h"
+#include "FrameCipher.h"
+
+// 发送的先后类别，数值越小越先发
+enum SendClass {
+    SEND_CONTROL = 0, // 登录、上下线、邀约、直连协商
+    SEND_CHAT,
+    SEND_PROGRESS,
+    SEND_BULK,        // 文件数据
+    SEND_CLASS_COUNT,
+};
+
+// 按消息类型决定发送的先后：控制消息最先，然后是聊天、进度，文件数据最后
+inline SendClass send_class(uint8_t type) {
+    switch (type) {
+        case MSG_CHAT:
+            return SEND_CHAT;
+        case MSG_PROGRESS:
+            return SEND_PROGRESS;
+        case MSG_FILE_DATA:
+        case MSG_FILE_DATA_Z:
+            return SEND_BULK;
+        default:
+            return SEND_CONTROL;
+    }
+}
+
+// 一个连接的发送队列，由它自己的写线程发出，每个包都完整地写完才写下一个。不同类别之间严格按优先级：
+// 队列里有聊天消息时，排在后面的文件数据块要等它发完。
+// 文件数据按传输（flow）分开排队，传输之间用差额轮询（DRR）做加权公平排队，
+// 每轮每个传输最多发 weight * QUANTUM 字节，同一连接上一个大文件不会把其他传输饿死。
+// 每个传输排队的数据超过 FLOW_BUDGET 时 push_bulk 阻塞，发送线程跟着连接的实际速度走。
+// 帧是发送的最小单位，已经开始发的帧不会被打断，所以数据块越小，聊天插队越及时。
+// 内核发送缓冲区里没发出的数据限制在 UNSENT_LIMIT 以内，否则几 MB 数据先进了内核，排序也就没用了。
+// 打开合并发送（set_batching）后，一小段时间里放进来的小包攒到一起用一次 writev 写出去。
+// 加密（set_cipher）时每次写出的一个包、一批包原地加密成一个记录；文件数据包的包头和数据分开加密，
+// 数据原地加密（走 sendfile 的读出来分段加密），收方能直接解密到目的缓冲区，两头都不多拷贝一次。
+class SendQueue {
+public:
+    explicit SendQueue(int fd) : fd_(fd), thread_(&SendQueue::run, this) {
+#ifdef TCP_NOTSENT_LOWAT
+        int unsent = UNSENT_LIMIT;
+        setsockopt(fd_, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &unsent, sizeof(unsent));
+#endif
+    }
+
+    ~SendQueue() {
+        close();
+    }
+
+    // 禁止拷贝
+    SendQueue(const SendQueue& other) = delete;
+    SendQueue& operator=(const SendQueue& other) = delete;
+
+    int fd() const { return fd_; }
+
+    // 到现在为止写 socket 的系统调用次数（send、writev、sendfile），看合并发送省了多少次用
+    uint64_t write_calls() const { return write_calls_; }
+
+    // 合并发送：第一个小包（控制、聊天、进度）放进来后最多再等 delay，这期间放进来的小包
+    // 和它一起用一次 writev 写出去，连着发的几条聊天不再各占一次系统调用、一个 TCP 段。
+    // 攒到 BATCH_LIMIT 或者有文件数据在排队时不再等。version 不为 0 时攒到的包再套一个
+    // 这个版本的 MSG_BUNDLE 帧头（对端要支持 FEATURE_BUNDLE），为 0 时只是首尾相接写出去。delay 为 0 时关闭
+    void set_batching(std::chrono::microseconds delay, int version) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        batch_delay_ = delay;
+        batch_version_ = version;
+    }
+
+    // 小包写出去之前先经过 filter（比如压缩，见 FrameCompressor.h），在写线程里按真正发出的顺序调用，
+    // 可以就地改写整个帧，返回 false 表示连接不能再用。只对设置之后放进来的包生效，只能设置一次
+    void set_filter(std::function<bool(std::vector<char>&)> filter) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        filter_ = std::move(filter);
+    }
+
+#ifdef HAVE_OPENSSL
+    // 之后写出去的数据都用 cipher 加密成记录（见 FrameCipher.h）。要在放第一个包之前设置
+    void set_cipher(std::shared_ptr<RecordCipher> cipher) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        cipher_ = std::move(cipher);
+    }
+
+    // 放入一个控制包，它照原样写出去之后，再写的数据都用 cipher 加密。服务器回复密钥交换时用
+    bool push_then_encrypt(std::vector<char>&& package, std::shared_ptr<RecordCipher> cipher) {
+        Frame frame;
+        frame.data = std::move(package);
+        frame.cipher = std::move(cipher);
+        return push_small(SEND_CONTROL, std::move(frame));
+    }
+#endif
+
+    // 放入一个完整的包，不会阻塞。连接已经出错或关闭时返回 false
+    bool push(SendClass send_class, std::vector<char>&& package) {
+        Frame frame;
+        frame.data = std::move(package);
+        return push_small(send_class, std::move(frame));
+    }
+
+    // 放入一个文件数据包，flow 标识它属于哪个传输，weight 是这个传输分到的份额。
+    // head_size 是包头的长度，加密时包头和数据各自成一个记录，收方可以把数据直接解密到自己的缓冲区；
+    // 为 0 时整个包一个记录
+    bool push_bulk(const std::string& flow, std::vector<char>&& package, size_t head_size = 0, uint32_t weight = 1) {
+        Frame frame;
+        frame.data = std::move(package);
+        frame.head_size = std::min(head_size, frame.data.size());
+        return push_frame(flow, std::move(frame), weight);
+    }
+
+    // 零拷贝版本：head 是包头，包体从 file_fd 的 [offset, offset + length) 用 sendfile 直接发出。
+    // 调用方在 flush 返回之前不能关闭 file_fd
+    bool push_bulk(const std::string& flow, std::vector<char>&& head, int file_fd, uint64_t offset, uint32_t length,
+                   uint32_t weight = 1) {
+        Frame frame;
+        frame.data = std::move(head);
+        frame.file_fd = file_fd;
+        frame.file_offset = offset;
+        frame.file_length = length;
+        return push_frame(flow, std::move(frame), weight);
+    }
+
+    // 等 flow 排队的数据全部发出。连接出错、队列关闭时返回 false
+    bool flush(const std::string& flow) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        has_space_.wait(lock, [this, &flow] { return exited_ || flows_.find(flow) == flows_.end(); });
+        return flows_.find(flow) == flows_.end();
+    }
+
+    // 发送过程中发现这个文件/系统不支持 sendfile 时为 false，之后的文件数据都改为读出来再发
+    bool sendfile_supported() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return !sendfile_unsupported_;
+    }
+
+    // 停掉写线程，没发出去的包丢弃。之后 push 都返回 false
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        has_frame_.notify_one();
+        has_space_.notify_all();
+        if (thread_.joinable() && thread_.get_id() != std::this_thread::get_id()) {
+            thread_.join();
+        }
+    }
+
+private:
+    static const size_t FLOW_BUDGET = 2 * 1024 * 1024; // 每个传输最多排队 2MB
+    static const int64_t QUANTUM = 64 * 1024;          // 每轮每份额可发的字节数
+    static const int UNSENT_LIMIT = 128 * 1024;        // 内核里最多压着这么多还没发出的数据
+    static const size_t BATCH_LIMIT = 16 * 1024;       // 合并发送时一次最多攒这么多字节
+    static const size_t BATCH_MAX_FRAMES = 256;        // 和这么多个包（writev 的 iovec 个数有上限）
+
+    struct Frame {
+        std::vector<char> data;
+        int file_fd = -1; // 不为 -1 时 data 之后还要从文件发 file_length 字节
+        uint64_t file_offset = 0;
+        uint32_t file_length = 0;
+        size_t head_size = 0; // 加密时 data 的前这么多字节单独一个记录（见 push_bulk）
+        bool filter = false; // 发送前要经过 filter_
+#ifdef HAVE_OPENSSL
+        std::shared_ptr<RecordCipher> cipher; // 不为空时这个包写出去之后开始加密
+#endif
+
+        size_t size() const { return data.size() + file_length; }
+    };
+
+    struct Flow {
+        std::deque<Frame> frames;
+        size_t bytes = 0;    // 排队和正在发的字节数
+        int64_t deficit = 0; // DRR 里攒下的可发字节数
+        uint32_t weight = 1;
+        bool active = false; // 是否在 active_ 里
+    };
+
+    bool push_small(SendClass send_class, Frame&& frame) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (stop_) {
+            return false;
+        }
+        if (small_bytes_ == 0) {
+            batch_start_ = std::chrono::steady_clock::now();
+        }
+        small_bytes_ += frame.data.size();
+        frame.filter = static_cast<bool>(filter_);
+        queues_[std::min(send_class, SEND_PROGRESS)].push_back(std::move(frame));
+        has_frame_.notify_one();
+        return true;
+    }
+
+    bool push_frame(const std::string& flow, Frame&& frame, uint32_t weight) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        has_space_.wait(lock, [this, &flow, &frame] {
+            auto it = flows_.find(flow);
+            return stop_ || it == flows_.end() || it->second.bytes == 0 ||
+                   it->second.bytes + frame.size() <= FLOW_BUDGET;
+        });
+        if (stop_) {
+            return false;
+        }
+        Flow& state = flows_[flow];
+        state.weight = weight > 0 ? weight : 1;
+        state.bytes += frame.size();
+        state.frames.push_back(std::move(frame));
+        if (!state.active) {
+            state.active = true;
+            active_.push_back(flow);
+        }
+        has_frame_.notify_one();
+        return true;
+    }
+
+    bool has_frame() const {
+        for (int i = 0; i < SEND_BULK; ++i) {
+            if (!queues_[i].empty()) {
+                return true;
+            }
+        }
+        return !active_.empty();
+    }
+
+    // 取下一个要发的包：先按类别，文件数据再按 DRR 在传输之间轮流。调用方持有锁
+    Frame take(std::string& flow) {
+        for (int i = 0; i < SEND_BULK; ++i) {
+            if (!queues_[i].empty()) {
+                Frame frame = std::move(queues_[i].front());
+                queues_[i].pop_front();
+                small_bytes_ -= frame.data.size();
+                return frame;
+            }
+        }
+        while (true) {
+            Flow& state = flows_[active_.front()];
+            int64_t size = state.frames.front().size();
+            if (state.deficit < size) {
+                // 这一轮的额度不够发下一个包，攒上额度，轮到下一个传输
+                state.deficit += QUANTUM * state.weight;
+                active_.push_back(active_.front());
+                active_.pop_front();
+                continue;
+            }
+            state.deficit -= size;
+            flow = active_.front();
+            Frame frame = std::move(state.frames.front());
+            state.frames.pop_front();
+            if (state.frames.empty()) {
+                state.active = false;
+                state.deficit = 0; // 没有数据排队的传输不保留额度
+                active_.pop_front();
+            }
+            return frame;
+        }
+    }
+
+    // 合并发送：等到第一个小包放进来 batch_delay_ 之后，或者攒够 BATCH_LIMIT、有文件数据要发时，
+    // 按类别顺序取出小包放进 batch_，不超过 BATCH_LIMIT（单个大包照样整个发），要开始加密的包是一批的最后一个。
+    // 调用方持有锁
+    void take_batch(std::unique_lock<std::mutex>& lock) {
+        has_frame_.wait_until(lock, batch_start_ + batch_delay_,
+                              [this] { return stop_ || small_bytes_ >= BATCH_LIMIT || !active_.empty(); });
+        size_t bytes = 0;
+        batch_.clear();
+        bundle_version_ = batch_version_;
+        for (int i = 0; i < SEND_BULK; ++i) {
+            std::deque<Frame>& queue = queues_[i];
+            while (!queue.empty() && (batch_.empty() || (bytes + queue.front().data.size() <= BATCH_LIMIT &&
+                                                         batch_.size() < BATCH_MAX_FRAMES))) {
+                bytes += queue.front().data.size();
+                small_bytes_ -= queue.front().data.size();
+                batch_.push_back(std::move(queue.front()));
+                queue.pop_front();
+#ifdef HAVE_OPENSSL
+                if (batch_.back().cipher) {
+                    return;
+                }
+#endif
+            }
+        }
+    }
+
+    // 把 take_batch 取出的包（和 MSG_BUNDLE 帧头）用 writev 一次写出去，加密时整批是一个记录
+    bool send_batch() {
+        size_t bytes = 0;
+        iov_.resize(1);
+        for (Frame& frame : batch_) {
+            if (frame.filter && !filter_(frame.data)) {
+                return false;
+            }
+            bytes += frame.data.size();
+            iov_.push_back({frame.data.data(), frame.data.size()});
+        }
+        if (bundle_version_ != 0 && batch_.size() > 1) {
+            iov_[0] = {batch_header_, put_frame_header(bundle_version_, MSG_BUNDLE, bytes, batch_header_)};
+        } else {
+            iov_[0] = {batch_header_, 0};
+        }
+#ifdef HAVE_OPENSSL
+        if (cipher_ && !seal_iov()) {
+            return false;
+        }
+        if (!write_iov()) {
+            return false;
+        }
+        if (batch_.back().cipher) {
+            cipher_ = std::move(batch_.back().cipher);
+        }
+        return true;
+#else
+        return write_iov();
+#endif
+    }
+
+    // 把 iov_ 用 writev 写出去，只写了一部分时从断开的地方接着写
+    bool write_iov() {
+        struct iovec* vec = iov_.data();
+        size_t count = iov_.size();
+        while (count > 0) {
+            ssize_t sent = writev(fd_, vec, count);
+            ++write_calls_;
+            if (sent < 0 && errno == EINTR) {
+                continue;
+            }
+            if (sent <= 0) {
+                return false;
+            }
+            while (count > 0 && (size_t)sent >= vec->iov_len) {
+                sent -= vec->iov_len;
+                ++vec;
+                --count;
+            }
+            if (count > 0) {
+                vec->iov_base = (char*)vec->iov_base + sent;
+                vec->iov_len -= sent;
+            }
+        }
+        return true;
+    }
+
+    bool send_all(const char* data, size_t length, int flags = 0) {
+        while (length > 0) {
+            ssize_t sent = send(fd_, data, length, flags);
+            ++write_calls_;
+            if (sent < 0 && errno == EINTR) {
+                continue;
+            }
+            if (sent <= 0) {
+                return false;
+            }
+            data += sent;
+            length -= sent;
+        }
+        return true;
+    }
+
+    // 把文件的一段读出来再发，不支持 sendfile 时用
+    bool send_copy(int file_fd, uint64_t offset, size_t length) {
+        copy_buffer_.resize(64 * 1024);
+        while (length > 0) {
+            ssize_t len = pread(file_fd, copy_buffer_.data(), std::min(length, copy_buffer_.size()), offset);
+            if (len <= 0 || !send_all(copy_buffer_.data(), len)) {
+                return false;
+            }
+            offset += len;
+            length -= len;
+        }
+        return true;
+    }
+
+    // 发一个带文件数据的包：包头先发（Linux 上带 MSG_MORE，和数据合成一个 TCP 段），
+    // 数据由 sendfile 直接从文件发到 socket，不经过用户态。系统不支持时读出来补发
+    bool send_file_frame(const Frame& frame, bool& unsupported) {
+        if (unsupported) {
+            return send_all(frame.data.data(), frame.data.size()) &&
+                   send_copy(frame.file_fd, frame.file_offset, frame.file_length);
+        }
+#if defined(__linux__)
+        if (!send_all(frame.data.data(), frame.data.size(), MSG_MORE)) {
+            return false;
+        }
+        off_t offset = frame.file_offset;
+        size_t remaining = frame.file_length;
+        while (remaining > 0) {
+            ssize_t sent = sendfile(fd_, frame.file_fd, &offset, remaining);
+            ++write_calls_;
+            if (sent < 0 && errno == EINTR) {
+                continue;
+            }
+            if (sent < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                unsupported = true; // 包头已经发出去了，剩下的数据读出来补发
+                return send_copy(frame.file_fd, offset, remaining);
+            }
+            if (sent <= 0) {
+                return false;
+            }
+            remaining -= sent;
+        }
+        return true;
+#elif defined(__APPLE__)
+        // macOS 的 sendfile 可以把包头一起带上
+        struct iovec head_vec = {(void*)frame.data.data(), frame.data.size()};
+        struct sf_hdtr hdtr = {&head_vec, 1, nullptr, 0};
+        off_t offset = frame.file_offset;
+        size_t remaining = frame.file_length;
+        bool first = true;
+        while (remaining > 0 || first) {
+            off_t len = remaining;
+            int result = sendfile(frame.file_fd, fd_, offset, &len, first ? &hdtr : nullptr, 0);
+            if (result < 0 && errno != EINTR && errno != EAGAIN) {
+                if (first && len == 0 && (errno == ENOTSUP || errno == ENOTSOCK || errno == EOPNOTSUPP)) {
+                    unsupported = true; // 什么都还没发出去，整个包改走拷贝
+                    return send_file_frame(frame, unsupported);
+                }
+                return false;
+            }
+            if (first) {
+                len -= std::min<off_t>(len, frame.data.size()); // len 包含已发出的包头
+                first = false;
+            }
+            offset += len;
+            remaining -= len;
+        }
+        return true;
+#else
+        unsupported = true;
+        return send_file_frame(frame, unsupported);
+#endif
+    }
+
+#ifdef HAVE_OPENSSL
+    // 把 [data, data + length) 原地加密成一个记录，记录头和校验码写进 header、tag
+    bool seal(char* data, size_t length, char* header, char* tag) {
+        return cipher_->begin_seal(length, header) && cipher_->update(data, length) && cipher_->finish(tag);
+    }
+
+    // 把 iov_ 里的数据原地加密成一个记录：前面加上记录头，后面加上校验码
+    bool seal_iov() {
+        size_t length = 0;
+        for (const struct iovec& vec : iov_) {
+            length += vec.iov_len;
+        }
+        if (!cipher_->begin_seal(length, record_header_)) {
+            return false;
+        }
+        for (const struct iovec& vec : iov_) {
+            if (!cipher_->update((char*)vec.iov_base, vec.iov_len)) {
+                return false;
+            }
+        }
+        if (!cipher_->finish(record_tag_)) {
+            return false;
+        }
+        iov_.insert(iov_.begin(), {record_header_, RECORD_HEADER});
+        iov_.push_back({record_tag_, RECORD_TAG});
+        return true;
+    }
+
+    // 加密时发带包头长度的文件数据包：包头、数据在包里原地各加密成一个记录，一次 writev 写出去
+    bool send_sealed_split_frame(Frame& frame) {
+        char* head = frame.data.data();
+        char* data = head + frame.head_size;
+        size_t length = frame.data.size() - frame.head_size;
+        if (!seal(head, frame.head_size, record_header_, record_tag_) || !seal(data, length, data_header_, data_tag_)) {
+            return false;
+        }
+        iov_.assign({{record_header_, RECORD_HEADER}, {head, frame.head_size}, {record_tag_, RECORD_TAG},
+                     {data_header_, RECORD_HEADER}, {data, length}, {data_tag_, RECORD_TAG}});
+        return write_iov();
+    }
+
+    // 加密时发带文件数据的包：包头单独一个记录；数据每次读 SEAL_CHUNK 字节进 copy_buffer_，
+    // 原地加密成一个记录写出去，第一段和包头的记录一起写
+    bool send_sealed_file_frame(const Frame& frame) {
+        size_t head_record = RECORD_HEADER + frame.data.size() + RECORD_TAG;
+        copy_buffer_.resize(head_record + RECORD_HEADER + SEAL_CHUNK + RECORD_TAG);
+        char* head = copy_buffer_.data();
+        std::memcpy(head + RECORD_HEADER, frame.data.data(), frame.data.size());
+        if (!seal(head + RECORD_HEADER, frame.data.size(), head, head + RECORD_HEADER + frame.data.size())) {
+            return false;
+        }
+        char* record = head + head_record;
+        char* start = head; // 还没写出去的第一个字节
+        uint64_t offset = frame.file_offset;
+        size_t remaining = frame.file_length;
+        do {
+            ssize_t len = 0;
+            if (remaining > 0) {
+                len = pread(frame.file_fd, record + RECORD_HEADER, std::min(remaining, SEAL_CHUNK), offset);
+                if (len <= 0) {
+                    return false;
+                }
+            }
+            char* end = record;
+            if (len > 0) {
+                if (!seal(record + RECORD_HEADER, len, record, record + RECORD_HEADER + len)) {
+                    return false;
+                }
+                end = record + RECORD_HEADER + len + RECORD_TAG;
+            }
+            if (!send_all(start, end - start)) {
+                return false;
+            }
+            start = record;
+            offset += len;
+            remaining -= len;
+        } while (remaining > 0);
+        return true;
+    }
+#endif
+
+    // 写出一个包：小包直接写，带文件数据的走 send_file_frame；加密时小包是一个记录
+    bool send_frame(Frame& frame, bool& unsupported) {
+        if (frame.filter && !filter_(frame.data)) {
+            return false;
+        }
+#ifdef HAVE_OPENSSL
+        if (cipher_ && frame.file_fd >= 0) {
+            return send_sealed_file_frame(frame);
+        }
+        if (cipher_ && frame.head_size > 0 && frame.head_size < frame.data.size()) {
+            return send_sealed_split_frame(frame);
+        }
+        if (cipher_) {
+            iov_.assign(1, {frame.data.data(), frame.data.size()});
+            return seal_iov() && write_iov();
+        }
+#endif
+        bool ok = frame.file_fd < 0 ? send_all(frame.data.data(), frame.data.size())
+                                    : send_file_frame(frame, unsupported);
+#ifdef HAVE_OPENSSL
+        if (ok && frame.cipher) {
+            cipher_ = std::move(frame.cipher);
+        }
+#endif
+        return ok;
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            has_frame_.wait(lock, [this] { return stop_ || has_frame(); });
+            if (stop_) {
+                break;
+            }
+            if (batch_delay_.count() > 0 && small_bytes_ > 0) {
+                take_batch(lock);
+                if (stop_) {
+                    break;
+                }
+                lock.unlock();
+                bool ok = send_batch();
+                lock.lock();
+                if (!ok) {
+                    stop_ = true;
+                    break;
+                }
+                continue;
+            }
+            std::string flow;
+            Frame frame = take(flow);
+            bool unsupported = sendfile_unsupported_;
+
+            lock.unlock();
+            // 发送时不持有锁，其他线程可以继续放包
+            bool ok = send_frame(frame, unsupported);
+            lock.lock();
+
+            sendfile_unsupported_ = unsupported;
+            if (!flow.empty()) {
+                auto it = flows_.find(flow);
+                it->second.bytes -= frame.size();
+                if (!it->second.active && it->second.bytes == 0) {
+                    flows_.erase(it);
+                }
+                has_space_.notify_all();
+            }
+            if (!ok) {
+                stop_ = true; // 连接出错，之后的包都发不出去了
+                break;
+            }
+        }
+        // 写线程退出后不会再碰任何包里的文件，等着 flush 的线程可以放心关文件了
+        exited_ = true;
+        has_space_.notify_all();
+    }
+
+    int fd_;
+    std::atomic<uint64_t> write_calls_{0};
+    std::deque<Frame> queues_[SEND_BULK];
+    std::map<std::string, Flow> flows_;
+    std::deque<std::string> active_; // 有数据排队的传输，DRR 按这个顺序轮流
+    std::vector<char> copy_buffer_;   // 只有写线程用
+    std::chrono::microseconds batch_delay_{0};
+    int batch_version_ = 0;
+    size_t small_bytes_ = 0; // 小包队列里的字节数
+    std::chrono::steady_clock::time_point batch_start_; // 小包队列从空变成非空的时间
+    std::vector<Frame> batch_; // 合并发送的包，以下四个只有写线程用
+    int bundle_version_ = 0;
+    char batch_header_[V2_MAX_HEADER];
+    std::vector<struct iovec> iov_;
+    std::function<bool(std::vector<char>&)> filter_; // 设置之后不再改，写线程不加锁调用
+#ifdef HAVE_OPENSSL
+    std::shared_ptr<RecordCipher> cipher_; // 以下几个只有写线程用（set_cipher 在放包之前）
+    char record_header_[RECORD_HEADER];
+    char record_tag_[RECORD_TAG];
+    char data_header_[RECORD_HEADER];      // 包头和数据分开加密时数据的记录
+    char data_tag_[RECORD_TAG];
+#endif
+    bool sendfile_unsupported_ = false;
+    bool stop_ = false;
+    bool exited_ = false;
+    mutable std::mutex mutex_;
+    std::condition_variable has_frame_;
+    std::condition_variable has_space_;
+    std::thread thread_; // 放在最后，保证其他成员先初始化好再启动线程
+};
+
+#endif // SENDQUEUE_H
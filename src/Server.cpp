@@ -2,17 +2,160 @@
 #include <thread>
 #include <vector>
 #include <map>
+#include <unordered_map>
+#include <atomic>
 #include <mutex>
+#include <memory>
+#include <csignal>
 #include <cstring>
+#include <algorithm>
+#include <random>
+#include <chrono>
+#include <cstdlib>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include "Protocol.h"
+#include "ProtocolV2.h"
+#include "MessageDispatch.h"
 #include "SafeQueue.h"
+#include "FileStore.h"
+#include "ChunkSizer.h"
+#include "SendQueue.h"
+#include "CreditWindow.h"
+#include "FrameCompressor.h"
+#include "ChunkCompressor.h"
+#include "FrameCipher.h"
 
-// fd->username 展示当前在线用户
-std::map<int, std::string> clients;
-std::mutex clients_mutex; // 保护 clients 的互斥锁
+// 上传的文件按内容哈希存放，相同内容只上传、只存一次
+FileStore g_store("./store");
+
+// 上传编号，服务器范围内递增，发送方填在数据块里
+std::atomic<uint32_t> g_next_upload_id{1};
+
+// 发往每个连接的小包攒多久一起写（--write-tick 微秒），0 表示来一个发一个。
+// 聊天很多时每条消息要给每个在线用户各 send 一次，打开后每个连接每个周期只 writev 一次
+std::chrono::microseconds g_write_tick{0};
+
+// 用户编号：v2 连接上用编号代替用户名，登录时分配，同名的用户共用一个，服务器运行期间不变
+struct UserIds {
+    std::unordered_map<std::string, uint32_t> ids;
+    std::vector<std::string> names; // 编号 - 1 -> 用户名
+    std::mutex mutex;
+
+    uint32_t intern(const std::string& name) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = ids.find(name);
+        if (it != ids.end()) {
+            return it->second;
+        }
+        names.push_back(name);
+        return ids[name] = names.size();
+    }
+
+    std::string name(uint32_t user_id) {
+        std::lock_guard<std::mutex> lock(mutex);
+        return user_id > 0 && user_id <= names.size() ? names[user_id - 1] : std::string();
+    }
+};
+UserIds g_user_ids;
+
+// 一个用户正在上传的文件：上传编号 -> 内容哈希和还没还给发送方的额度。
+// 登录连接和它的数据连接共用一份，最后一条连接断开时才释放：
+// 登录连接先断开时，数据连接上已经到达、还没处理的数据块照样能写完
+struct UploadSet {
+    struct Upload {
+        std::string file_hash;
+        CreditReturn credit{CREDIT_STEP};
+    };
+    std::unordered_map<uint32_t, Upload> files;
+    std::mutex mutex;
+
+    ~UploadSet() {
+        // 没传完的上传留在存储里，重新发送同一文件时续传
+        for (const auto& file : files) {
+            g_store.release_upload(file.second.file_hash);
+        }
+    }
+
+    // 登记一个上传，返回分配给它的编号
+    uint32_t insert(const std::string& file_hash) {
+        uint32_t transfer_id = g_next_upload_id++;
+        std::lock_guard<std::mutex> lock(mutex);
+        files[transfer_id].file_hash = file_hash;
+        return transfer_id;
+    }
+
+    bool find(uint32_t transfer_id, std::string& file_hash) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = files.find(transfer_id);
+        if (it == files.end()) {
+            return false;
+        }
+        file_hash = it->second.file_hash;
+        return true;
+    }
+
+    // 写完 bytes 字节后调用，返回要还给发送方的额度，0 表示先攒着
+    uint32_t consume(uint32_t transfer_id, size_t bytes) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = files.find(transfer_id);
+        return it == files.end() ? 0 : it->second.credit.add(bytes);
+    }
+
+    void erase(uint32_t transfer_id) {
+        std::lock_guard<std::mutex> lock(mutex);
+        files.erase(transfer_id);
+    }
+};
+
+// 一个客户端连接。每个连接有自己的发送队列和写线程，往慢的客户端发数据时不会卡住其他人
+struct Connection {
+    int fd;
+    std::string username;
+    SendQueue outbox;      // 所有发往这个连接的包都经过它，按类别排好先后再发
+    uint64_t session = 0;  // 登录时分配的会话令牌，客户端凭它把数据连接绑定到这个用户
+    int version = 1;       // 线路格式和可选功能，客户端的 MSG_HELLO 协商后确定，之后不变
+    bool negotiated = false; // 发过 MSG_HELLO。没发的是老客户端，只收发 legacy_message 里的消息和旧格式的文件包
+    uint32_t features = 0;
+    uint32_t user_id = 0;  // 登录后分配的用户编号
+    std::vector<std::weak_ptr<Connection>> data_conns; // 绑定到这个会话的数据连接，由 clients_mutex 保护
+    std::weak_ptr<UploadSet> uploads; // 登录连接的上传列表，数据连接绑定时共用
+    // 这个用户作为接收方给各个传输的发送额度，key 为它分配的传输编号。
+    // 发送线程持有额度，都发完后这里的 weak_ptr 自然失效
+    std::map<uint32_t, std::weak_ptr<CreditWindow>> credits;
+    std::mutex credits_mutex;
+    std::mutex legacy_mutex; // 老客户端一次只能收一个文件，推给它的文件排队一个个发（见 serve_legacy）
+
+    explicit Connection(int client_fd) : fd(client_fd), outbox(client_fd) {
+        outbox.set_batching(g_write_tick, 0);
+    }
+};
+
+// fd->连接 展示当前在线用户
+std::map<int, std::shared_ptr<Connection>> clients;
+// 会话令牌->登录连接，数据连接连上来时按令牌找到所属用户
+std::map<uint64_t, std::weak_ptr<Connection>> g_sessions;
+std::mutex clients_mutex; // 保护 clients、g_sessions 和各连接的 data_conns
+
+// 已发出的文件邀约，key 为内容哈希。只有接受了邀约的客户端才会收到数据；
+// 发送方还在线时优先让它直连接收方，服务器只负责牵线
+struct FileOffer {
+    FileMsg meta;
+    std::weak_ptr<Connection> sender;
+};
+std::map<std::string, FileOffer> g_offers;
+
+// 已转给发送方、还没有结果的直连请求，key 为一次性令牌。直连失败或发送方掉线时改为中转
+struct P2PPending {
+    std::weak_ptr<Connection> receiver;
+    int sender_fd;
+    FileMsg meta;
+    std::vector<uint8_t> have;
+    FileRequestMsg request; // 接收方的 MSG_FILE_ACCEPT（不含位图）
+};
+std::map<uint64_t, P2PPending> g_p2p_pending;
+std::mutex offers_mutex; // 保护 g_offers 和 g_p2p_pending
 
 void log(const std::string& msg) {
     std::cout << "[Server]: " << msg << std::endl; // 日志
@@ -38,164 +181,1025 @@ bool recv_exact(int sock, void* buffer, size_t length) {
     return true;
 }
 
-bool broadcast(int client_fd, const std::string& message) {
+// 把 v1 包换成 v2 帧。LOGIN 和 CHAT 的包体里拼着用户名，换成编号 user_id
+bool to_v2(std::vector<char>& package, uint32_t user_id) {
+    const Header* header = (const Header*)package.data();
+    const char* body = package.data() + sizeof(Header);
+    size_t length = std::min<size_t>(header->length, package.size() - sizeof(Header));
+    if (header->type == MSG_LOGIN) {
+        const std::string suffix = " connected"; // "alice connected" 只留下名字
+        length = length >= suffix.size() ? length - suffix.size() : length;
+    } else if (header->type == MSG_CHAT) {
+        size_t prefix = g_user_ids.name(user_id).size() + 2; // "alice: hello" 只留下聊天内容
+        prefix = std::min(prefix, length);
+        body += prefix;
+        length -= prefix;
+    }
+    std::vector<char> frame;
+    if (!v2_encode_frame(header->type, body, length, user_id, frame)) {
+        return false;
+    }
+    package.swap(frame);
+    return true;
+}
+
+// 把一个完整的 v1 包交给连接的发送队列，v2 连接先换成 v2 帧。
+// user_id 是 LOGIN/CHAT/FILE/PROGRESS 这几种消息说的是哪个用户
+bool send_to(Connection& conn, std::vector<char> package, uint32_t user_id = 0) {
+    if (package.size() < sizeof(Header)) {
+        return conn.outbox.push(SEND_CONTROL, std::move(package));
+    }
+    uint8_t type = ((const Header*)package.data())->type;
+    if (!conn.negotiated && !legacy_message(type)) {
+        return true; // 老客户端会按旧的结构体解，不发给它
+    }
+    if (conn.version == 2 && !to_v2(package, user_id)) {
+        log("Failed to encode message type " + std::to_string(type) + " for " + conn.username);
+        return false;
+    }
+    return conn.outbox.push(send_class(type), std::move(package));
+}
+
+// 文件数据按传输编号区分属于哪个传输，这个传输排队的数据太多时会阻塞，直到写线程发出去一些。
+// type 为 MSG_FILE_DATA_Z 时 data 是压缩过的数据，data_len 是压缩后的长度
+bool send_file_data(Connection& conn, const FileDataMsg& data_msg, const char* data, uint8_t type = MSG_FILE_DATA) {
+    char head[FILE_DATA_HEAD_MAX];
+    size_t head_size = encode_file_data_head(conn.version, data_msg, head, type);
+    std::vector<char> package;
+    package.reserve(head_size + data_msg.data_len);
+    package.insert(package.end(), head, head + head_size);
+    package.insert(package.end(), data, data + data_msg.data_len);
+    std::string flow((const char*)&data_msg.transfer_id, sizeof(data_msg.transfer_id));
+    return conn.outbox.push_bulk(flow, std::move(package), head_size);
+}
+
+// 先在锁内拷贝一份在线列表，发送时不再持有 clients_mutex
+std::vector<std::shared_ptr<Connection>> snapshot_clients(int except_fd) {
+    std::vector<std::shared_ptr<Connection>> result;
     std::lock_guard<std::mutex> lock(clients_mutex);
     for (const auto& client : clients) {
-        if (client.first != client_fd) {
-            if (send(client.first, message.c_str(), message.length(), 0) < 0) {
-                log("Failed to broadcast message");
-                return false;
-            }
+        if (client.first != except_fd) {
+            result.push_back(client.second);
         }
     }
-    return true;
+    return result;
+}
+
+bool broadcast(int client_fd, const std::string& message, uint32_t user_id) {
+    bool ok = true;
+    for (const auto& conn : snapshot_clients(client_fd)) {
+        if (!send_to(*conn, std::vector<char>(message.begin(), message.end()), user_id)) {
+            log("Failed to broadcast message to " + conn->username);
+            ok = false; // 一个客户端出错不影响发给其他人
+        }
+    }
+    return ok;
 }
 
 // 重构 broadcast 函数，支持包的转发
-bool broadcast(int client_fd, const std::vector<char>& package) {
-    std::lock_guard<std::mutex> lock(clients_mutex);
-    for (const auto& client : clients) {
-        if (client.first != client_fd) {
-            if (send(client.first, package.data(), package.size(), 0) < 0) {
-                log("Failed to broadcast package");
-                return false;
-            }
+bool broadcast(int client_fd, const std::vector<char>& package, uint32_t user_id) {
+    bool ok = true;
+    for (const auto& conn : snapshot_clients(client_fd)) {
+        if (!send_to(*conn, package, user_id)) {
+            log("Failed to broadcast package to " + conn->username);
+            ok = false;
         }
     }
+    return ok;
+}
+
+// 读出文件的第 index 片：上传还没完成时等它收齐再从 spill 文件读，入库之后改从清单读，stored 记下已经入库。
+// 上传中断、存储里缺块时记一条日志返回 false
+bool load_piece(const std::string& file_hash, uint32_t index, uint64_t file_size, StoreManifest& manifest,
+                bool& stored, std::vector<char>& block) {
+    uint32_t piece_count = PieceMap::piece_count(file_size);
+    if (!stored) {
+        PieceState state = g_store.wait_piece(file_hash, index);
+        if (state == PIECE_GONE) {
+            log("Upload of " + file_hash + " interrupted");
+            return false;
+        }
+        // 上传在 wait_piece 和读 spill 之间入库的话，.part 已经删了，改读清单
+        if (state == PIECE_READY && g_store.read_spill(file_hash, index, file_size, block)) {
+            return true;
+        }
+        if (!g_store.load_manifest(file_hash, manifest) || manifest.blocks.size() != piece_count) {
+            log("Missing manifest for " + file_hash);
+            return false;
+        }
+        stored = true;
+    }
+    if (!g_store.read_block(manifest.blocks[index], block)) {
+        log("Missing block " + manifest.blocks[index]);
+        return false;
+    }
     return true;
 }
 
-void handle_client(int client_fd) {
+// 按分片顺序把文件发给一个接受了邀约的客户端，对方已有的分片跳过。
+// 每个接收方一个线程、各自的进度：上传还没完成时从上传的 spill 文件里读已收齐的分片，
+// 赶上上传进度后就等下一片；快的接收方不用等慢的，慢的也拖不住上传者。
+// 数据块大小不超过接收方给的 max_chunk，发送过程中按实测吞吐量调整，数据块带上接收方给的 transfer_id。
+// credit 不为空时每个数据块先扣接收方给的额度，额度用完就等接收方写完一部分还回来。
+// 接收方支持 FEATURE_FILE_DEFLATE 时压得动的数据块压缩后发（见 ChunkCompressor.h），额度还是按原始长度扣
+void serve_file(std::shared_ptr<Connection> receiver, FileMsg meta, std::vector<uint8_t> have, uint32_t max_chunk,
+                uint32_t transfer_id, std::shared_ptr<CreditWindow> credit) {
+    ChunkSizer chunk_sizer(max_chunk);
+    std::string file_hash = Sha256::to_hex(meta.file_hash);
+    StoreManifest manifest;
+    bool stored = false;
+
+    std::vector<char> block;
+#ifdef HAVE_ZLIB
+    std::unique_ptr<ChunkCompressor> compressor;
+    std::vector<char> packed; // 压缩后的数据块
+    if (receiver->features & FEATURE_FILE_DEFLATE) {
+        compressor.reset(new ChunkCompressor());
+    }
+#endif
+    uint32_t piece_count = PieceMap::piece_count(meta.file_size);
+    for (uint32_t index = 0; index < piece_count; ++index) {
+        if (PieceMap::test_bit(have, index)) {
+            continue;
+        }
+        if (!load_piece(file_hash, index, meta.file_size, manifest, stored, block)) {
+            log("Stop serving " + std::string(meta.filename) + " to " + receiver->username);
+            return;
+        }
+
+        uint64_t offset = (uint64_t)index * FILE_PIECE_SIZE;
+        for (size_t pos = 0, len = 0; pos < block.size(); pos += len) {
+            len = std::min<size_t>(chunk_sizer.size(), block.size() - pos);
+            if (credit && !credit->acquire(len)) {
+                return; // 接收方断开了
+            }
+            FileDataMsg data_msg = {};
+            data_msg.transfer_id = transfer_id;
+            data_msg.offset = offset;
+            data_msg.data_len = len;
+            const char* data = block.data() + pos;
+            uint8_t type = MSG_FILE_DATA;
+#ifdef HAVE_ZLIB
+            if (compressor && compressor->compress(data, len, packed)) {
+                data = packed.data();
+                data_msg.data_len = packed.size();
+                type = MSG_FILE_DATA_Z;
+            }
+#endif
+            if (!send_file_data(*receiver, data_msg, data, type)) {
+                return;
+            }
+            chunk_sizer.on_sent(receiver->fd, len);
+#ifdef HAVE_ZLIB
+            if (compressor) {
+                compressor->on_sent(len);
+            }
+#endif
+            offset += len;
+        }
+    }
+}
+
+// 老客户端的文件包：v1 帧头 + 旧结构体 + 数据
+std::vector<char> legacy_package(uint8_t type, const void* msg, size_t msg_size, const char* data = nullptr,
+                                 size_t data_len = 0) {
     Header header;
-    std::string username = "Unknown";
-    bool is_running = true;
+    header.length = msg_size + data_len;
+    header.type = type;
+    std::vector<char> package(sizeof(header) + header.length);
+    std::memcpy(package.data(), &header, sizeof(header));
+    std::memcpy(package.data() + sizeof(header), msg, msg_size);
+    if (data_len > 0) {
+        std::memcpy(package.data() + sizeof(header) + msg_size, data, data_len);
+    }
+    return package;
+}
 
-    while(is_running) {
-        // 依据规则先接收header的头部
-        if(!recv_exact(client_fd, &header, sizeof(header))) {
-            // log("Failed to receive header (Client disconnected or error)");
-            is_running = false;
-            break; // 必须 break，否则会继续执行后续逻辑
+// 老客户端不会接受邀约，文件直接按旧格式推给它：先发 LegacyFileMsg，再从头到尾按顺序发完数据块。
+// 和 serve_file 一样跟在上传后面读；不走数据连接、不压缩，也没有额度，靠发送队列的背压限速
+void serve_legacy(std::shared_ptr<Connection> receiver, FileMsg meta) {
+    std::lock_guard<std::mutex> lock(receiver->legacy_mutex);
+    LegacyFileMsg file_msg = {};
+    file_msg.sender_len = meta.sender_len;
+    std::memcpy(file_msg.sender, meta.sender, sizeof(file_msg.sender));
+    file_msg.filename_len = meta.filename_len;
+    std::memcpy(file_msg.filename, meta.filename, sizeof(file_msg.filename));
+    file_msg.file_size = meta.file_size;
+    // 文件元信息和数据块走同一个流，保证先到
+    const std::string flow = "legacy";
+    if (!receiver->outbox.push_bulk(flow, legacy_package(MSG_FILE, &file_msg, sizeof(file_msg)))) {
+        return;
+    }
+    log("Pushing " + std::string(meta.filename) + " to legacy client " + receiver->username);
+
+    LegacyFileDataMsg data_msg = {};
+    data_msg.sender_len = file_msg.sender_len;
+    std::memcpy(data_msg.sender, file_msg.sender, sizeof(data_msg.sender));
+    data_msg.filename_len = file_msg.filename_len;
+    std::memcpy(data_msg.filename, file_msg.filename, sizeof(data_msg.filename));
+    std::string file_hash = Sha256::to_hex(meta.file_hash);
+    StoreManifest manifest;
+    bool stored = false;
+    std::vector<char> block;
+    uint32_t piece_count = PieceMap::piece_count(meta.file_size);
+    for (uint32_t index = 0; index < piece_count; ++index) {
+        if (!load_piece(file_hash, index, meta.file_size, manifest, stored, block)) {
+            log("Stop pushing " + std::string(meta.filename) + " to " + receiver->username);
+            return;
+        }
+        for (size_t pos = 0, len = 0; pos < block.size(); pos += len) {
+            len = std::min<size_t>(LEGACY_CHUNK_SIZE, block.size() - pos);
+            data_msg.offset = (uint64_t)index * FILE_PIECE_SIZE + pos;
+            data_msg.data_len = len;
+            if (!receiver->outbox.push_bulk(
+                    flow, legacy_package(MSG_FILE_DATA, &data_msg, sizeof(data_msg), block.data() + pos, len))) {
+                return;
+            }
+        }
+    }
+}
+
+// 把文件邀约转给其他在线用户，对方接受后才会发送数据。老客户端不认识邀约，文件直接推给它
+void offer_file(int except_fd, const FileMsg& meta, uint32_t user_id) {
+    std::vector<char> package = make_package(MSG_FILE, meta);
+    for (const auto& conn : snapshot_clients(except_fd)) {
+        if (!conn->negotiated) {
+            std::thread legacy_thread(serve_legacy, conn, meta);
+            legacy_thread.detach();
+        } else if (!send_to(*conn, package, user_id)) {
+            log("Failed to send file offer to " + conn->username);
+        }
+    }
+}
+
+// 校验收齐的上传并切块入库。要把整个文件读一遍算哈希，放到单独的线程里做，
+// 同一条连接上还在传的其他文件不用等它
+void store_upload(std::string file_hash) {
+    size_t new_blocks = 0;
+    if (g_store.finish_upload(file_hash, &new_blocks)) {
+        log("File " + file_hash + " stored (" + std::to_string(new_blocks) + " new blocks)");
+    } else {
+        log("File " + file_hash + " failed verification, discarded");
+    }
+}
+
+// 老客户端发完的文件入库，然后像新客户端发的一样发出邀约。
+// 老客户端不能直连，邀约里不记发送方，接受的人都从服务器收
+void import_legacy(std::string path, FileMsg meta, int sender_fd, uint32_t user_id) {
+    std::string file_hash = Sha256::to_hex(meta.file_hash);
+    size_t new_blocks = 0;
+    if (!g_store.import_file(path, file_hash, meta.file_size, &new_blocks)) {
+        log("Failed to store legacy upload " + std::string(meta.filename));
+        return;
+    }
+    log("File " + file_hash + " stored (" + std::to_string(new_blocks) + " new blocks)");
+    {
+        std::lock_guard<std::mutex> lock(offers_mutex);
+        g_offers[file_hash] = FileOffer{meta, std::weak_ptr<Connection>()};
+    }
+    offer_file(sender_fd, meta, user_id);
+}
+
+// 每个接收方单独一个线程发送，不占用收发聊天消息的线程
+void start_serving(const std::shared_ptr<Connection>& receiver, const FileMsg& meta, const std::vector<uint8_t>& have,
+                   uint32_t max_chunk, uint32_t transfer_id, const std::shared_ptr<CreditWindow>& credit) {
+    std::thread serve_thread(serve_file, receiver, meta, have, max_chunk, transfer_id, credit);
+    serve_thread.detach();
+}
+
+// 文件数据走接收方的数据连接，登录连接只留给聊天、上下线这些要求及时送达的消息。
+// 有几条数据连接就把分片轮流分到几条上，每条连接一个发送线程；
+// 数据连接不够（还没连上或已断开）时就用现有的几条，一条都没有才退回登录连接。
+// 几条连接共用接收方给这个传输的额度
+void serve_striped(const std::shared_ptr<Connection>& receiver, const FileMsg& meta, const std::vector<uint8_t>& have,
+                   const FileRequestMsg& request) {
+    std::shared_ptr<CreditWindow> credit;
+    if (request.window != 0) {
+        // 同一传输重复请求（比如续传）时沿用还在发的那份额度，不重复加初始额度
+        std::lock_guard<std::mutex> lock(receiver->credits_mutex);
+        credit = receiver->credits[request.transfer_id].lock();
+        if (!credit) {
+            credit = std::make_shared<CreditWindow>(request.window);
+            receiver->credits[request.transfer_id] = credit;
+        }
+        for (auto it = receiver->credits.begin(); it != receiver->credits.end();) {
+            it = it->second.expired() ? receiver->credits.erase(it) : std::next(it); // 顺手清掉已经发完的
         }
-        // 接受body数据
-        std::vector<char> body(header.length);
-        if(!recv_exact(client_fd, body.data(), header.length)) {
+    }
+    std::vector<std::shared_ptr<Connection>> conns;
+    {
+        std::lock_guard<std::mutex> lock(clients_mutex);
+        for (const auto& weak : receiver->data_conns) {
+            std::shared_ptr<Connection> data_conn = weak.lock();
+            if (data_conn && conns.size() < request.streams) {
+                conns.push_back(data_conn);
+            }
+        }
+    }
+    if (conns.empty()) {
+        conns.push_back(receiver);
+    } else {
+        log("Serving " + std::string(meta.filename) + " to " + receiver->username + " over " +
+            std::to_string(conns.size()) + " connections");
+    }
+    for (uint32_t stripe = 0; stripe < conns.size(); ++stripe) {
+        start_serving(conns[stripe], meta, PieceMap::stripe_skip(have, meta.file_size, stripe, conns.size()),
+                      request.max_chunk, request.transfer_id, credit);
+    }
+}
+
+// 让发送方直连接收方：把接收方的地址和它给的一次性令牌转给发送方。
+// 转发失败返回 false，由调用方改为中转
+bool request_direct(const std::shared_ptr<Connection>& receiver, const std::shared_ptr<Connection>& sender,
+                    const FileMsg& meta, const FileRequestMsg& request, const std::vector<uint8_t>& have) {
+    struct sockaddr_in peer_addr;
+    socklen_t peer_len = sizeof(peer_addr);
+    if (getpeername(receiver->fd, (struct sockaddr*)&peer_addr, &peer_len) != 0 || peer_addr.sin_family != AF_INET) {
+        return false;
+    }
+
+    P2PConnectMsg connect_msg = {};
+    std::memcpy(connect_msg.file_hash, meta.file_hash, sizeof(connect_msg.file_hash));
+    connect_msg.peer_ip = peer_addr.sin_addr.s_addr;
+    connect_msg.peer_port = htons(request.p2p_port);
+    connect_msg.token = request.token;
+    connect_msg.max_chunk = request.max_chunk;
+    connect_msg.transfer_id = request.transfer_id;
+    connect_msg.bitmap_len = have.size();
+
+    {
+        std::lock_guard<std::mutex> lock(offers_mutex);
+        g_p2p_pending[request.token] = P2PPending{receiver, sender->fd, meta, have, request};
+    }
+    if (send_to(*sender, make_package(MSG_P2P_CONNECT, connect_msg, have.data()))) {
+        return true;
+    }
+    std::lock_guard<std::mutex> lock(offers_mutex);
+    g_p2p_pending.erase(request.token);
+    return false;
+}
+
+// 读一个包，v2 连接上的帧换回 v1 的包体，后面的处理不用管连接是哪个版本。
+// 连接断开返回 false；包不完整、v2 帧解不开时记一条日志再返回 false
+bool read_frame(Connection& conn, FrameReader& reader, Header& header, std::vector<char>& body) {
+    uint32_t length = 0;
+    if (!reader.read_header(header.type, length)) {
+        return false;
+    }
+    if (reader.version() == 1) {
+        header.length = length;
+        body.resize(length);
+        if (!reader.read(body.data(), length)) {
+            log("Failed to receive body"); // 不完整的包不能处理，否则文件数据块缺的部分会当成 0 写进文件
+            return false;
+        }
+        return true;
+    }
+    if (header.type == MSG_FILE_DATA || header.type == MSG_FILE_DATA_Z) {
+        // 数据直接读到 FileDataMsg 后面
+        FileDataMsg data_msg;
+        if (!v2_read_head(reader, length, data_msg)) {
+            log("Invalid v2 file data from " + conn.username);
+            return false;
+        }
+        body.resize(sizeof(data_msg) + data_msg.data_len);
+        std::memcpy(body.data(), &data_msg, sizeof(data_msg));
+        if (!reader.read(body.data() + sizeof(data_msg), data_msg.data_len)) {
             log("Failed to receive body");
-            is_running = false;
+            return false;
         }
+        header.length = body.size();
+        return true;
+    }
+    std::vector<char> frame(length);
+    if (!reader.read(frame.data(), length)) {
+        log("Failed to receive body");
+        return false;
+    }
+    uint32_t user_id = 0; // 客户端发来的用户编号没有意义，发送者就是这条连接的用户
+    if (!v2_decode_body(header.type, frame.data(), frame.size(), body, user_id)) {
+        log("Invalid v2 message type " + std::to_string(header.type) + " from " + conn.username);
+        return false;
+    }
+    header.length = body.size();
+    return true;
+}
 
-        switch (header.type) {
-            case MSG_LOGIN: {
-                username = std::string(body.data(), header.length);
-                
-                // 先发送当前所有在线用户给新登录的客户端
-                {
-                    std::lock_guard<std::mutex> lock(clients_mutex);
-                    for (const auto& client : clients) {
-                        if (client.first != client_fd) {
-                            // 发送已在线用户的信息
-                            std::string user_login = client.second + " connected";
-                            Header user_header;
-                            user_header.type = MSG_LOGIN;
-                            user_header.length = user_login.length();
-                            
-                            std::vector<char> user_package(sizeof(user_header) + user_login.length());
-                            std::memcpy(user_package.data(), &user_header, sizeof(user_header));
-                            std::memcpy(user_package.data() + sizeof(user_header), user_login.c_str(), user_login.length());
-                            send(client_fd, user_package.data(), user_package.size(), 0);
-                        }
-                    }
-                    // 将新用户添加到在线列表
-                    clients[client_fd] = username;
-                }
-                
-                log(username + " connected");
-                // 向其他人广播新用户上线了（使用完整的协议格式）
-                std::string login_broadcast = username + " connected";
-                Header login_header;
-                login_header.type = MSG_LOGIN;
-                login_header.length = login_broadcast.length();
-                
-                std::vector<char> login_package(sizeof(login_header) + login_broadcast.length());
-                std::memcpy(login_package.data(), &login_header, sizeof(login_header));
-                std::memcpy(login_package.data() + sizeof(login_header), login_broadcast.c_str(), login_broadcast.length());
-                broadcast(client_fd, login_package);
+// 一条客户端连接上的状态，和服务器处理的各种消息。收到的包由 dispatch_message 按类型交给对应的 handle
+struct ClientSession {
+    int client_fd;
+    std::shared_ptr<Connection> conn;
+    std::string username = "Unknown";
+    bool is_running = true;
+    bool is_data = false;                   // 数据连接只收发文件数据，不参与聊天
+    std::shared_ptr<UploadSet> uploading;   // 本用户正在上传的文件
+    std::weak_ptr<Connection> control;      // 本用户的登录连接，上传的额度从这里还给发送方
+    FrameReader reader;                     // 先按 v1 读，协商了 v2 再切换
+    bool first_frame = true;                // MSG_HELLO 只能是第一个包
+    bool key_pending = false;               // 协商了 FEATURE_ENCRYPT，下一个包必须是 MSG_KEY_EXCHANGE
+    HelloTranscript transcript = {};        // 收到和答复的 HELLO，派生密钥时用
+    std::vector<char> bundle_body;          // MSG_BUNDLE 里 v2 帧换回的 v1 包体
+    // 老客户端正在发的文件，key 为文件名（它的数据块只带文件名）
+    struct LegacyUpload {
+        LegacyFileMsg meta;
+        std::string path; // 临时文件
+        int fd = -1;
+        uint64_t received = 0;
+        Sha256 hasher;
+    };
+    std::map<std::string, LegacyUpload> legacy_uploads;
+#ifdef HAVE_ZLIB
+    std::unique_ptr<FrameDecompressor> decompressor; // 协商了 FEATURE_DEFLATE 才有
+    std::vector<char> inflated;             // MSG_COMPRESSED 解出来的帧
+    std::vector<char> compressed_body;      // 和它换回的 v1 包体
+    ChunkDecompressor chunk_decompressor;   // MSG_FILE_DATA_Z 的数据块
+    std::vector<char> chunk;                // 和解出来的数据
+#endif
+
+    explicit ClientSession(int fd)
+        : client_fd(fd), conn(std::make_shared<Connection>(fd)), uploading(std::make_shared<UploadSet>()),
+          control(conn), reader(fd) {
+        conn->uploads = uploading;
+    }
+
+    void run() {
+        Header header;
+        std::vector<char> body; // 各个包复用同一块缓冲区
+        while (is_running) {
+            // 依据规则先接收header的头部，再接收body数据
+            if (!read_frame(*conn, reader, header, body)) {
                 break;
             }
-            case MSG_CHAT: {
-                std::string message(body.data(), header.length);
-                log("Msg from " + username + ": " + message);
-                
-                // 构造带发送者信息的消息：格式为 "sender: message"
-                std::string formatted_msg = username + ": " + message;
-                Header new_header;
-                new_header.type = MSG_CHAT;
-                new_header.length = formatted_msg.length();
-                
-                std::vector<char> package(sizeof(new_header) + formatted_msg.length());
-                std::memcpy(package.data(), &new_header, sizeof(new_header));
-                std::memcpy(package.data() + sizeof(new_header), formatted_msg.c_str(), formatted_msg.length());
-                broadcast(client_fd, package);
+            if (is_data && header.type != MSG_FILE_DATA && header.type != MSG_FILE_DATA_Z) {
+                log("Invalid message on data connection of " + username);
                 break;
             }
-            case MSG_FILE: {
-                FileMsg* file_msg = (FileMsg*)body.data();
-                log(username + " is sending file: " + file_msg->filename + " (" + std::to_string(file_msg->file_size) + " bytes)");
-                
-                // 转发文件头信息包
-                std::vector<char> package(sizeof(header) + body.size());
-                std::memcpy(package.data(), &header, sizeof(header));
-                std::memcpy(package.data() + sizeof(header), body.data(), body.size());
-                broadcast(client_fd, package);
+            if (key_pending && header.type != MSG_KEY_EXCHANGE) {
+                log("Missing key exchange from " + username);
                 break;
             }
-            case MSG_FILE_DATA: {
-                // 转发文件数据块
-                std::vector<char> package(sizeof(header) + body.size());
-                std::memcpy(package.data(), &header, sizeof(header));
-                std::memcpy(package.data() + sizeof(header), body.data(), body.size());
-                broadcast(client_fd, package);
-                break;
+            if (!conn->negotiated && (header.type == MSG_FILE || header.type == MSG_FILE_DATA)) {
+                legacy_file(header.type, body);
+            } else if (!conn->negotiated && !legacy_message(header.type)) {
+                unhandled(header.type);
+            } else {
+                dispatch_message(*this, header.type, body);
             }
-            case MSG_PROGRESS: {
-                ProgressMsg* prog_msg = (ProgressMsg*)body.data();
-                // 计算百分比
-                double percent = (prog_msg->total_size > 0) ? 
-                                 (double)prog_msg->received_size / prog_msg->total_size * 100.0 : 0;
-                log("File transfer progress from " + username + ": " + std::to_string((int)percent) + "%");
-                
-                // 转发进度包
-                std::vector<char> package(sizeof(header) + body.size());
-                std::memcpy(package.data(), &header, sizeof(header));
-                std::memcpy(package.data() + sizeof(header), body.data(), body.size());
-                broadcast(client_fd, package);
-                break;
+            first_frame = false;
+        }
+        disconnect();
+    }
+
+    void handle(MessageTag<MSG_HELLO>, HelloMsg& request, const char*) {
+        if (!first_frame) {
+            log("Invalid hello message");
+            is_running = false;
+            return;
+        }
+        // 取双方都支持的版本和功能，答复还按 v1 发，之后两边都换成新版本
+        conn->negotiated = true;
+        HelloMsg reply = {};
+        reply.version = std::max<uint8_t>(1, std::min(request.version, PROTOCOL_VERSION));
+        reply.features = request.features & SUPPORTED_FEATURES;
+        if (reply.features & FEATURE_ENCRYPT) {
+            // 小包压缩流的输出长度会泄露内容（CRIME），加密时不用；文件数据块各自单独压，照旧
+            reply.features &= ~FEATURE_DEFLATE;
+        }
+        send_to(*conn, make_package(MSG_HELLO, reply));
+        transcript = HelloTranscript{request, reply};
+        conn->version = reply.version;
+        conn->features = reply.features;
+        key_pending = (reply.features & FEATURE_ENCRYPT) != 0;
+        reader.set_version(reply.version);
+#ifdef HAVE_ZLIB
+        if (reply.features & FEATURE_DEFLATE) {
+            // 答复已经放进队列了，不会被压缩；之后发往这个连接的小包都经过压缩流
+            auto compressor = std::make_shared<FrameCompressor>(reply.version);
+            conn->outbox.set_filter([compressor](std::vector<char>& frame) { return compressor->compress(frame); });
+            decompressor.reset(new FrameDecompressor());
+        }
+#endif
+    }
+
+#ifdef HAVE_OPENSSL
+    // 客户端的临时公钥：回一个自己的，回复之后发往这个连接的数据都加密，收到的从下一个包起都要解密
+    void handle(MessageTag<MSG_KEY_EXCHANGE>, KeyExchangeMsg& request, const char*) {
+        KeyExchange exchange;
+        KeyExchangeMsg reply = {};
+        std::memcpy(reply.public_key, exchange.public_key(), sizeof(reply.public_key));
+        std::unique_ptr<RecordCipher> send;
+        std::unique_ptr<RecordCipher> receive;
+        if (!key_pending || !exchange.ok() ||
+            !exchange.derive(request.public_key, false, &transcript, sizeof(transcript), send, receive)) {
+            invalid(MSG_KEY_EXCHANGE);
+            return;
+        }
+        key_pending = false;
+        conn->outbox.push_then_encrypt(encode_package(conn->version, MSG_KEY_EXCHANGE, reply), std::move(send));
+        reader.set_cipher(std::move(receive));
+    }
+#endif
+
+    void handle(MessageTag<MSG_LOGIN>, TextBody& text, const char*) {
+        username = std::string(text.data, text.length);
+        
+        // 先发送当前所有在线用户给新登录的客户端
+        {
+            std::lock_guard<std::mutex> lock(clients_mutex);
+            for (const auto& client : clients) {
+                if (client.first != client_fd) {
+                    // 发送已在线用户的信息
+                    std::string user_login = client.second->username + " connected";
+                    send_to(*conn, make_text_package(MSG_LOGIN, user_login), client.second->user_id);
+                }
             }
-            default:
-                log("Invalid message type");
-                is_running = false;
-                break;
+            // 将新用户添加到在线列表
+            conn->username = username;
+            conn->user_id = g_user_ids.intern(username);
+            clients[client_fd] = conn;
+            // 分配会话令牌，客户端开数据连接时带上它
+            static std::mt19937_64 rng(std::random_device{}());
+            while (conn->session == 0 || g_sessions.count(conn->session)) {
+                conn->session = rng();
+            }
+            g_sessions[conn->session] = conn;
+        }
+        SessionMsg session = {conn->session};
+        send_to(*conn, make_package(MSG_SESSION, session));
+        
+        log(username + " connected");
+        // 向其他人广播新用户上线了（使用完整的协议格式）
+        std::string login_broadcast = username + " connected";
+        broadcast(client_fd, make_text_package(MSG_LOGIN, login_broadcast), conn->user_id);
+    }
+
+    void handle(MessageTag<MSG_CHAT>, TextBody& text, const char*) {
+        std::string message(text.data, text.length);
+        log("Msg from " + username + ": " + message);
+        
+        // 构造带发送者信息的消息：格式为 "sender: message"
+        std::string formatted_msg = username + ": " + message;
+        broadcast(client_fd, make_text_package(MSG_CHAT, formatted_msg), conn->user_id);
+    }
+
+    void handle(MessageTag<MSG_FILE>, FileMsg& file_msg, const char*) {
+        // 发送者以连接为准，v2 的邀约本来就不带名字
+        std::memset(file_msg.sender, 0, sizeof(file_msg.sender));
+        std::strncpy(file_msg.sender, username.c_str(), sizeof(file_msg.sender) - 1);
+        file_msg.sender_len = std::strlen(file_msg.sender);
+        std::string file_hash = Sha256::to_hex(file_msg.file_hash);
+        log(username + " is sending file: " + file_msg.filename + " (" + std::to_string(file_msg.file_size) + " bytes)");
+        if (file_msg.file_size > MAX_FILE_SIZE) {
+            // 不登记也不转发，新客户端本来就不会发这么大的邀约
+            log("Rejected oversized file from " + username);
+            send_to(*conn, make_text_package(MSG_CHAT, "Server: file is too large, the file was not sent"));
+            return;
+        }
+        
+        {
+            std::lock_guard<std::mutex> lock(offers_mutex);
+            g_offers[file_hash] = FileOffer{file_msg, conn};
         }
 
+        // 先准备好上传再转发邀约，接收方一接受就能从 spill 文件里读到数据
+        FileStatusMsg status = {};
+        std::memcpy(status.file_hash, file_msg.file_hash, sizeof(status.file_hash));
+        status.max_chunk = MAX_CHUNK_SIZE;
+        std::vector<uint8_t> have;
+        std::vector<char> reply;
+        if (g_store.has_file(file_hash)) {
+            log("File " + file_hash + " already stored, upload skipped");
+            status.need_upload = 0;
+            reply = make_package(MSG_FILE_STATUS, status);
+        } else if (g_store.begin_upload(file_hash, file_msg.file_size, have)) {
+            status.need_upload = 1;
+            status.transfer_id = uploading->insert(file_hash);
+            status.window = (conn->features & FEATURE_CREDIT) ? TRANSFER_WINDOW : 0; // 0 表示不限
+            status.bitmap_len = have.size();
+            reply = make_package(MSG_FILE_STATUS, status, have.data());
+        } else {
+            // 别人正在上传同样的内容，接收方跟着那次上传的进度走
+            log("File " + file_hash + " is already being uploaded");
+            status.need_upload = 0;
+            reply = make_package(MSG_FILE_STATUS, status);
+        }
+
+        // 转发文件邀约，对方接受后才会发送数据
+        offer_file(client_fd, file_msg, conn->user_id);
 
+        // 告诉发送方是否还需要上传，需要的话附上服务器已有分片的位图
+        send_to(*conn, reply);
+        // 空文件，或者上次断线前其实已经收齐了
+        if (status.need_upload && g_store.upload_complete(file_hash) && g_store.finish_upload(file_hash)) {
+            uploading->erase(status.transfer_id);
+        }
     }
 
-    close(client_fd);
-    {
-        // 加锁消除数据
-        std::lock_guard<std::mutex> lock(clients_mutex);
-        clients.erase(client_fd);
+    void handle(MessageTag<MSG_FILE_DATA>, FileDataMsg& data_msg, const char* data) {
+        // 数据块只写一次 spill 文件，各接收方的发送线程自己从里面读
+        std::string file_hash;
+        if (!uploading->find(data_msg.transfer_id, file_hash)) {
+            log("File data for unknown transfer " + std::to_string(data_msg.transfer_id) + " from " + username);
+            return;
+        }
+        size_t data_len = data_msg.data_len;
+        bool complete = false;
+        bool stored = g_store.write_chunk(file_hash, data_msg.offset, data, data_len, complete);
+        // 写完（写失败的也算，数据已经从连接上取走了）攒够一批就把额度还给发送方
+        CreditMsg credit = {data_msg.transfer_id, uploading->consume(data_msg.transfer_id, data_len)};
+        std::shared_ptr<Connection> owner = control.lock();
+        if (credit.bytes > 0 && owner && (owner->features & FEATURE_CREDIT)) {
+            send_to(*owner, make_package(MSG_CREDIT, credit));
+        }
+        if (!stored) {
+            log("Failed to store file data for " + file_hash);
+            return;
+        }
+        if (complete) {
+            uploading->erase(data_msg.transfer_id);
+            std::thread store_thread(store_upload, file_hash);
+            store_thread.detach();
+        }
+    }
+
+    void handle(MessageTag<MSG_FILE_ACCEPT>, FileRequestMsg& request, const char* bitmap) {
+        std::string file_hash = Sha256::to_hex(request.file_hash);
+        std::vector<uint8_t> have(bitmap, bitmap + request.bitmap_len);
+
+        FileMsg meta = {};
+        std::shared_ptr<Connection> sender;
+        bool known = false;
+        {
+            std::lock_guard<std::mutex> lock(offers_mutex);
+            auto it = g_offers.find(file_hash);
+            if (it != g_offers.end()) {
+                meta = it->second.meta;
+                sender = it->second.sender.lock();
+                known = true;
+            }
+        }
+        if (!known) {
+            // 服务器重启过，邀约丢了，但存储里有这份内容的话照样可以续传
+            StoreManifest manifest;
+            if (!g_store.load_manifest(file_hash, manifest)) {
+                log(username + " requested unknown file " + file_hash);
+                return;
+            }
+            std::memcpy(meta.file_hash, request.file_hash, sizeof(meta.file_hash));
+            meta.file_size = manifest.file_size;
+            log(username + " resumed file " + file_hash);
+        } else {
+            log(username + " accepted file: " + meta.filename);
+        }
+        // 发送方还在线、接收方开了直连端口，就让双方直连，数据不经过服务器
+        if (request.p2p_port != 0 && sender && sender != conn &&
+            request_direct(conn, sender, meta, request, have)) {
+            log("Brokered direct transfer " + sender->username + " -> " + username);
+            return;
+        }
+        // 上传还没完成也马上开始发，按这个接收方自己的速度跟在上传后面
+        serve_striped(conn, meta, have, request);
+    }
+
+    // 同一用户的数据连接：按令牌找到登录连接并登记，之后这条连接只走文件数据
+    void handle(MessageTag<MSG_DATA_ATTACH>, SessionMsg& attach, const char*) {
+        if (conn->session != 0 || is_data) {
+            log("Invalid data attach message");
+            is_running = false;
+            return;
+        }
+        std::shared_ptr<Connection> owner;
+        {
+            std::lock_guard<std::mutex> lock(clients_mutex);
+            auto it = g_sessions.find(attach.token);
+            if (it != g_sessions.end()) {
+                owner = it->second.lock();
+            }
+            if (owner) {
+                auto& data_conns = owner->data_conns;
+                data_conns.erase(std::remove_if(data_conns.begin(), data_conns.end(),
+                                                [](const std::weak_ptr<Connection>& weak) { return weak.expired(); }),
+                                 data_conns.end());
+                data_conns.push_back(conn);
+                conn->username = owner->username;
+                if (std::shared_ptr<UploadSet> owner_uploads = owner->uploads.lock()) {
+                    uploading = owner_uploads;
+                }
+            }
+        }
+        if (!owner) {
+            log("Data connection with unknown session");
+            is_running = false;
+            return;
+        }
+        is_data = true;
+        control = owner;
+        username = owner->username + " (data)";
+        send_to(*conn, make_package(MSG_DATA_ATTACH, attach));
+        log(username + " attached");
+    }
+
+    // 接收方写完了一部分，给正在发这个传输的线程补上额度
+    void handle(MessageTag<MSG_CREDIT>, CreditMsg& credit, const char*) {
+        std::lock_guard<std::mutex> lock(conn->credits_mutex);
+        auto it = conn->credits.find(credit.transfer_id);
+        if (it == conn->credits.end()) {
+            return; // 直连传的，或者已经发完了
+        }
+        std::shared_ptr<CreditWindow> window = it->second.lock();
+        if (window && credit.bytes > 0) {
+            window->grant(credit.bytes);
+            return;
+        }
+        if (window) {
+            log(username + " cancelled transfer " + std::to_string(credit.transfer_id));
+            window->close(); // 在等额度的发送线程都停下
+        }
+        conn->credits.erase(it);
+    }
+
+    void handle(MessageTag<MSG_P2P_RESULT>, P2PResultMsg& result, const char*) {
+        P2PPending pending;
+        {
+            std::lock_guard<std::mutex> lock(offers_mutex);
+            auto it = g_p2p_pending.find(result.token);
+            if (it == g_p2p_pending.end() || it->second.sender_fd != client_fd) {
+                return;
+            }
+            pending = it->second;
+            g_p2p_pending.erase(it);
+        }
+        std::shared_ptr<Connection> receiver = pending.receiver.lock();
+        if (result.success) {
+            log("Direct transfer of " + std::string(pending.meta.filename) + " finished");
+        } else if (receiver) {
+            log("Direct transfer of " + std::string(pending.meta.filename) + " failed, relaying to " + receiver->username);
+            serve_striped(receiver, pending.meta, pending.have, pending.request);
+        }
     }
-    log(username + " disconnected");
-} 
 
-int main() {
+    void handle(MessageTag<MSG_PROGRESS>, ProgressMsg& prog_msg, const char*) {
+        std::memset(prog_msg.sender, 0, sizeof(prog_msg.sender));
+        std::strncpy(prog_msg.sender, username.c_str(), sizeof(prog_msg.sender) - 1);
+        prog_msg.sender_len = std::strlen(prog_msg.sender);
+        // 计算百分比
+        double percent = (prog_msg.total_size > 0) ? 
+                         (double)prog_msg.received_size / prog_msg.total_size * 100.0 : 0;
+        log("File transfer progress from " + username + ": " + std::to_string((int)percent) + "%");
+        
+        // 转发进度包
+        broadcast(client_fd, make_package(MSG_PROGRESS, prog_msg), conn->user_id);
+    }
+
+    // 从 in 取出一个按连接版本编码的完整帧分派，v2 的包体换回 v1 放进 body。MSG_BUNDLE、MSG_COMPRESSED 里面的帧用它。
+    // 握手、文件数据、MSG_BUNDLE 和外层同类型的帧不能放在里面，帧头不对时返回 false
+    bool dispatch_inner(BufferSource& in, uint8_t outer, std::vector<char>& body) {
+        uint8_t type = 0;
+        uint32_t length = 0;
+        if (!get_frame_header(in, conn->version, type, length) || length > in.remaining() || type == outer ||
+            type == MSG_BUNDLE || type == MSG_HELLO || type == MSG_DATA_ATTACH || type == MSG_FILE_DATA ||
+            type == MSG_FILE_DATA_Z || type == MSG_KEY_EXCHANGE) {
+            return false;
+        }
+        const char* frame = in.rest();
+        in.skip(length);
+        if (conn->version == 1) {
+            dispatch_message(*this, type, frame, length);
+            return true;
+        }
+        uint32_t user_id = 0;
+        if (!v2_decode_body(type, frame, length, body, user_id)) {
+            invalid(type);
+            return true;
+        }
+        dispatch_message(*this, type, body);
+        return true;
+    }
+
+    // 客户端把一小段时间里的几个小包合成一帧发来（见 SendQueue::set_batching）。
+    // 包体已经整个读进来了，在内存里逐个拆开分派，不用再为每个包读一次 socket
+    void handle(MessageTag<MSG_BUNDLE>, RawBody& bundle, const char*) {
+        BufferSource in(bundle.data, bundle.length);
+        while (in.remaining() > 0 && is_running) {
+            if (!dispatch_inner(in, MSG_BUNDLE, bundle_body)) {
+                invalid(MSG_BUNDLE);
+                return;
+            }
+        }
+    }
+
+#ifdef HAVE_ZLIB
+    // 压缩过的帧，用这条连接的解压流解开再分派（见 FrameCompressor.h）
+    void handle(MessageTag<MSG_COMPRESSED>, RawBody& compressed, const char*) {
+        if (!decompressor || !decompressor->decompress(compressed.data, compressed.length, inflated)) {
+            invalid(MSG_COMPRESSED);
+            return;
+        }
+        BufferSource in(inflated.data(), inflated.size());
+        if (!dispatch_inner(in, MSG_COMPRESSED, compressed_body) || in.remaining() > 0) {
+            invalid(MSG_COMPRESSED);
+        }
+    }
+
+    // 压缩过的文件数据块，解开后和 MSG_FILE_DATA 一样处理（见 ChunkCompressor.h）
+    void handle(MessageTag<MSG_FILE_DATA_Z>, FileDataMsg& data_msg, const char* data) {
+        size_t length = 0;
+        chunk.resize(MAX_CHUNK_SIZE);
+        if (!(conn->features & FEATURE_FILE_DEFLATE) ||
+            !chunk_decompressor.decompress(data, data_msg.data_len, chunk.data(), chunk.size(), length)) {
+            invalid(MSG_FILE_DATA_Z);
+            return;
+        }
+        data_msg.data_len = length;
+        handle(MessageTag<MSG_FILE_DATA>(), data_msg, chunk.data());
+    }
+#endif
+
+    // 包体太短、位图长度不对。握手用的 HELLO、KEY_EXCHANGE 和 DATA_ATTACH 出错时断开，
+    // 压缩的帧解不开时解压流已经对不上了，也断开；压缩的数据块解不开时这块数据就丢了、额度也还不回去，
+    // 也断开，客户端不会自动重连，重新发送同一文件时只补传缺少的分片；其他的跳过这个包
+    void invalid(uint8_t type) {
+        log("Invalid " + std::string(message_name(type)) + " message from " + username);
+        if (type == MSG_HELLO || type == MSG_KEY_EXCHANGE || type == MSG_DATA_ATTACH || type == MSG_COMPRESSED ||
+            type == MSG_FILE_DATA_Z) {
+            is_running = false;
+        }
+    }
+
+    // 老客户端发来的文件（见 LegacyFileMsg）：没有哈希，数据块紧跟着元信息按顺序到。
+    // 先写进临时文件、边收边算哈希，收齐后入库，再像新客户端发的一样发出邀约
+    void legacy_file(uint8_t type, const std::vector<char>& body) {
+        if (type == MSG_FILE) {
+            LegacyFileMsg file_msg;
+            if (body.size() < sizeof(file_msg)) {
+                invalid(type);
+                return;
+            }
+            std::memcpy(&file_msg, body.data(), sizeof(file_msg));
+            std::string filename = legacy_filename(file_msg.filename, file_msg.filename_len);
+            drop_legacy_upload(filename); // 同名的上一个没发完
+            log(username + " is sending file: " + filename + " (" + std::to_string(file_msg.file_size) +
+                " bytes, legacy client)");
+            if (conn->user_id == 0 || file_msg.file_size > MAX_FILE_SIZE) {
+                log("Rejected file from " + username);
+                send_to(*conn, make_text_package(MSG_CHAT, "Server: the file was not sent"));
+                return;
+            }
+            LegacyUpload& upload = legacy_uploads[filename];
+            upload.meta = file_msg;
+            upload.fd = g_store.create_temp(upload.path);
+            if (upload.fd < 0) {
+                log("Failed to create temp file for " + filename);
+                legacy_uploads.erase(filename);
+                return;
+            }
+            if (file_msg.file_size == 0) {
+                finish_legacy_upload(filename);
+            }
+            return;
+        }
+
+        LegacyFileDataMsg data_msg;
+        if (body.size() < sizeof(data_msg)) {
+            invalid(type);
+            return;
+        }
+        std::memcpy(&data_msg, body.data(), sizeof(data_msg));
+        if (body.size() - sizeof(data_msg) < data_msg.data_len) {
+            invalid(type);
+            return;
+        }
+        std::string filename = legacy_filename(data_msg.filename, data_msg.filename_len);
+        auto it = legacy_uploads.find(filename);
+        if (it == legacy_uploads.end()) {
+            return; // 被拒绝的文件，后面的数据块都丢掉
+        }
+        LegacyUpload& upload = it->second;
+        const char* data = body.data() + sizeof(data_msg);
+        if (data_msg.offset != upload.received || data_msg.data_len > upload.meta.file_size - upload.received ||
+            write(upload.fd, data, data_msg.data_len) != (ssize_t)data_msg.data_len) {
+            log("Failed to store legacy file data for " + filename);
+            drop_legacy_upload(filename);
+            return;
+        }
+        upload.hasher.update(data, data_msg.data_len);
+        upload.received += data_msg.data_len;
+        if (upload.received == upload.meta.file_size) {
+            finish_legacy_upload(filename);
+        }
+    }
+
+    static std::string legacy_filename(const char* filename, uint32_t filename_len) {
+        return std::string(filename, strnlen(filename, std::min<size_t>(filename_len, sizeof(LegacyFileMsg::filename))));
+    }
+
+    // 收齐了：交给单独的线程入库、发邀约
+    void finish_legacy_upload(const std::string& filename) {
+        LegacyUpload& upload = legacy_uploads[filename];
+        close(upload.fd);
+        FileMsg meta = {};
+        std::strncpy(meta.sender, username.c_str(), sizeof(meta.sender) - 1);
+        meta.sender_len = std::strlen(meta.sender);
+        std::strncpy(meta.filename, filename.c_str(), sizeof(meta.filename) - 1);
+        meta.filename_len = std::strlen(meta.filename);
+        meta.file_size = upload.meta.file_size;
+        upload.hasher.final(meta.file_hash);
+        std::thread import_thread(import_legacy, upload.path, meta, client_fd, conn->user_id);
+        import_thread.detach();
+        legacy_uploads.erase(filename);
+    }
+
+    // 没发完的老客户端上传，临时文件直接删掉
+    void drop_legacy_upload(const std::string& filename) {
+        auto it = legacy_uploads.find(filename);
+        if (it != legacy_uploads.end()) {
+            close(it->second.fd);
+            unlink(it->second.path.c_str());
+            legacy_uploads.erase(it);
+        }
+    }
+
+    // 服务器不处理的类型（包括更新的客户端才有的）跳过，包体已经读走了，不影响后面的包
+    void unhandled(uint8_t type) {
+        log("Ignored message type " + std::to_string(type) + " from " + username);
+    }
+
+    void disconnect() {
+        // 先 shutdown 让正在往这个连接发数据的线程尽快失败返回
+        shutdown(client_fd, SHUT_RDWR);
+        // 这个用户的其他连接都断开后，没传完的上传才会释放
+        uploading.reset();
+        while (!legacy_uploads.empty()) {
+            drop_legacy_upload(legacy_uploads.begin()->first);
+        }
+        {
+            // 加锁消除数据。数据连接由客户端在登录连接断开时自己关掉
+            std::lock_guard<std::mutex> lock(clients_mutex);
+            clients.erase(client_fd);
+            if (conn->session != 0) {
+                g_sessions.erase(conn->session);
+            }
+        }
+        // 这个连接还有没结束的直连发送，改由服务器中转给接收方
+        std::vector<P2PPending> orphaned;
+        {
+            std::lock_guard<std::mutex> lock(offers_mutex);
+            for (auto it = g_p2p_pending.begin(); it != g_p2p_pending.end();) {
+                if (it->second.sender_fd == client_fd) {
+                    orphaned.push_back(it->second);
+                    it = g_p2p_pending.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
+        for (const auto& pending : orphaned) {
+            if (std::shared_ptr<Connection> receiver = pending.receiver.lock()) {
+                serve_striped(receiver, pending.meta, pending.have, pending.request);
+            }
+        }
+        // 叫醒还在等这个接收方额度的发送线程
+        {
+            std::lock_guard<std::mutex> lock(conn->credits_mutex);
+            for (const auto& credit : conn->credits) {
+                if (std::shared_ptr<CreditWindow> window = credit.second.lock()) {
+                    window->close();
+                }
+            }
+        }
+        // 先停掉写线程再关闭，避免 fd 被复用后发错对象
+        conn->outbox.close();
+        close(client_fd);
+        log(username + " disconnected");
+#ifdef MESSAGE_STATS
+        log("Message stats:\n" + MessageStats::instance().report());
+#endif
+    }
+};
+
+void handle_client(int client_fd) {
+    ClientSession session(client_fd);
+    session.run();
+}
+
+int main(int argc, char* argv[]) {
     int server_fd, new_socket;
     struct sockaddr_in server_addr;
     int opt = 1;
     int addrlen = sizeof(server_addr);
     const int PORT = 8080;
 
+    // 对方断开后继续 send 会触发 SIGPIPE，忽略它，靠返回值处理
+    signal(SIGPIPE, SIG_IGN);
+
+    for (int i = 1; i < argc; ++i) {
+        if (std::string(argv[i]) == "--write-tick" && i + 1 < argc) {
+            g_write_tick = std::chrono::microseconds(atoi(argv[++i]));
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--write-tick <microseconds>]" << std::endl;
+            return -1;
+        }
+    }
 
     if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
         log("socket failed");
@@ -228,6 +1232,9 @@ int main() {
     }
 
     log("Server started on port " + std::to_string(PORT));
+    if (g_write_tick.count() > 0) {
+        log("Write tick: " + std::to_string(g_write_tick.count()) + "us");
+    }
 
     while (true) {
         if ((new_socket = accept(server_fd, (struct sockaddr *)&server_addr, (socklen_t*)&addrlen)) < 0) {
@@ -0,0 +1,151 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+// SHA-256 (FIPS 180-4)，用作文件内容地址，不依赖第三方库。
+class Sha256 {
+public:
+    static const size_t DIGEST_SIZE = 32;
+
+    Sha256() { reset(); }
+
+    void reset() {
+        static const uint32_t init[8] = {
+            0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+            0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+        };
+        std::memcpy(state_, init, sizeof(state_));
+        total_len_ = 0;
+        buffer_len_ = 0;
+    }
+
+    void update(const void* data, size_t len) {
+        const uint8_t* ptr = (const uint8_t*)data;
+        total_len_ += len;
+        // 先把上次剩下的不满 64 字节的数据补齐
+        if (buffer_len_ > 0) {
+            size_t take = std::min(len, sizeof(buffer_) - buffer_len_);
+            std::memcpy(buffer_ + buffer_len_, ptr, take);
+            buffer_len_ += take;
+            ptr += take;
+            len -= take;
+            if (buffer_len_ < sizeof(buffer_)) {
+                return;
+            }
+            transform(buffer_);
+            buffer_len_ = 0;
+        }
+        while (len >= sizeof(buffer_)) {
+            transform(ptr);
+            ptr += sizeof(buffer_);
+            len -= sizeof(buffer_);
+        }
+        std::memcpy(buffer_, ptr, len);
+        buffer_len_ = len;
+    }
+
+    void final(uint8_t digest[DIGEST_SIZE]) {
+        uint64_t bit_len = total_len_ * 8;
+        uint8_t pad = 0x80;
+        update(&pad, 1);
+        uint8_t zero = 0;
+        while (buffer_len_ != 56) {
+            update(&zero, 1);
+        }
+        uint8_t len_be[8];
+        for (int i = 0; i < 8; ++i) {
+            len_be[i] = (uint8_t)(bit_len >> (56 - 8 * i));
+        }
+        update(len_be, 8);
+        for (int i = 0; i < 8; ++i) {
+            digest[i * 4] = (uint8_t)(state_[i] >> 24);
+            digest[i * 4 + 1] = (uint8_t)(state_[i] >> 16);
+            digest[i * 4 + 2] = (uint8_t)(state_[i] >> 8);
+            digest[i * 4 + 3] = (uint8_t)state_[i];
+        }
+    }
+
+    // 十六进制形式，用作存储目录里的文件名
+    static std::string to_hex(const uint8_t digest[DIGEST_SIZE]) {
+        static const char* digits = "0123456789abcdef";
+        std::string hex(DIGEST_SIZE * 2, '0');
+        for (size_t i = 0; i < DIGEST_SIZE; ++i) {
+            hex[i * 2] = digits[digest[i] >> 4];
+            hex[i * 2 + 1] = digits[digest[i] & 0x0f];
+        }
+        return hex;
+    }
+
+    static bool from_hex(const std::string& hex, uint8_t digest[DIGEST_SIZE]) {
+        if (hex.size() != DIGEST_SIZE * 2) {
+            return false;
+        }
+        for (size_t i = 0; i < DIGEST_SIZE; ++i) {
+            int hi = hex_value(hex[i * 2]);
+            int lo = hex_value(hex[i * 2 + 1]);
+            if (hi < 0 || lo < 0) {
+                return false;
+            }
+            digest[i] = (uint8_t)(hi << 4 | lo);
+        }
+        return true;
+    }
+
+private:
+    static int hex_value(char c) {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    }
+
+    static uint32_t rotr(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+    void transform(const uint8_t block[64]) {
+        static const uint32_t k[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+        };
+        uint32_t w[64];
+        for (int i = 0; i < 16; ++i) {
+            w[i] = ((uint32_t)block[i * 4] << 24) | ((uint32_t)block[i * 4 + 1] << 16) |
+                   ((uint32_t)block[i * 4 + 2] << 8) | (uint32_t)block[i * 4 + 3];
+        }
+        for (int i = 16; i < 64; ++i) {
+            uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = state_[0], b = state_[1], c = state_[2], d = state_[3];
+        uint32_t e = state_[4], f = state_[5], g = state_[6], h = state_[7];
+        for (int i = 0; i < 64; ++i) {
+            uint32_t s1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+            uint32_t ch = (e & f) ^ (~e & g);
+            uint32_t t1 = h + s1 + ch + k[i] + w[i];
+            uint32_t s0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+            uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+            uint32_t t2 = s0 + maj;
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+        state_[0] += a; state_[1] += b; state_[2] += c; state_[3] += d;
+        state_[4] += e; state_[5] += f; state_[6] += g; state_[7] += h;
+    }
+
+    uint32_t state_[8];
+    uint64_t total_len_;
+    uint8_t buffer_[64];
+    size_t buffer_len_;
+};
+
+#endif // SHA256_H
@@ -12,15 +12,39 @@
 #include <cstring>
 #include <fstream>
 #include <algorithm>
+#include <csignal>
 #include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <chrono>
+#include <map>
+#include <unordered_map>
+#include <memory>
+#include <random>
+#include <atomic>
 #include "Protocol.h"
+#include "ProtocolV2.h"
+#include "MessageDispatch.h"
 #include "SafeQueue.h"
+#include "Sha256.h"
+#include "PieceMap.h"
+#include "DiskWriter.h"
+#include "ReadAhead.h"
+#include "ChunkSizer.h"
+#include "SendQueue.h"
+#include "CreditWindow.h"
+#include "FrameCompressor.h"
+#include "ChunkCompressor.h"
+#include "FrameCipher.h"
 #include "file_dialog.h"
 
 #define GL_SILENCE_DEPRECATION
 #include <GLFW/glfw3.h>
 
-const size_t CHUNK_SIZE = 4096; // 每次发送 4KB
+const uint64_t PROGRESS_INTERVAL = 256 * 1024; // 每发出 256KB 向服务器报告一次进度
+const auto SEND_BATCH_DELAY = std::chrono::microseconds(200); // 发往服务器的小包最多多等 200us，好和后面的一起发
+const size_t WRITE_QUEUE_BUDGET = 16 * 1024 * 1024; // 等待写盘的数据超过 16MB 才让网络线程停下来等
 
 struct ChatMessage {
     std::string sender;
@@ -36,11 +60,25 @@ struct FileTransferStatus {
     bool is_sending; // true=发送中, false=接收中
     bool completed; // 传输是否完成
     std::string saved_path; // 保存的完整路径（仅接收时使用）
+    std::string file_hash; // 内容哈希（十六进制），接收时用来对应邀约，发送时用来对应上传
+    uint32_t transfer_id = 0; // 接收时本地分配的传输编号，数据块按它对应到这一项
+    bool awaiting_accept = false; // 收到邀约，等用户点 Accept/Decline
 };
 
 struct AppContext {
     int sock = -1;
     bool is_connected = false;
+    bool auto_accept = false; // 收到文件邀约时自动接收
+    bool zero_copy = true; // 上传时用 sendfile 发送文件数据，关掉则走 read + send 的拷贝路径，便于对比速度
+    int read_ahead_buffers = 4; // 发送时提前读好的分片数（每个 1MB），--read-ahead 设置
+    int fixed_chunk_kb = 0; // 固定的数据块大小（KB），0 表示按实测吞吐量自动调整，--chunk-kb 设置
+    int fixed_streams = 0; // 固定的并行连接数，0 表示按文件大小和实测带宽自动选择，--streams 设置
+    bool require_encryption = false; // 和服务器协商不出加密时不连接
+    uint32_t server_ip = 0; // 服务器地址和端口，网络字节序，开数据连接时用
+    uint16_t server_port = 0;
+    uint64_t session_token = 0; // 登录后服务器下发的会话令牌，0 表示还没收到
+    int protocol_version = 1; // 和服务器 MSG_HELLO 协商出的线路格式版本和可选功能
+    uint32_t features = 0;
     std::string username;
     SafeQueue<std::string> recv_queue;
     std::vector<ChatMessage> chat_history;
@@ -50,22 +88,243 @@ struct AppContext {
 
 AppContext g_ctx;
 std::mutex g_ctx_mutex; // 保护 file_transfers
+// g_ctx.sock 的发送队列。多个线程都往服务器发包，由它的写线程统一写出：每个包完整写完，
+// 聊天、进度先于文件数据，几个同时上传的文件轮流发
+static std::unique_ptr<SendQueue> g_outbox;
+// 和服务器之间（登录连接、数据连接）用协商出的格式，只有网络线程读 g_ctx.sock
+static std::unique_ptr<FrameReader> g_reader;
+// 服务器分配的用户编号 -> 用户名，上线通知里带着，只有网络线程访问
+static std::unordered_map<uint32_t, std::string> g_user_names;
+#ifdef HAVE_ZLIB
+// 服务器发来的 MSG_COMPRESSED 用它解，协商了 FEATURE_DEFLATE 才有，只有网络线程用
+static std::unique_ptr<FrameDecompressor> g_decompressor;
+#endif
 
-// 接收文件的状态
-static std::ofstream g_current_file;
-static uint64_t g_expected_size = 0;
-static uint64_t g_received_size = 0;
-static std::string g_receiving_filename;
+// 收到的文件邀约和接收中的文件，key 为本地分配的传输编号，接受邀约时交给对方，数据块都带着它。
+// 几个文件同时接收（不同的发送方、中转和直连混着来）时各走各的，每个数据块查一次表就找到自己的文件。
+// 网络线程、数据连接和直连的接收线程都会访问，由 g_recv_mutex 保护。
+// 数据先写到 save_path.part，分片位图存到 save_path.part.map，断线重连后据此续传。
+// .part 一开始就按文件大小预分配，每个数据块按 offset 用 pwrite 写入，到达顺序无所谓
+struct RecvSession {
+    uint32_t transfer_id = 0;
+    std::string file_hash; // 内容哈希（十六进制）
+    std::string filename;
+    uint64_t expected_size = 0;
+    std::string save_path;
+    int fd = -1;
+    PieceMap pieces;
+    std::chrono::steady_clock::time_point start_time; // 第一个数据块到达的时间，用来测接收速度
+    uint64_t start_bytes = 0;                         // 那时已有的字节数（续传时不为 0）
+    CreditReturn credit{CREDIT_STEP};                 // 写完的数据攒够一批就把额度还给服务器
 
-bool send_package(int sock, int type, const void* data, size_t data_size) {
-    Header header;
-    header.length = data_size;
-    header.type = type;
-    std::vector<char> package(sizeof(header) + data_size);
-    std::memcpy(package.data(), &header, sizeof(header));
-    std::memcpy(package.data() + sizeof(header), data, data_size);
-    ssize_t sent = send(sock, package.data(), package.size(), 0);
-    return sent > 0;
+    RecvSession() = default;
+    RecvSession(const RecvSession& other) = delete;
+    RecvSession& operator=(const RecvSession& other) = delete;
+    ~RecvSession() {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+};
+static std::unordered_map<uint32_t, RecvSession> g_recv_sessions;
+static std::unordered_map<std::string, uint32_t> g_recv_ids; // 内容哈希 -> 传输编号，同一文件的邀约再来时找回原来的
+static uint32_t g_next_transfer_id = 1;
+static std::mutex g_recv_mutex;
+
+// 按内容哈希找到接收记录，没有就新建一个并分配传输编号。调用方需持有 g_recv_mutex
+RecvSession& recv_session_for(const std::string& file_hash) {
+    auto existing = g_recv_ids.find(file_hash);
+    if (existing != g_recv_ids.end()) {
+        return g_recv_sessions[existing->second];
+    }
+    uint32_t transfer_id = g_next_transfer_id++;
+    RecvSession& session = g_recv_sessions[transfer_id];
+    session.transfer_id = transfer_id;
+    session.file_hash = file_hash;
+    g_recv_ids[file_hash] = transfer_id;
+    return session;
+}
+
+// 对方发来的文件名只取最后一段，去掉 / 和 \ 前面的目录，保存时不会写到 downloads 外面。
+// 剩下空串、"." 或 ".." 时返回空串，这样的邀约不接收
+std::string safe_filename(const std::string& filename) {
+    std::string name = filename.substr(filename.find_last_of("/\\") + 1);
+    if (name.empty() || name == "." || name == ".." || name.find('\0') != std::string::npos) {
+        return "";
+    }
+    return name;
+}
+
+// 保存路径。同时收到同名的文件、或者之前已经收过同名的文件时，后来的加上序号，不写进同一个 .part、不覆盖。
+// 调用方需持有 g_recv_mutex
+std::string unique_save_path(const RecvSession& session) {
+    std::string path = "./downloads/" + session.filename;
+    for (int copy = 1;; ++copy) {
+        bool taken = access(path.c_str(), F_OK) == 0; // 之前收完的同名文件不覆盖
+        for (const auto& other : g_recv_sessions) {
+            if (&other.second != &session && other.second.save_path == path) {
+                taken = true;
+                break;
+            }
+        }
+        if (!taken) {
+            return path;
+        }
+        path = "./downloads/" + std::to_string(copy) + "_" + session.filename;
+    }
+}
+
+// 接收结束（收完或出错）后删掉记录。调用方需持有 g_recv_mutex
+void erase_recv_session(std::unordered_map<uint32_t, RecvSession>::iterator it) {
+    g_recv_ids.erase(it->second.file_hash);
+    g_recv_sessions.erase(it);
+}
+
+// 已发出 MSG_FILE、等待服务器答复 MSG_FILE_STATUS 的上传，key 为内容哈希
+struct PendingUpload {
+    std::string filepath;
+    std::string filename;
+    uint64_t file_size;
+    uint8_t file_hash[32];
+};
+static std::map<std::string, PendingUpload> g_pending_uploads;
+// 本次登录发出过的文件，服务器要求直连时按内容哈希找回本地路径
+static std::map<std::string, PendingUpload> g_shared_files;
+static std::mutex g_pending_mutex; // 保护 g_pending_uploads 和 g_shared_files
+// 正在上传到服务器的文件的发送额度，key 为服务器分配的传输编号，服务器写完一部分就用 MSG_CREDIT 补上
+static std::map<uint32_t, std::shared_ptr<CreditWindow>> g_upload_credits;
+static std::mutex g_upload_credits_mutex;
+
+// 点对点直连：接收方监听一个临时端口，接受邀约时把端口和一次性令牌交给服务器，
+// 服务器再转给发送方，由发送方直接连过来发数据。令牌用过一次就删除
+static int g_p2p_listen_fd = -1;
+static uint16_t g_p2p_port = 0;
+static std::map<uint64_t, uint32_t> g_p2p_tokens; // 令牌 -> 接收方的传输编号
+static std::mutex g_p2p_mutex;
+const int P2P_CONNECT_TIMEOUT_MS = 3000;
+
+// 数据连接：连到同一服务器、凭会话令牌绑定到本用户的额外连接，和服务器之间的文件数据都走这里，
+// 登录连接只收发聊天、上下线、进度这些小包，大文件传输时聊天也不用排在几 MB 的数据后面。
+// 大文件的分片轮流分到几条数据连接上同时发（第 k 条发 index % N == k 的分片），接收方按 offset 写入。
+// 建好后一直复用到断开服务器。
+// 和登录连接一样，每条数据连接有自己的发送队列，同时上传的几个文件在上面轮流发。
+// 数据连接关闭前要等手上的发送结束，所以 fd 在最后一个引用释放时才关
+struct DataChannel {
+    int fd;
+    SendQueue outbox;
+    FrameReader reader;
+
+    explicit DataChannel(int channel_fd) : fd(channel_fd), outbox(channel_fd), reader(channel_fd) {}
+    DataChannel(const DataChannel& other) = delete;
+    DataChannel& operator=(const DataChannel& other) = delete;
+    ~DataChannel() {
+        outbox.close(); // 先停掉写线程再关闭
+        close(fd);
+    }
+};
+static std::vector<std::shared_ptr<DataChannel>> g_data_channels;
+static std::mutex g_data_mutex;      // 保护 g_data_channels
+static std::mutex g_data_open_mutex; // 同一时间只有一个线程在建数据连接，避免多建
+const int MAX_STREAMS = 4;
+const uint64_t STRIPE_MIN_BYTES = 16 * 1024 * 1024; // 每条连接至少分到 16MB 才值得多开一条
+// 最近一次传输实测的速度（字节/秒），0 表示还没测过
+static std::atomic<double> g_measured_bandwidth(0);
+
+bool recv_exact(int sock, void* buffer, size_t length) {
+    size_t received = 0;
+    char* ptr = (char*)buffer;
+    while (received < length) {
+        ssize_t result = recv(sock, ptr + received, length - received, 0);
+        if (result <= 0) {
+            return false;
+        }
+        received += result;
+    }
+    return true;
+}
+
+// 计算文件内容的 SHA-256，服务器据此判断是否已有相同文件
+bool hash_file(const std::string& filepath, uint8_t digest[32]) {
+    std::ifstream file(filepath, std::ios::binary);
+    if (!file) {
+        return false;
+    }
+    Sha256 hasher;
+    std::vector<char> buffer(1024 * 1024);
+    while (file) {
+        file.read(buffer.data(), buffer.size());
+        hasher.update(buffer.data(), file.gcount());
+    }
+    hasher.final(digest);
+    return true;
+}
+
+// 服务器连接和数据连接的包交给它们的发送队列；直连的 socket 只有一个线程在用，没有队列
+SendQueue* outbox_for(int sock) {
+    if (sock == g_ctx.sock) {
+        return g_outbox.get();
+    }
+    std::lock_guard<std::mutex> lock(g_data_mutex);
+    for (const auto& channel : g_data_channels) {
+        if (channel->fd == sock) {
+            return &channel->outbox; // 发送方持有这条连接的引用，队列不会失效
+        }
+    }
+    return nullptr;
+}
+
+bool send_all(int sock, const void* data, size_t length, int flags = 0) {
+    const char* ptr = (const char*)data;
+    while (length > 0) {
+        ssize_t sent = send(sock, ptr, length, flags);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return false;
+        }
+        ptr += sent;
+        length -= sent;
+    }
+    return true;
+}
+
+// 发往服务器的包（有发送队列的连接）用协商出的格式，直连发的是 v1 包
+int package_version(int sock, SendQueue*& outbox) {
+    outbox = outbox_for(sock);
+    return outbox ? g_ctx.protocol_version : 1;
+}
+
+bool send_encoded(int sock, SendQueue* outbox, uint8_t type, std::vector<char> package) {
+    if (outbox) {
+        return outbox->push(send_class(type), std::move(package));
+    }
+    return send_all(sock, package.data(), package.size());
+}
+
+// tail 是跟在结构体后面的位图
+template <typename Msg>
+bool send_package(int sock, uint8_t type, const Msg& msg, const void* tail = nullptr) {
+    SendQueue* outbox;
+    int version = package_version(sock, outbox);
+    return send_encoded(sock, outbox, type, encode_package(version, type, msg, tail));
+}
+
+bool send_text(int sock, uint8_t type, const std::string& text) {
+    SendQueue* outbox;
+    int version = package_version(sock, outbox);
+    return send_encoded(sock, outbox, type, encode_text_package(version, type, text));
+}
+
+// 传输列表里这份内容还没完成的上传，调用时持有 g_ctx_mutex。
+// 按内容哈希找，不同目录里的同名文件不会串到一起；找不到返回 nullptr
+FileTransferStatus* find_sending_transfer(const std::string& file_hash) {
+    for (auto& transfer : g_ctx.file_transfers) {
+        if (transfer.is_sending && !transfer.completed && transfer.file_hash == file_hash) {
+            return &transfer;
+        }
+    }
+    return nullptr;
 }
 
 void send_file(const std::string& filepath) {
@@ -77,11 +336,25 @@ void send_file(const std::string& filepath) {
     }
     
     uint64_t file_size = file.tellg();
-    file.seekg(0, std::ios::beg);
+    file.close();
+    if (file_size > MAX_FILE_SIZE) {
+        g_ctx.recv_queue.push("SYSTEM:File is too large to send: " + filepath);
+        return;
+    }
     
     // 提取文件名
     std::string filename = filepath.substr(filepath.find_last_of("/\\") + 1);
     
+    // 1. 计算内容哈希，传输列表里的这一项和之后的进度都按它对应
+    PendingUpload upload;
+    upload.filepath = filepath;
+    upload.filename = filename;
+    upload.file_size = file_size;
+    if (!hash_file(filepath, upload.file_hash)) {
+        g_ctx.recv_queue.push("SYSTEM:Failed to read file: " + filepath);
+        return;
+    }
+    
     // 添加到传输列表
     {
         std::lock_guard<std::mutex> lock(g_ctx_mutex);
@@ -93,206 +366,1192 @@ void send_file(const std::string& filepath) {
         status.is_sending = true;
         status.completed = false;
         status.saved_path = "";
+        status.file_hash = Sha256::to_hex(upload.file_hash);
         g_ctx.file_transfers.push_back(status);
     }
+    {
+        std::lock_guard<std::mutex> lock(g_pending_mutex);
+        g_pending_uploads[Sha256::to_hex(upload.file_hash)] = upload;
+        g_shared_files[Sha256::to_hex(upload.file_hash)] = upload;
+    }
     
-    // 1. 发送文件元信息
+    // 2. 发送文件元信息，是否上传由服务器的 MSG_FILE_STATUS 决定
     FileMsg file_msg = {};
     strncpy(file_msg.sender, g_ctx.username.c_str(), sizeof(file_msg.sender) - 1);
     file_msg.sender_len = g_ctx.username.length();
     strncpy(file_msg.filename, filename.c_str(), sizeof(file_msg.filename) - 1);
     file_msg.filename_len = filename.length();
     file_msg.file_size = file_size;
+    std::memcpy(file_msg.file_hash, upload.file_hash, sizeof(file_msg.file_hash));
     
-    if (!send_package(g_ctx.sock, MSG_FILE, &file_msg, sizeof(file_msg))) {
+    if (!send_package(g_ctx.sock, MSG_FILE, file_msg)) {
         g_ctx.recv_queue.push("SYSTEM:Failed to send file metadata");
-        return;
+    }
+}
+
+// 一次上传的进度。分成几条连接并行发送时，各条连接一起累加
+struct UploadProgress {
+    std::atomic<uint64_t> done{0};        // 对方已有的加上已经发出的字节数
+    std::atomic<uint64_t> last_report{0}; // 上次向服务器报告进度时的 done
+    std::mutex mutex;                     // 保护下面两项，各条连接发完时写入，用于完成提示
+    std::string method;
+    uint32_t chunk_size = 0;
+};
+
+// 按分片分块发送文件数据，skip 中标记的分片不发（对方已经有了，或者归别的连接发）。
+// 数据块放进 out 这个连接的发送队列，以文件哈希作为一个传输，和同一连接上的其他传输轮流发出。
+// 每个数据块带上对方给这次传输分配的 transfer_id，credit 不为空时先扣对方给的额度，不够就等。
+// progress 不为空时是上传到服务器，更新界面和服务器上的进度；为空时 out 是直连接收方的连接。
+// 读盘和发送同时进行：sendfile 路径让内核提前预读后面的分片，拷贝路径由 ReadAhead 线程提前读好。
+// 数据块大小不超过对方给的 max_chunk，由 ChunkSizer 按实测吞吐量调整。
+// 服务器支持 FEATURE_FILE_DEFLATE 时压得动的数据块压缩后发（见 ChunkCompressor.h），直连的接收方没有协商，不压
+bool upload_file(SendQueue& out, const PendingUpload& upload, uint32_t transfer_id, const std::vector<uint8_t>& skip,
+                 uint32_t max_chunk, CreditWindow* credit, UploadProgress* progress) {
+    std::string file_hash = Sha256::to_hex(upload.file_hash);
+    uint64_t file_size = upload.file_size;
+    int file_fd = open(upload.filepath.c_str(), O_RDONLY);
+    if (file_fd < 0) {
+        g_ctx.recv_queue.push("SYSTEM:Failed to open file: " + upload.filepath);
+        return false;
+    }
+    size_t depth = std::max(1, g_ctx.read_ahead_buffers);
+    bool zero_copy = g_ctx.zero_copy;
+    std::unique_ptr<ReadAhead> read_ahead;
+    if (zero_copy) {
+#ifdef POSIX_FADV_SEQUENTIAL
+        posix_fadvise(file_fd, 0, 0, POSIX_FADV_SEQUENTIAL); // 顺序读，让内核加大预读窗口
+#endif
+    } else {
+        read_ahead.reset(new ReadAhead(file_fd, file_size, skip, depth));
     }
     
-    // 2. 分块发送文件数据
-    std::vector<char> buffer(CHUNK_SIZE);
-    uint64_t sent = 0;
+    std::string flow((const char*)upload.file_hash, sizeof(upload.file_hash));
+    int version = outbox_for(out.fd()) ? g_ctx.protocol_version : 1; // 直连用的队列不在表里，发 v1 包
+    std::vector<char> packed; // 压缩后的数据块
+#ifdef HAVE_ZLIB
+    std::unique_ptr<ChunkCompressor> compressor;
+    if (outbox_for(out.fd()) && (g_ctx.features & FEATURE_FILE_DEFLATE)) {
+        compressor.reset(new ChunkCompressor());
+    }
+#endif
+    ReadAhead::Block block;
+    ChunkSizer chunk_sizer(max_chunk, g_ctx.fixed_chunk_kb * 1024);
+    bool ok = true;
+    uint32_t piece_count = PieceMap::piece_count(file_size);
+    uint32_t piece = 0;
     
-    while (sent < file_size && g_ctx.is_connected) {
-        size_t to_read = std::min((uint64_t)CHUNK_SIZE, file_size - sent);
-        file.read(buffer.data(), to_read);
-        
-        // 构造 FileDataMsg
-        FileDataMsg data_msg = {};
-        strncpy(data_msg.sender, g_ctx.username.c_str(), sizeof(data_msg.sender) - 1);
-        data_msg.sender_len = g_ctx.username.length();
-        strncpy(data_msg.filename, filename.c_str(), sizeof(data_msg.filename) - 1);
-        data_msg.filename_len = filename.length();
-        data_msg.offset = sent;
-        data_msg.data_len = to_read;
-        
-        // 发送包含数据的完整包
-        std::vector<char> package(sizeof(data_msg) + to_read);
-        std::memcpy(package.data(), &data_msg, sizeof(data_msg));
-        std::memcpy(package.data() + sizeof(data_msg), buffer.data(), to_read);
-        
-        if (!send_package(g_ctx.sock, MSG_FILE_DATA, package.data(), package.size())) {
-            g_ctx.recv_queue.push("SYSTEM:Failed to send file data");
-            break;
+    for (; piece < piece_count && ok && g_ctx.is_connected; ++piece) {
+        if (PieceMap::test_bit(skip, piece)) {
+            continue;
+        }
+        uint64_t piece_offset = (uint64_t)piece * FILE_PIECE_SIZE;
+        uint32_t piece_len = PieceMap::piece_length(file_size, piece);
+        const char* piece_data = nullptr;
+        if (read_ahead) {
+            if (!read_ahead->next(block)) {
+                g_ctx.recv_queue.push("SYSTEM:Failed to read file: " + upload.filepath);
+                ok = false;
+                break;
+            }
+            piece_data = block.data.data();
+        } else if (zero_copy) {
+#ifdef POSIX_FADV_WILLNEED
+            // 发这一片的时候，让内核在后台把后面几片读进页缓存
+            posix_fadvise(file_fd, piece_offset + piece_len, (off_t)FILE_PIECE_SIZE * depth, POSIX_FADV_WILLNEED);
+#endif
         }
         
-        sent += to_read;
-        
-        // 更新进度
-        {
-            std::lock_guard<std::mutex> lock(g_ctx_mutex);
-            for (auto& transfer : g_ctx.file_transfers) {
-                if (transfer.filename == filename && transfer.is_sending) {
-                    transfer.sent_size = sent;
-                    transfer.progress = (float)sent / file_size;
-                    break;
+        for (uint32_t pos = 0, to_read = 0; pos < piece_len; pos += to_read) {
+            to_read = std::min(chunk_sizer.size(), piece_len - pos); // 数据块不跨片
+            if (credit && !credit->acquire(to_read)) {
+                ok = false; // 断开了
+                break;
+            }
+            
+            // 构造 FileDataMsg
+            FileDataMsg data_msg = {};
+            data_msg.transfer_id = transfer_id;
+            data_msg.offset = piece_offset + pos;
+            data_msg.data_len = to_read;
+            
+            // 零拷贝时只拼包头，数据由写线程用 sendfile 从文件发出；拷贝路径把预读好的数据拼进包里，
+            // 压缩过的数据块也一样
+            bool compressed = false;
+#ifdef HAVE_ZLIB
+            if (compressor) {
+                compressed = piece_data ? compressor->compress(piece_data + pos, to_read, packed)
+                                        : compressor->compress(file_fd, data_msg.offset, to_read, packed);
+            }
+#endif
+            if (compressed) {
+                data_msg.data_len = packed.size();
+            }
+            char head[FILE_DATA_HEAD_MAX];
+            size_t head_size =
+                encode_file_data_head(version, data_msg, head, compressed ? MSG_FILE_DATA_Z : MSG_FILE_DATA);
+            std::vector<char> package;
+            package.reserve(head_size + (compressed ? packed.size() : piece_data ? to_read : 0));
+            package.insert(package.end(), head, head + head_size);
+            if (compressed) {
+                package.insert(package.end(), packed.begin(), packed.end());
+                ok = out.push_bulk(flow, std::move(package), head_size);
+            } else if (piece_data) {
+                package.insert(package.end(), piece_data + pos, piece_data + pos + to_read);
+                ok = out.push_bulk(flow, std::move(package), head_size);
+            } else {
+                ok = out.push_bulk(flow, std::move(package), file_fd, data_msg.offset, to_read);
+            }
+            if (!ok) {
+                break;
+            }
+            
+            chunk_sizer.on_sent(out.fd(), to_read);
+#ifdef HAVE_ZLIB
+            if (compressor) {
+                compressor->on_sent(to_read);
+            }
+#endif
+            if (!progress) {
+                continue; // 直连发送不占用界面上的上传进度
+            }
+            uint64_t done = progress->done += to_read;
+            
+            // 更新进度
+            {
+                std::lock_guard<std::mutex> lock(g_ctx_mutex);
+                if (FileTransferStatus* transfer = find_sending_transfer(file_hash)) {
+                    transfer->sent_size = done;
+                    transfer->progress = (float)done / file_size;
                 }
             }
+            
+            // 发送进度更新，几条连接同时发时只由其中一条报告
+            uint64_t last_report = progress->last_report;
+            if ((done - last_report >= PROGRESS_INTERVAL || done == file_size) && done > last_report &&
+                progress->last_report.compare_exchange_strong(last_report, done)) {
+                ProgressMsg prog = {};
+                strncpy(prog.sender, g_ctx.username.c_str(), sizeof(prog.sender) - 1);
+                prog.sender_len = g_ctx.username.length();
+                prog.total_size = file_size;
+                prog.received_size = done;
+                send_package(g_ctx.sock, MSG_PROGRESS, prog);
+            }
         }
-        
-        // 发送进度更新
-        if (sent % (CHUNK_SIZE * 10) == 0 || sent == file_size) { // 每10个块发送一次进度
-            ProgressMsg prog = {};
-            strncpy(prog.sender, g_ctx.username.c_str(), sizeof(prog.sender) - 1);
-            prog.sender_len = g_ctx.username.length();
-            prog.total_size = file_size;
-            prog.received_size = sent;
-            send_package(g_ctx.sock, MSG_PROGRESS, &prog, sizeof(prog));
+        if (read_ahead) {
+            read_ahead->release(std::move(block));
         }
     }
     
-    file.close();
+    bool used_read_ahead = read_ahead != nullptr;
+    read_ahead.reset(); // 先停掉读线程再关文件
+    ok = out.flush(flow) && ok; // 写线程还要从文件里读数据，发完才能关
+    close(file_fd);
+    if (progress) {
+        std::lock_guard<std::mutex> lock(progress->mutex);
+        progress->method = used_read_ahead ? "copy, read-ahead" : out.sendfile_supported() ? "sendfile" : "copy";
+        if (!used_read_ahead && (g_ctx.features & FEATURE_ENCRYPT)) {
+            progress->method = "read, encrypted"; // 加密时发送队列把文件数据读出来加密再发，不走 sendfile
+        }
+        progress->chunk_size = std::max(progress->chunk_size, chunk_sizer.size());
+    }
+    return ok && piece == piece_count;
+}
+
+// 带超时的 connect，对方不可达时不用等到系统默认的超时
+int connect_with_timeout(uint32_t ip, uint16_t port, int timeout_ms) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        return -1;
+    }
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = ip;
+    addr.sin_port = port;
+    int flags = fcntl(sock, F_GETFL, 0);
+    fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+    int result = connect(sock, (struct sockaddr*)&addr, sizeof(addr));
+    if (result < 0 && errno == EINPROGRESS) {
+        struct pollfd pfd = {sock, POLLOUT, 0};
+        int error = 0;
+        socklen_t len = sizeof(error);
+        if (poll(&pfd, 1, timeout_ms) == 1 && getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &len) == 0 && error == 0) {
+            result = 0;
+        }
+    }
+    if (result < 0) {
+        close(sock);
+        return -1;
+    }
+    fcntl(sock, F_SETFL, flags);
+    return sock;
+}
+
+// 服务器转来的直连请求：连上接收方，只发它缺少的分片。直连失败时告诉服务器改为中转
+void send_direct(P2PConnectMsg request, std::vector<uint8_t> have) {
+    std::string file_hash = Sha256::to_hex(request.file_hash);
+    PendingUpload upload;
+    bool found = false;
+    {
+        std::lock_guard<std::mutex> lock(g_pending_mutex);
+        auto it = g_shared_files.find(file_hash);
+        if (it != g_shared_files.end()) {
+            upload = it->second;
+            found = true;
+        }
+    }
+
+    bool success = false;
+    int sock = found ? connect_with_timeout(request.peer_ip, request.peer_port, P2P_CONNECT_TIMEOUT_MS) : -1;
+    if (sock >= 0) {
+        P2PHelloMsg hello = {};
+        std::memcpy(hello.file_hash, request.file_hash, sizeof(hello.file_hash));
+        hello.token = request.token;
+        if (send_package(sock, MSG_P2P_HELLO, hello)) {
+            SendQueue out(sock);
+            // 直连只传这一个文件，接收方写盘慢时 TCP 自己会让发送方停下，不需要额度
+            success = upload_file(out, upload, request.transfer_id, have, request.max_chunk, nullptr, nullptr);
+        }
+        close(sock);
+    }
+
+    P2PResultMsg result = {};
+    std::memcpy(result.file_hash, request.file_hash, sizeof(result.file_hash));
+    result.token = request.token;
+    result.success = success;
+    send_package(g_ctx.sock, MSG_P2P_RESULT, result);
+    if (found) {
+        g_ctx.recv_queue.push(success ? "SYSTEM:File sent directly to peer: " + upload.filename
+                                      : "SYSTEM:Direct transfer failed, relaying via server: " + upload.filename);
+    }
+}
+
+// 接受邀约时生成一次性令牌，连同直连端口一起交给服务器；监听没开起来就只走中转。
+// 直连不加密，和服务器的连接加密时也只走中转
+void fill_p2p_request(FileRequestMsg& request) {
+    static std::mt19937_64 rng(std::random_device{}());
+    std::lock_guard<std::mutex> lock(g_p2p_mutex);
+    if (g_p2p_port == 0 || (g_ctx.features & FEATURE_ENCRYPT)) {
+        return;
+    }
+    uint64_t token = 0;
+    while (token == 0 || g_p2p_tokens.count(token)) {
+        token = rng();
+    }
+    g_p2p_tokens[token] = request.transfer_id;
+    request.p2p_port = g_p2p_port;
+    request.token = token;
+}
+
+// 按文件大小一次性分配好磁盘空间，避免边写边扩展造成碎片，磁盘空间不够时也能提前发现。
+// 已有的数据不受影响，续传时可以直接用
+bool preallocate(int fd, uint64_t size) {
+    if (size == 0) {
+        return true;
+    }
+#if defined(__linux__)
+    return posix_fallocate(fd, 0, size) == 0;
+#elif defined(__APPLE__)
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        return false;
+    }
+    if ((uint64_t)st.st_size < size) {
+        // 先尝试分配连续空间，不行再退而求其次
+        fstore_t store = {F_ALLOCATECONTIG, F_PEOFPOSMODE, 0, (off_t)(size - st.st_size), 0};
+        if (fcntl(fd, F_PREALLOCATE, &store) == -1) {
+            store.fst_flags = F_ALLOCATEALL;
+            if (fcntl(fd, F_PREALLOCATE, &store) == -1) {
+                return false;
+            }
+        }
+        return ftruncate(fd, size) == 0;
+    }
+    return true;
+#else
+    struct stat st;
+    return fstat(fd, &st) == 0 && ((uint64_t)st.st_size >= size || ftruncate(fd, size) == 0);
+#endif
+}
+
+// 写入一个收到的数据块，服务器中转和直连收到的数据都走这里
+// 还给服务器 bytes 字节的额度，为 0 时不用还（直连的数据也算，服务器不认识的传输编号会忽略）
+void return_credit(uint32_t transfer_id, uint32_t bytes) {
+    CreditMsg credit = {transfer_id, bytes};
+    if (credit.bytes > 0 && (g_ctx.features & FEATURE_CREDIT)) {
+        send_package(g_ctx.sock, MSG_CREDIT, credit);
+    }
+}
+
+// 接收中的文件出错、不再接收时告诉服务器停下这个传输（额度为 0 的 MSG_CREDIT），然后丢掉接收状态
+void cancel_recv_session(std::unordered_map<uint32_t, RecvSession>::iterator it) {
+    CreditMsg cancel = {it->second.transfer_id, 0};
+    if (g_ctx.features & FEATURE_CREDIT) {
+        send_package(g_ctx.sock, MSG_CREDIT, cancel);
+    }
+    erase_recv_session(it);
+}
+
+// 收到的每个数据块不管写没写进文件都要还额度，否则服务器那边的额度越用越少，最后停住
+void receive_file_data(const FileDataMsg& data_msg, const char* file_data, size_t data_len) {
+    std::lock_guard<std::mutex> recv_lock(g_recv_mutex);
+    auto it = g_recv_sessions.find(data_msg.transfer_id);
+    if (it == g_recv_sessions.end()) {
+        return_credit(data_msg.transfer_id, data_len); // 已经取消或者不认识的传输，数据丢掉，额度马上还
+        return;
+    }
+    RecvSession& session = it->second;
+    if (data_len > session.expected_size || data_msg.offset > session.expected_size - data_len) {
+        return_credit(session.transfer_id, session.credit.add(data_len));
+        return; // 超出文件范围的数据块直接丢弃
+    }
+    if (session.fd < 0) {
+        // 第一个数据块到达时才创建文件，已有的 .part 保留（续传）
+        mkdir("./downloads", 0755);
+        std::string part_path = session.save_path + ".part";
+        session.fd = open(part_path.c_str(), O_RDWR | O_CREAT, 0644);
+        uint8_t file_hash[32];
+        Sha256::from_hex(session.file_hash, file_hash);
+        if (session.fd < 0 || !session.pieces.open(part_path + ".map", file_hash, session.expected_size)) {
+            g_ctx.recv_queue.push("SYSTEM:Failed to create file: " + session.filename);
+            cancel_recv_session(it);
+            return;
+        }
+        if (!preallocate(session.fd, session.expected_size)) {
+            g_ctx.recv_queue.push("SYSTEM:Not enough disk space for file: " + session.filename);
+            cancel_recv_session(it);
+            return;
+        }
+        session.start_time = std::chrono::steady_clock::now();
+        session.start_bytes = session.pieces.received_bytes();
+    }
+    // 按 offset 写入，续传、乱序到达的数据块都不用管顺序
+    size_t written = 0;
+    while (written < data_len) {
+        ssize_t result = pwrite(session.fd, file_data + written, data_len - written, data_msg.offset + written);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            break;
+        }
+        written += result;
+    }
+    // 数据已经离开写盘队列，额度还给服务器
+    return_credit(session.transfer_id, session.credit.add(data_len));
+    if (written < data_len) {
+        g_ctx.recv_queue.push("SYSTEM:Failed to write file: " + session.filename);
+        return; // 这一块不记入位图，续传时会重新请求
+    }
+    session.pieces.add(data_msg.offset, data_len);
+    uint64_t received_size = session.pieces.received_bytes();
+    bool done = session.pieces.complete();
     
-    // 完成后标记为完成状态
-    if (sent == file_size) {
-        g_ctx.recv_queue.push("SYSTEM:File sent successfully: " + filename);
+    // 更新进度
+    {
         std::lock_guard<std::mutex> lock(g_ctx_mutex);
         for (auto& transfer : g_ctx.file_transfers) {
-            if (transfer.filename == filename && transfer.is_sending) {
-                transfer.completed = true;
+            if (transfer.transfer_id == session.transfer_id && !transfer.is_sending) {
+                transfer.sent_size = received_size;
+                transfer.progress = (float)received_size / session.expected_size;
+                
+                // 检查是否接收完成并标记
+                if (done) {
+                    transfer.completed = true;
+                }
                 break;
             }
         }
     }
+    
+    // 接收完成后关闭文件，去掉 .part 后缀并发送系统消息
+    if (done) {
+        close(session.fd);
+        session.fd = -1;
+        session.pieces.remove();
+        rename((session.save_path + ".part").c_str(), session.save_path.c_str());
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - session.start_time).count();
+        if (seconds > 0 && session.expected_size > session.start_bytes) {
+            g_measured_bandwidth = (session.expected_size - session.start_bytes) / seconds;
+        }
+        g_ctx.recv_queue.push("SYSTEM:File received successfully: " + session.filename);
+        erase_recv_session(it);
+    }
 }
 
-void network_thread_func() {
+// 写盘线程，收到的 MSG_FILE_DATA 包体原样交给它，由它调用 receive_file_data
+static DiskWriter g_disk_writer(WRITE_QUEUE_BUDGET, [](DiskWriter::Buffer& frame) {
+    FileDataMsg data_msg;
+    std::memcpy(&data_msg, frame.data(), sizeof(data_msg));
+    receive_file_data(data_msg, frame.data() + sizeof(FileDataMsg), frame.size() - sizeof(FileDataMsg));
+});
+
+// 压缩过的数据块（MSG_FILE_DATA_Z）在收包的线程里解开，解出来的数据放进池里的缓冲区交给写盘线程。
+// 每条连接一个收包线程，各用各的解压器，几条数据连接并行解
+bool recv_compressed_file_data(FrameReader& reader, uint32_t length) {
+#ifdef HAVE_ZLIB
+    thread_local ChunkDecompressor decompressor;
+    thread_local std::vector<char> packed;
+    FileDataMsg data_msg;
+    size_t start = 0; // 压缩数据在 packed 里的位置，v1 的包体前面是 FileDataMsg
+    if (reader.version() == 1) {
+        if (length > sizeof(FileDataMsg) + MAX_CHUNK_SIZE) {
+            return false;
+        }
+        packed.resize(length);
+        if (!reader.read(packed.data(), length) || !decode_v1(packed, data_msg)) {
+            return false;
+        }
+        start = sizeof(FileDataMsg);
+    } else {
+        if (!v2_read_head(reader, length, data_msg) || data_msg.data_len > MAX_CHUNK_SIZE) {
+            return false;
+        }
+        packed.resize(data_msg.data_len);
+        if (!reader.read(packed.data(), packed.size())) {
+            return false;
+        }
+    }
+    DiskWriter::Buffer frame = g_disk_writer.acquire();
+    frame.resize(sizeof(data_msg) + MAX_CHUNK_SIZE);
+    size_t raw_length = 0;
+    if (!decompressor.decompress(packed.data() + start, data_msg.data_len, frame.data() + sizeof(data_msg),
+                                 MAX_CHUNK_SIZE, raw_length)) {
+        g_ctx.recv_queue.push("SYSTEM:Failed to decompress file data from server");
+        return false;
+    }
+    data_msg.data_len = raw_length;
+    frame.resize(sizeof(data_msg) + raw_length);
+    std::memcpy(frame.data(), &data_msg, sizeof(data_msg));
+    g_disk_writer.submit(std::move(frame));
+    return true;
+#else
+    (void)reader;
+    (void)length;
+    return false; // 没有协商 FEATURE_FILE_DEFLATE，服务器不会发
+#endif
+}
+
+// 把一个数据块读进池里的缓冲区交给写盘线程，不在收包的线程里写文件。
+// 缓冲区里放的是 v1 的包体（FileDataMsg + 数据），v2 的数据直接读到 FileDataMsg 后面
+bool recv_file_data(FrameReader& reader, uint8_t type, uint32_t length) {
+    if (type == MSG_FILE_DATA_Z) {
+        return recv_compressed_file_data(reader, length);
+    }
+    if (reader.version() == 1) {
+        if (length < sizeof(FileDataMsg) || length > sizeof(FileDataMsg) + MAX_CHUNK_SIZE) {
+            return false;
+        }
+        DiskWriter::Buffer frame = g_disk_writer.acquire();
+        frame.resize(length);
+        if (!reader.read(frame.data(), length)) {
+            return false;
+        }
+        g_disk_writer.submit(std::move(frame));
+        return true;
+    }
+    FileDataMsg data_msg;
+    if (!v2_read_head(reader, length, data_msg) || data_msg.data_len > MAX_CHUNK_SIZE) {
+        return false;
+    }
+    DiskWriter::Buffer frame = g_disk_writer.acquire();
+    frame.resize(sizeof(data_msg) + data_msg.data_len);
+    std::memcpy(frame.data(), &data_msg, sizeof(data_msg));
+    if (!reader.read(frame.data() + sizeof(data_msg), data_msg.data_len)) {
+        return false;
+    }
+    g_disk_writer.submit(std::move(frame));
+    return true;
+}
+
+// v2 的邀约和进度只带用户编号，按编号填上 sender
+template <typename Msg>
+void fill_sender(std::vector<char>& body, const std::string& name) {
+    Msg msg;
+    if (!decode_v1(body, msg)) {
+        return;
+    }
+    std::strncpy(msg.sender, name.c_str(), sizeof(msg.sender) - 1);
+    msg.sender_len = std::strlen(msg.sender);
+    std::memcpy(body.data(), &msg, sizeof(msg));
+}
+
+// 读一个服务器发来的包（文件数据以外的）。v2 帧换回 v1 的包体，用户编号换回用户名：
+// 上线通知是 "alice connected"，聊天是 "alice: hello"，邀约和进度填上 sender。
+// 帧头已经读过，length 是包体长度。格式不对的包返回 true、header.type 置 0，调用方跳过它
+// 一个包体换成 v1 格式放进 body：v2 的包体先解码，LOGIN/CHAT/FILE/PROGRESS 按用户编号填上名字
+void decode_frame_body(int version, Header& header, const char* frame, size_t length, std::vector<char>& body) {
+    if (version == 1) {
+        body.assign(frame, frame + length);
+        header.length = length;
+        return;
+    }
+    uint32_t user_id = 0;
+    if (!v2_decode_body(header.type, frame, length, body, user_id)) {
+        header.type = 0;
+        body.clear();
+    }
+    if (header.type == MSG_LOGIN) {
+        std::string name(body.begin(), body.end());
+        g_user_names[user_id] = name;
+        name += " connected";
+        body.assign(name.begin(), name.end());
+    } else if (header.type == MSG_CHAT) {
+        std::string name = g_user_names[user_id] + ": ";
+        body.insert(body.begin(), name.begin(), name.end());
+    } else if (header.type == MSG_FILE) {
+        fill_sender<FileMsg>(body, g_user_names[user_id]);
+    } else if (header.type == MSG_PROGRESS) {
+        fill_sender<ProgressMsg>(body, g_user_names[user_id]);
+    }
+    header.length = body.size();
+}
+
+bool recv_frame_body(FrameReader& reader, Header& header, uint32_t length, std::vector<char>& body) {
+    std::vector<char> frame(length);
+    if (!reader.read(frame.data(), length)) {
+        return false;
+    }
+    decode_frame_body(reader.version(), header, frame.data(), frame.size(), body);
+    return true;
+}
+
+bool recv_frame(FrameReader& reader, Header& header, std::vector<char>& body) {
+    uint32_t length = 0;
+    return reader.read_header(header.type, length) && recv_frame_body(reader, header, length, body);
+}
+
+// 连接上的第一个包：报出本客户端支持的版本和功能，读服务器的答复，reader 换成协商出的版本。
+// transcript 返回发出的和收到的 HELLO，服务器的答复就是 transcript.server。
+// 老服务器不认识 MSG_HELLO 会直接断开，返回 false
+bool exchange_hello(int fd, FrameReader& reader, HelloTranscript& transcript) {
+    HelloMsg& hello = transcript.client;
+    hello = {};
+    hello.version = PROTOCOL_VERSION;
+    hello.features = SUPPORTED_FEATURES;
+    std::vector<char> package = make_package(MSG_HELLO, hello);
     Header header;
-    while (g_ctx.is_connected) {
-        // 1. 读取头部 (阻塞)
-        ssize_t len = recv(g_ctx.sock, &header, sizeof(header), 0);
-        if (len <= 0) {
-            // 连接断开
-            g_ctx.recv_queue.push("SYSTEM:Disconnected from server.");
-            g_ctx.is_connected = false;
-            close(g_ctx.sock);
-            g_ctx.sock = -1;
-            break;
+    std::vector<char> body;
+    if (!send_all(fd, package.data(), package.size()) || !recv_frame(reader, header, body) ||
+        header.type != MSG_HELLO || !decode_v1(body, transcript.server)) {
+        return false;
+    }
+    reader.set_version(transcript.server.version);
+    return true;
+}
+
+#ifdef HAVE_OPENSSL
+// 协商了 FEATURE_ENCRYPT 时紧接着 HELLO 交换临时公钥（见 FrameCipher.h）。之后 reader 收到的都要解密，
+// 发出去的交给这条连接的发送队列用 cipher 加密。HELLO 成功之后这一步失败就是连接不能用了，不退回明文
+bool exchange_keys(int fd, FrameReader& reader, const HelloTranscript& transcript,
+                   std::shared_ptr<RecordCipher>& cipher) {
+    KeyExchange exchange;
+    KeyExchangeMsg request = {};
+    std::memcpy(request.public_key, exchange.public_key(), sizeof(request.public_key));
+    std::vector<char> package = encode_package(reader.version(), MSG_KEY_EXCHANGE, request);
+    Header header;
+    std::vector<char> body;
+    KeyExchangeMsg reply;
+    std::unique_ptr<RecordCipher> send;
+    std::unique_ptr<RecordCipher> receive;
+    if (!exchange.ok() || !send_all(fd, package.data(), package.size()) || !recv_frame(reader, header, body) ||
+        header.type != MSG_KEY_EXCHANGE || !decode_v1(body, reply) ||
+        !exchange.derive(reply.public_key, true, &transcript, sizeof(transcript), send, receive)) {
+        return false;
+    }
+    reader.set_cipher(std::move(receive));
+    cipher = std::move(send);
+    return true;
+}
+#endif
+
+// 一条直连：先校验令牌，之后只接收令牌对应传输的数据块
+void p2p_receive(int peer_fd) {
+    Header header;
+    P2PHelloMsg hello;
+    uint32_t transfer_id = 0;
+    bool ok = recv_exact(peer_fd, &header, sizeof(header)) && header.type == MSG_P2P_HELLO &&
+              header.length == sizeof(hello) && recv_exact(peer_fd, &hello, sizeof(hello));
+    if (ok) {
+        std::lock_guard<std::mutex> lock(g_p2p_mutex);
+        auto it = g_p2p_tokens.find(hello.token);
+        ok = it != g_p2p_tokens.end();
+        if (ok) {
+            transfer_id = it->second;
+            g_p2p_tokens.erase(it); // 令牌只能用一次
         }
+    }
+    if (ok) {
+        std::lock_guard<std::mutex> lock(g_recv_mutex);
+        auto it = g_recv_sessions.find(transfer_id);
+        ok = it != g_recv_sessions.end() && it->second.file_hash == Sha256::to_hex(hello.file_hash);
+    }
 
-        // 2. 读取包体
-        std::vector<char> body(header.length + 1, 0);
-        ssize_t body_len = recv(g_ctx.sock, body.data(), header.length, 0);
-        if (body_len <= 0) {
-            g_ctx.is_connected = false;
+    while (ok && recv_exact(peer_fd, &header, sizeof(header))) {
+        if (header.type != MSG_FILE_DATA || header.length < sizeof(FileDataMsg) ||
+            header.length > sizeof(FileDataMsg) + MAX_CHUNK_SIZE) {
             break;
         }
+        DiskWriter::Buffer frame = g_disk_writer.acquire();
+        frame.resize(header.length);
+        if (!recv_exact(peer_fd, frame.data(), header.length)) {
+            break;
+        }
+        FileDataMsg data_msg;
+        if (!decode_v1(frame.data(), frame.size(), data_msg) || data_msg.transfer_id != transfer_id) {
+            break;
+        }
+        g_disk_writer.submit(std::move(frame));
+    }
+    close(peer_fd);
+}
 
-        // 3. 处理消息
-        std::string msg_content(body.data(), header.length);
-        if (header.type == MSG_LOGIN) {
-            // 格式: "username connected" - 提取用户名并添加到在线列表
-            g_ctx.recv_queue.push("LOGIN:" + msg_content);
-        } else if (header.type == MSG_CHAT) {
-            // 格式: "sender: message"
-            g_ctx.recv_queue.push("CHAT:" + msg_content);
-        } else if (header.type == MSG_FILE) {
-            // 接收文件元信息
-            FileMsg* file_msg = (FileMsg*)body.data();
-            g_receiving_filename = std::string(file_msg->filename, file_msg->filename_len);
-            g_expected_size = file_msg->file_size;
-            g_received_size = 0;
-            
-            // 创建 downloads 目录
-            mkdir("./downloads", 0755);
-            
-            // 打开文件准备写入
-            std::string save_path = "./downloads/" + g_receiving_filename;
-            g_current_file.open(save_path, std::ios::binary);
-            
-            if (!g_current_file) {
-                g_ctx.recv_queue.push("SYSTEM:Failed to create file: " + g_receiving_filename);
-            } else {
-                // 添加到传输列表
-                std::lock_guard<std::mutex> lock(g_ctx_mutex);
-                FileTransferStatus status;
-                status.filename = g_receiving_filename;
-                status.total_size = g_expected_size;
-                status.sent_size = 0;
-                status.progress = 0.0f;
-                status.is_sending = false;
-                status.completed = false;
-                status.saved_path = save_path; // 保存文件路径
-                g_ctx.file_transfers.push_back(status);
-                
-                std::string sender(file_msg->sender, file_msg->sender_len);
-                g_ctx.recv_queue.push("SYSTEM:Receiving file from " + sender + ": " + g_receiving_filename);
-            }
-        } else if (header.type == MSG_FILE_DATA) {
-            // 接收文件数据块
-            const char* file_data = body.data() + sizeof(FileDataMsg);
-            size_t data_len = header.length - sizeof(FileDataMsg);
-            
-            if (g_current_file.is_open()) {
-                g_current_file.write(file_data, data_len);
-                g_received_size += data_len;
-                
-                // 更新进度
-                {
-                    std::lock_guard<std::mutex> lock(g_ctx_mutex);
-                    for (auto& transfer : g_ctx.file_transfers) {
-                        if (transfer.filename == g_receiving_filename && !transfer.is_sending) {
-                            transfer.sent_size = g_received_size;
-                            transfer.progress = (float)g_received_size / g_expected_size;
-                            
-                            // 检查是否接收完成并标记
-                            if (g_received_size >= g_expected_size) {
-                                transfer.completed = true;
-                            }
-                            break;
-                        }
-                    }
-                }
-                
-                // 接收完成后关闭文件并发送系统消息
-                if (g_received_size >= g_expected_size) {
-                    g_current_file.close();
-                    g_ctx.recv_queue.push("SYSTEM:File received successfully: " + g_receiving_filename);
+// 在临时端口上监听直连，每条直连一个线程
+bool start_p2p_listener() {
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        return false;
+    }
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = 0; // 由系统分配端口
+    socklen_t len = sizeof(addr);
+    if (bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listen_fd, 8) < 0 ||
+        getsockname(listen_fd, (struct sockaddr*)&addr, &len) < 0) {
+        close(listen_fd);
+        return false;
+    }
+    {
+        std::lock_guard<std::mutex> lock(g_p2p_mutex);
+        g_p2p_listen_fd = listen_fd;
+        g_p2p_port = ntohs(addr.sin_port);
+    }
+    std::thread listen_thread([listen_fd]() {
+        while (true) {
+            int peer_fd = accept(listen_fd, nullptr, nullptr);
+            if (peer_fd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) {
+                    continue;
                 }
+                break;
             }
-        } else if (header.type == MSG_PROGRESS) {
-            g_ctx.recv_queue.push("PROGRESS:" + msg_content);
+            std::thread(p2p_receive, peer_fd).detach();
+        }
+    });
+    listen_thread.detach();
+    return true;
+}
+
+// 数据连接上只会收到服务器发来的文件数据，交给写盘线程
+void data_channel_receive(std::shared_ptr<DataChannel> channel) {
+    uint8_t type;
+    uint32_t length;
+    while (channel->reader.read_header(type, length)) {
+        if ((type != MSG_FILE_DATA && type != MSG_FILE_DATA_Z) || !recv_file_data(channel->reader, type, length)) {
+            break;
         }
     }
+    shutdown(channel->fd, SHUT_RDWR); // 还在这条连接上发送的线程马上失败返回
+    std::lock_guard<std::mutex> lock(g_data_mutex);
+    g_data_channels.erase(std::remove(g_data_channels.begin(), g_data_channels.end(), channel), g_data_channels.end());
 }
 
-bool connect_to_server(const char* ip, int port) {
-    g_ctx.sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (g_ctx.sock < 0) {
-        return false;
+// 新建一条数据连接：连到服务器，带上会话令牌，等服务器确认绑定后开始接收
+std::shared_ptr<DataChannel> open_data_channel() {
+    if (g_ctx.session_token == 0) {
+        return nullptr;
     }
+    int fd = connect_with_timeout(g_ctx.server_ip, g_ctx.server_port, P2P_CONNECT_TIMEOUT_MS);
+    if (fd < 0) {
+        return nullptr;
+    }
+    // 和登录连接协商同样的版本和加密；这条连接还没登记，send_package 不认识它，绑定包在这里直接放进它的队列
+    auto channel = std::make_shared<DataChannel>(fd); // 失败时由它关闭 fd
+    HelloTranscript transcript = {};
+    if (g_ctx.protocol_version > 1 && !exchange_hello(fd, channel->reader, transcript)) {
+        return nullptr;
+    }
+    if ((g_ctx.features & FEATURE_ENCRYPT) && !(transcript.server.features & FEATURE_ENCRYPT)) {
+        return nullptr; // 登录连接是加密的，数据连接也必须加密
+    }
+#ifdef HAVE_OPENSSL
+    if (transcript.server.features & FEATURE_ENCRYPT) {
+        std::shared_ptr<RecordCipher> cipher;
+        if (!exchange_keys(fd, channel->reader, transcript, cipher)) {
+            return nullptr;
+        }
+        channel->outbox.set_cipher(std::move(cipher));
+    }
+#endif
+    // 绑定包经过发送队列，加密时也是密文
+    SessionMsg attach = {g_ctx.session_token};
+    std::vector<char> package = encode_package(channel->reader.version(), MSG_DATA_ATTACH, attach);
+    Header header;
+    std::vector<char> reply;
+    if (!channel->outbox.push(SEND_CONTROL, std::move(package)) || !recv_frame(channel->reader, header, reply) ||
+        header.type != MSG_DATA_ATTACH || header.length != sizeof(SessionMsg)) {
+        return nullptr;
+    }
+    {
+        std::lock_guard<std::mutex> lock(g_data_mutex);
+        g_data_channels.push_back(channel);
+    }
+    std::thread(data_channel_receive, channel).detach();
+    return channel;
+}
+
+// 取 count 条数据连接，已有的先用，不够再新建；建不起来就少用几条
+std::vector<std::shared_ptr<DataChannel>> get_data_channels(int count) {
+    std::lock_guard<std::mutex> open_lock(g_data_open_mutex);
+    std::vector<std::shared_ptr<DataChannel>> channels;
+    {
+        std::lock_guard<std::mutex> lock(g_data_mutex);
+        for (const auto& channel : g_data_channels) {
+            if ((int)channels.size() < count) {
+                channels.push_back(channel);
+            }
+        }
+    }
+    while ((int)channels.size() < count) {
+        std::shared_ptr<DataChannel> channel = open_data_channel();
+        if (!channel) {
+            break;
+        }
+        channels.push_back(channel);
+    }
+    return channels;
+}
 
+// 和服务器断开时数据连接也一起断开
+void close_data_channels() {
+    std::lock_guard<std::mutex> lock(g_data_mutex);
+    for (const auto& channel : g_data_channels) {
+        shutdown(channel->fd, SHUT_RDWR);
+    }
+}
+
+// 根据文件大小和最近实测的带宽决定用几条连接：每条至少分到 STRIPE_MIN_BYTES；
+// 按实测带宽一条连接一秒内就能传完的不拆分，并行省下的时间抵不上建连接和多线程的开销
+int choose_stream_count(uint64_t file_size) {
+    if (g_ctx.fixed_streams > 0) {
+        return std::min(g_ctx.fixed_streams, MAX_STREAMS);
+    }
+    double bandwidth = g_measured_bandwidth;
+    if (file_size < STRIPE_MIN_BYTES * 2 || (bandwidth > 0 && file_size < bandwidth)) {
+        return 1;
+    }
+    return (int)std::min<uint64_t>(MAX_STREAMS, file_size / STRIPE_MIN_BYTES);
+}
+
+// 上传到服务器：走数据连接，大文件的分片分到几条数据连接上并行发送。
+// 一条数据连接都开不了（比如服务器不支持）才退回登录连接
+void upload_striped(PendingUpload upload, uint32_t transfer_id, uint32_t window, std::vector<uint8_t> have,
+                    uint32_t max_chunk) {
+    std::vector<std::shared_ptr<DataChannel>> channels = get_data_channels(choose_stream_count(upload.file_size));
+    std::vector<SendQueue*> outboxes;
+    for (const auto& channel : channels) {
+        outboxes.push_back(&channel->outbox);
+    }
+    if (outboxes.empty()) {
+        outboxes.push_back(g_outbox.get());
+    }
+
+    UploadProgress progress;
+    uint32_t piece_count = PieceMap::piece_count(upload.file_size);
+    for (uint32_t piece = 0; piece < piece_count; ++piece) {
+        if (PieceMap::test_bit(have, piece)) {
+            progress.done += PieceMap::piece_length(upload.file_size, piece);
+        }
+    }
+    uint64_t skipped = progress.done;
+    // 几条连接共用服务器给的额度；window 为 0 时不限
+    std::shared_ptr<CreditWindow> credit;
+    if (window != 0) {
+        credit = std::make_shared<CreditWindow>(window);
+        std::lock_guard<std::mutex> lock(g_upload_credits_mutex);
+        g_upload_credits[transfer_id] = credit;
+    }
+    auto start_time = std::chrono::steady_clock::now();
+    std::vector<char> results(outboxes.size(), 0);
+    std::vector<std::thread> threads;
+    for (uint32_t stripe = 0; stripe < outboxes.size(); ++stripe) {
+        threads.emplace_back([&, stripe]() {
+            std::vector<uint8_t> skip = PieceMap::stripe_skip(have, upload.file_size, stripe, outboxes.size());
+            results[stripe] = upload_file(*outboxes[stripe], upload, transfer_id, skip, max_chunk, credit.get(), &progress);
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    if (credit) {
+        std::lock_guard<std::mutex> lock(g_upload_credits_mutex);
+        g_upload_credits.erase(transfer_id);
+    }
+    if (std::count(results.begin(), results.end(), 0) > 0) {
+        g_ctx.recv_queue.push("SYSTEM:Failed to send file data");
+        return;
+    }
+    
+    // 完成后标记为完成状态，附上发送速度方便对比不同的发送方式
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+    uint64_t transferred = progress.done - skipped; // 实际发出的字节数，不含跳过的分片
+    if (seconds > 0 && transferred > 0) {
+        g_measured_bandwidth = transferred / seconds;
+    }
+    char speed[128];
+    snprintf(speed, sizeof(speed), " (%.1f MB/s, %s, %u KB chunks, %zu streams)",
+             seconds > 0 ? transferred / seconds / (1024 * 1024) : 0.0, progress.method.c_str(),
+             progress.chunk_size / 1024, outboxes.size());
+    g_ctx.recv_queue.push("SYSTEM:File sent successfully: " + upload.filename + speed);
+    std::lock_guard<std::mutex> lock(g_ctx_mutex);
+    if (FileTransferStatus* transfer = find_sending_transfer(Sha256::to_hex(upload.file_hash))) {
+        transfer->completed = true;
+    }
+}
+
+// 发出 MSG_FILE_ACCEPT，附上已有分片的位图。先把数据连接准备好，服务器在这几条连接上发送。
+// 建数据连接要等服务器确认，所以放在单独的线程里，不卡界面和网络线程
+void send_file_request(uint32_t transfer_id, std::string file_hash, uint64_t file_size, std::vector<uint8_t> have) {
+    FileRequestMsg request = {};
+    Sha256::from_hex(file_hash, request.file_hash);
+    request.transfer_id = transfer_id;
+    request.window = (g_ctx.features & FEATURE_CREDIT) ? TRANSFER_WINDOW : 0; // 0 表示不限
+    fill_p2p_request(request);
+    request.max_chunk = MAX_CHUNK_SIZE;
+    request.streams = get_data_channels(choose_stream_count(file_size)).size();
+    request.bitmap_len = have.size();
+    send_package(g_ctx.sock, MSG_FILE_ACCEPT, request, have.data());
+}
+
+// 接受文件邀约，服务器收到后才开始发送数据。调用方需持有 g_ctx_mutex
+void accept_file(FileTransferStatus& transfer) {
+    std::thread request_thread(send_file_request, transfer.transfer_id, transfer.file_hash, transfer.total_size,
+                               std::vector<uint8_t>());
+    request_thread.detach();
+    transfer.awaiting_accept = false;
+}
+
+// 请求续传：把已有分片的位图发给服务器，服务器只补发缺少的部分
+void request_resume(const RecvSession& session) {
+    std::thread request_thread(send_file_request, session.transfer_id, session.file_hash, session.expected_size,
+                               session.pieces.bits());
+    request_thread.detach();
+}
+
+// 连上服务器后扫描 downloads 目录，没传完的文件（留有 .part.map）自动续传
+void resume_downloads() {
+    DIR* dir = opendir("./downloads");
+    if (!dir) {
+        return;
+    }
+    std::lock_guard<std::mutex> recv_lock(g_recv_mutex);
+    const std::string suffix = ".part.map";
+    while (struct dirent* entry = readdir(dir)) {
+        std::string name = entry->d_name;
+        if (name.size() <= suffix.size() || name.compare(name.size() - suffix.size(), suffix.size(), suffix) != 0) {
+            continue;
+        }
+        PieceMap pieces;
+        if (!pieces.load("./downloads/" + name)) {
+            continue;
+        }
+        std::string file_hash = Sha256::to_hex(pieces.file_hash());
+        RecvSession& session = recv_session_for(file_hash);
+        session.filename = name.substr(0, name.size() - suffix.size());
+        session.expected_size = pieces.file_size();
+        session.save_path = "./downloads/" + session.filename;
+        session.pieces = std::move(pieces);
+        request_resume(session);
+
+        std::lock_guard<std::mutex> lock(g_ctx_mutex);
+        FileTransferStatus status;
+        status.filename = session.filename;
+        status.total_size = session.expected_size;
+        status.sent_size = session.pieces.received_bytes();
+        status.progress = session.expected_size ? (float)status.sent_size / session.expected_size : 0.0f;
+        status.is_sending = false;
+        status.completed = false;
+        status.saved_path = session.save_path;
+        status.file_hash = file_hash;
+        status.transfer_id = session.transfer_id;
+        g_ctx.file_transfers.push_back(status);
+        g_ctx.recv_queue.push("SYSTEM:Resuming download: " + session.filename);
+    }
+    closedir(dir);
+}
+
+// 断开和服务器的连接：先停掉写线程再关闭，网络线程的循环看到 is_connected 为 false 就退出。
+// 网络线程不管因为什么出错都经过这里，不会自动重连，用户重新连接后没传完的文件按位图续传。只在网络线程里调用
+void disconnect_from_server(const std::string& reason) {
+    if (!g_ctx.is_connected) {
+        return;
+    }
+    g_ctx.recv_queue.push("SYSTEM:" + reason);
+    g_ctx.is_connected = false;
+    g_outbox->close();
+    close(g_ctx.sock);
+    g_ctx.sock = -1;
+}
+
+// 服务器发来的各种消息（文件数据以外的），由 dispatch_message 按类型调用。
+// 客户端不处理的类型（包括更新的服务器才有的）和格式不对的包直接跳过
+struct ServerMessages {
+    // 格式: "username connected" - 提取用户名并添加到在线列表
+    void handle(MessageTag<MSG_LOGIN>, TextBody& text, const char*) {
+        g_ctx.recv_queue.push("LOGIN:" + std::string(text.data, text.length));
+    }
+
+    // 格式: "sender: message"
+    void handle(MessageTag<MSG_CHAT>, TextBody& text, const char*) {
+        g_ctx.recv_queue.push("CHAT:" + std::string(text.data, text.length));
+    }
+
+    // 收到文件邀约，接受之后服务器才会发送数据
+    void handle(MessageTag<MSG_FILE>, FileMsg& file_msg, const char*) {
+        if (file_msg.file_size > MAX_FILE_SIZE) {
+            return; // 服务器不会转发这么大的邀约
+        }
+        std::string filename = safe_filename(std::string(file_msg.filename, file_msg.filename_len));
+        if (filename.empty()) {
+            return;
+        }
+        std::string file_hash = Sha256::to_hex(file_msg.file_hash);
+        std::lock_guard<std::mutex> recv_lock(g_recv_mutex);
+        RecvSession& session = recv_session_for(file_hash);
+        if (session.pieces.file_size() > 0) {
+            // 之前接收过一部分（发送方重新发送了同一文件），直接续传
+            request_resume(session);
+            return;
+        }
+        std::lock_guard<std::mutex> lock(g_ctx_mutex);
+        for (const auto& transfer : g_ctx.file_transfers) {
+            if (!transfer.is_sending && !transfer.completed && transfer.transfer_id == session.transfer_id) {
+                return; // 同一文件的邀约还没处理（或者接受了、数据还没到），不重复列出
+            }
+        }
+        session.filename = filename;
+        session.expected_size = file_msg.file_size;
+        session.save_path = unique_save_path(session);
+        
+        // 添加到传输列表
+        FileTransferStatus status;
+        status.filename = session.filename;
+        status.total_size = session.expected_size;
+        status.sent_size = 0;
+        status.progress = 0.0f;
+        status.is_sending = false;
+        status.completed = false;
+        status.saved_path = session.save_path; // 保存文件路径
+        status.file_hash = file_hash;
+        status.transfer_id = session.transfer_id;
+        status.awaiting_accept = true;
+        g_ctx.file_transfers.push_back(status);
+        if (g_ctx.auto_accept) {
+            accept_file(g_ctx.file_transfers.back());
+        }
+        
+        std::string sender(file_msg.sender, file_msg.sender_len);
+        g_ctx.recv_queue.push("SYSTEM:File offer from " + sender + ": " + session.filename +
+                              " (" + std::to_string(session.expected_size) + " bytes)");
+    }
+
+    void handle(MessageTag<MSG_PROGRESS>, ProgressMsg& prog, const char*) {
+        g_ctx.recv_queue.push("PROGRESS:" + std::string((const char*)&prog, sizeof(prog)));
+    }
+
+    // 服务器答复是否需要上传
+    void handle(MessageTag<MSG_FILE_STATUS>, FileStatusMsg& status, const char* bitmap) {
+        PendingUpload upload;
+        bool found = false;
+        {
+            std::lock_guard<std::mutex> lock(g_pending_mutex);
+            auto it = g_pending_uploads.find(Sha256::to_hex(status.file_hash));
+            if (it != g_pending_uploads.end()) {
+                upload = it->second;
+                g_pending_uploads.erase(it);
+                found = true;
+            }
+        }
+        if (found && status.need_upload) {
+            // 服务器已有的分片（上次断线前传过的）不用再传
+            std::vector<uint8_t> have(bitmap, bitmap + status.bitmap_len);
+            std::thread upload_thread(upload_striped, upload, status.transfer_id, status.window, have,
+                                      status.max_chunk);
+            upload_thread.detach();
+        } else if (found) {
+            // 服务器已有相同内容，直接标记为发送完成
+            g_ctx.recv_queue.push("SYSTEM:File already on server, upload skipped: " + upload.filename);
+            std::lock_guard<std::mutex> lock(g_ctx_mutex);
+            if (FileTransferStatus* transfer = find_sending_transfer(Sha256::to_hex(status.file_hash))) {
+                transfer->sent_size = upload.file_size;
+                transfer->progress = 1.0f;
+                transfer->completed = true;
+            }
+        }
+    }
+
+    // 服务器写完了一部分上传的数据，补上额度
+    void handle(MessageTag<MSG_CREDIT>, CreditMsg& credit, const char*) {
+        std::lock_guard<std::mutex> lock(g_upload_credits_mutex);
+        auto it = g_upload_credits.find(credit.transfer_id);
+        if (it != g_upload_credits.end()) {
+            it->second->grant(credit.bytes);
+        }
+    }
+
+    // 拿到会话令牌之后才能开数据连接，续传也放到这时候
+    void handle(MessageTag<MSG_SESSION>, SessionMsg& session, const char*) {
+        g_ctx.session_token = session.token;
+        resume_downloads();
+    }
+
+    // 服务器牵线：直接连到接收方发送数据，不占用网络线程
+    void handle(MessageTag<MSG_P2P_CONNECT>, P2PConnectMsg& request, const char* bitmap) {
+        std::thread direct_thread(send_direct, request, std::vector<uint8_t>(bitmap, bitmap + request.bitmap_len));
+        direct_thread.detach();
+    }
+
+#ifdef HAVE_ZLIB
+    // 压缩过的帧，解开后按普通的帧处理（见 FrameCompressor.h）。
+    // 解不开或者解出来的帧不对时，两边的压缩流已经对不上了，后面的帧也解不开，只能断开
+    void handle(MessageTag<MSG_COMPRESSED>, RawBody& compressed, const char*) {
+        if (!g_decompressor || !g_decompressor->decompress(compressed.data, compressed.length, inflated)) {
+            disconnect_from_server("Failed to decompress message from server, disconnected.");
+            return;
+        }
+        BufferSource in(inflated.data(), inflated.size());
+        Header header;
+        uint32_t length = 0;
+        if (!get_frame_header(in, g_ctx.protocol_version, header.type, length) || length != in.remaining() ||
+            header.type == MSG_COMPRESSED || header.type == MSG_FILE_DATA || header.type == MSG_FILE_DATA_Z) {
+            disconnect_from_server("Invalid compressed message from server, disconnected.");
+            return;
+        }
+        decode_frame_body(g_ctx.protocol_version, header, in.rest(), length, inflated_body);
+        dispatch_message(*this, header.type, inflated_body);
+    }
+
+    std::vector<char> inflated;      // 解出来的帧
+    std::vector<char> inflated_body; // 和它换回的 v1 包体
+#endif
+
+    void invalid(uint8_t) {}
+    void unhandled(uint8_t) {}
+};
+
+void network_thread_func() {
+    if (g_p2p_listen_fd < 0 && !start_p2p_listener()) {
+        g_ctx.recv_queue.push("SYSTEM:Direct transfer unavailable, files will be relayed by the server");
+    }
+
+    ServerMessages handler;
+    Header header;
+    std::vector<char> body;
+    while (g_ctx.is_connected) {
+        // 1. 读取头部 (阻塞)
+        uint32_t length = 0;
+        if (!g_reader->read_header(header.type, length)) {
+            disconnect_from_server("Disconnected from server.");
+            break;
+        }
+
+        // 文件数据直接读进写盘队列，马上回来接着收包
+        if (header.type == MSG_FILE_DATA || header.type == MSG_FILE_DATA_Z) {
+            if (!recv_file_data(*g_reader, header.type, length)) {
+                disconnect_from_server("Disconnected from server.");
+                break;
+            }
+            continue;
+        }
+
+        // 2. 读取包体，交给对应类型的处理函数
+        if (!recv_frame_body(*g_reader, header, length, body)) {
+            disconnect_from_server("Disconnected from server.");
+            break;
+        }
+        dispatch_message(handler, header.type, body);
+    }
+    {
+        // 服务器不会再还额度了，叫醒等着的上传线程
+        std::lock_guard<std::mutex> lock(g_upload_credits_mutex);
+        for (const auto& credit : g_upload_credits) {
+            credit.second->close();
+        }
+    }
+    close_data_channels();
+}
+
+bool connect_to_server(const char* ip, int port) {
     struct sockaddr_in server_addr;
     server_addr.sin_family = AF_INET;
     server_addr.sin_port = htons(port);
     inet_pton(AF_INET, ip, &server_addr.sin_addr);
 
-    if (connect(g_ctx.sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+    auto open_socket = [&server_addr]() {
+        g_ctx.sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (g_ctx.sock < 0) {
+            return false;
+        }
+        if (connect(g_ctx.sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+            close(g_ctx.sock);
+            g_ctx.sock = -1;
+            return false;
+        }
+        g_reader.reset(new FrameReader(g_ctx.sock));
+        return true;
+    };
+    if (!open_socket()) {
+        return false;
+    }
+    // 先协商格式和功能。老服务器不认识 MSG_HELLO 会断开，重连一次，按 v1 收发
+    HelloTranscript transcript = {};
+    if (exchange_hello(g_ctx.sock, *g_reader, transcript)) {
+        g_ctx.protocol_version = transcript.server.version;
+        g_ctx.features = transcript.server.features;
+    } else {
+        close(g_ctx.sock);
+        if (!open_socket()) {
+            return false;
+        }
+        g_ctx.protocol_version = 1;
+        g_ctx.features = 0;
+        g_ctx.recv_queue.push("SYSTEM:Server does not support protocol negotiation, using protocol v1");
+    }
+    if (g_ctx.require_encryption && !(g_ctx.features & FEATURE_ENCRYPT)) {
+        // 本客户端没带 OpenSSL、服务器不支持，或者 HELLO 被人改过，都不连
         close(g_ctx.sock);
         g_ctx.sock = -1;
+        g_ctx.recv_queue.push("SYSTEM:Connection to server would not be encrypted, not connecting");
         return false;
     }
+#ifdef HAVE_OPENSSL
+    std::shared_ptr<RecordCipher> cipher;
+    if ((g_ctx.features & FEATURE_ENCRYPT) && !exchange_keys(g_ctx.sock, *g_reader, transcript, cipher)) {
+        close(g_ctx.sock);
+        g_ctx.sock = -1;
+        g_ctx.recv_queue.push("SYSTEM:Key exchange with server failed");
+        return false;
+    }
+#endif
 
+    g_outbox.reset(new SendQueue(g_ctx.sock));
+#ifdef HAVE_OPENSSL
+    g_outbox->set_cipher(cipher); // 加密时之后发往服务器的都是密文
+#endif
+    // 连着发的几条消息攒一下一起写出去，服务器支持时合成一个 MSG_BUNDLE 帧
+    g_outbox->set_batching(SEND_BATCH_DELAY, (g_ctx.features & FEATURE_BUNDLE) ? g_ctx.protocol_version : 0);
+#ifdef HAVE_ZLIB
+    // 发往服务器的小包经过压缩流，服务器发来的用 g_decompressor 解，两个方向各自一份上下文
+    g_decompressor.reset();
+    if (g_ctx.features & FEATURE_DEFLATE) {
+        auto compressor = std::make_shared<FrameCompressor>(g_ctx.protocol_version);
+        g_outbox->set_filter([compressor](std::vector<char>& frame) { return compressor->compress(frame); });
+        g_decompressor.reset(new FrameDecompressor());
+    }
+#endif
+    g_user_names.clear(); // 编号只在一次服务器运行里有效
+    g_ctx.server_ip = server_addr.sin_addr.s_addr;
+    g_ctx.server_port = server_addr.sin_port;
     g_ctx.is_connected = true;
     return true;
 }
@@ -301,7 +1560,30 @@ static void glfw_error_callback(int error, const char* description) {
     fprintf(stderr, "GLFW Error %d: %s\n", error, description);
 }
 
-int main(int, char**) {
+// 命令行参数：调传输参数用，对比速度时固定下来。不认识的参数打印用法后返回 false
+bool parse_options(int argc, char* argv[]) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--read-ahead" && i + 1 < argc) {
+            g_ctx.read_ahead_buffers = std::max(1, atoi(argv[++i]));
+        } else if (arg == "--chunk-kb" && i + 1 < argc) {
+            g_ctx.fixed_chunk_kb = std::max(0, atoi(argv[++i]));
+        } else if (arg == "--streams" && i + 1 < argc) {
+            g_ctx.fixed_streams = std::max(0, atoi(argv[++i]));
+        } else {
+            fprintf(stderr, "Usage: %s [--read-ahead <pieces>] [--chunk-kb <KB>] [--streams <count>]\n", argv[0]);
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    if (!parse_options(argc, argv)) {
+        return 1;
+    }
+    // 服务器断开后 send 不要触发 SIGPIPE 直接退出
+    signal(SIGPIPE, SIG_IGN);
     glfwSetErrorCallback(glfw_error_callback);
     if (!glfwInit())
         return 1;
@@ -432,6 +1714,7 @@ int main(int, char**) {
             ImGui::InputText("Server IP", server_ip, IM_ARRAYSIZE(server_ip));
             ImGui::InputInt("Port", &server_port);
             ImGui::InputText("Username", username_buf, IM_ARRAYSIZE(username_buf));
+            ImGui::Checkbox("Require Encryption", &g_ctx.require_encryption);
             
             if (ImGui::Button("Connect")) {
                 if (connect_to_server(server_ip, server_port)) {
@@ -439,7 +1722,7 @@ int main(int, char**) {
                     // 添加自己到在线列表
                     g_ctx.online_users.push_back(g_ctx.username);
                     // 发送登录包
-                    send_package(g_ctx.sock, MSG_LOGIN, username_buf, strlen(username_buf));
+                    send_text(g_ctx.sock, MSG_LOGIN, username_buf);
                     
                     // 启动网络线程
                     network_thread = new std::thread(network_thread_func);
@@ -448,7 +1731,8 @@ int main(int, char**) {
                     show_connect_window = false;
                     ChatMessage sys_msg;
                     sys_msg.sender = "System";
-                    sys_msg.content = "Connected to server as " + g_ctx.username;
+                    sys_msg.content = "Connected to server as " + g_ctx.username +
+                                      ((g_ctx.features & FEATURE_ENCRYPT) ? " (encrypted)" : " (not encrypted)");
                     sys_msg.is_me = false;
                     g_ctx.chat_history.push_back(sys_msg);
                 } else {
@@ -472,6 +1756,12 @@ int main(int, char**) {
             // 左侧用户列表 (20% 宽度)
             float sidebar_width = io.DisplaySize.x * 0.2f;
             ImGui::BeginChild("UserList", ImVec2(sidebar_width, -ImGui::GetFrameHeightWithSpacing()), true);
+            // 连接状态：加密时绿色，明文时黄色提醒
+            if (g_ctx.features & FEATURE_ENCRYPT) {
+                ImGui::TextColored(ImVec4(0.0f, 1.0f, 0.0f, 1.0f), "Encrypted (AES-128-GCM)");
+            } else {
+                ImGui::TextColored(ImVec4(1.0f, 0.8f, 0.0f, 1.0f), "Not encrypted");
+            }
             ImGui::Text("Online Users (%zu)", g_ctx.online_users.size());
             ImGui::Separator();
             for (const auto& user : g_ctx.online_users) {
@@ -524,6 +1814,7 @@ int main(int, char**) {
             ImGui::EndChild();
             
             // 文件传输进度显示 - 固定在底部上方
+            std::vector<uint32_t> declined; // 拒绝的邀约，放开 g_ctx_mutex 后删掉接收记录
             {
                 std::lock_guard<std::mutex> lock(g_ctx_mutex);
                 if (!g_ctx.file_transfers.empty()) {
@@ -534,9 +1825,25 @@ int main(int, char**) {
                     std::vector<size_t> to_remove;
                     
                     for (size_t i = 0; i < g_ctx.file_transfers.size(); ++i) {
-                        const auto& transfer = g_ctx.file_transfers[i];
+                        auto& transfer = g_ctx.file_transfers[i];
                         
-                        if (transfer.completed) {
+                        if (transfer.awaiting_accept) {
+                            // 收到的邀约，由用户决定是否接收
+                            ImGui::TextColored(ImVec4(1.0f, 0.8f, 0.2f, 1.0f), "[Offer] %s (%.1f KB)",
+                                               transfer.filename.c_str(), transfer.total_size / 1024.0);
+                            ImGui::Indent(20.0f);
+                            std::string accept_btn_id = "Accept##" + std::to_string(i);
+                            if (ImGui::Button(accept_btn_id.c_str())) {
+                                accept_file(transfer);
+                            }
+                            ImGui::SameLine();
+                            std::string decline_btn_id = "Decline##" + std::to_string(i);
+                            if (ImGui::Button(decline_btn_id.c_str())) {
+                                declined.push_back(transfer.transfer_id);
+                                to_remove.push_back(i);
+                            }
+                            ImGui::Unindent(20.0f);
+                        } else if (transfer.completed) {
                             // 传输完成，显示更清晰的UI
                             std::string label = transfer.is_sending ? "[Sent] " : "[Received] ";
                             label += transfer.filename;
@@ -581,12 +1888,22 @@ int main(int, char**) {
                     ImGui::Separator();
                 }
             }
+            if (!declined.empty()) {
+                // 网络线程先拿 g_recv_mutex 再拿 g_ctx_mutex，这里不能反过来
+                std::lock_guard<std::mutex> recv_lock(g_recv_mutex);
+                for (uint32_t transfer_id : declined) {
+                    auto it = g_recv_sessions.find(transfer_id);
+                    if (it != g_recv_sessions.end() && it->second.fd < 0) {
+                        erase_recv_session(it); // 还没开始接收，保留的保存路径和哈希的对应一起释放
+                    }
+                }
+            }
             
             // 输入框
             if (ImGui::InputText("##MessageInput", message_buf, IM_ARRAYSIZE(message_buf), ImGuiInputTextFlags_EnterReturnsTrue)) {
                 if (strlen(message_buf) > 0) {
                     // 发送消息
-                    send_package(g_ctx.sock, MSG_CHAT, message_buf, strlen(message_buf));
+                    send_text(g_ctx.sock, MSG_CHAT, message_buf);
                     // 立即添加到聊天历史
                     ChatMessage my_msg;
                     my_msg.sender = g_ctx.username;
@@ -599,7 +1916,7 @@ int main(int, char**) {
             ImGui::SameLine();
             if (ImGui::Button("Send")) {
                 if (strlen(message_buf) > 0) {
-                    send_package(g_ctx.sock, MSG_CHAT, message_buf, strlen(message_buf));
+                    send_text(g_ctx.sock, MSG_CHAT, message_buf);
                     ChatMessage my_msg;
                     my_msg.sender = g_ctx.username;
                     my_msg.content = message_buf;
@@ -623,6 +1940,10 @@ int main(int, char**) {
                     send_thread.detach();
                 }
             }
+            ImGui::SameLine();
+            ImGui::Checkbox("Auto Accept", &g_ctx.auto_accept);
+            ImGui::SameLine();
+            ImGui::Checkbox("Zero Copy", &g_ctx.zero_copy);
             
             ImGui::EndGroup();
             ImGui::End();
@@ -0,0 +1,66 @@
+#ifndef TESTUTIL_H
+#define TESTUTIL_H
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// 测试用的小工具，不依赖测试框架。CHECK 失败时打印位置和表达式，接着跑后面的检查，
+// main 最后返回 test_result()，有失败时非 0，ctest 据此判断
+
+inline int& test_failures() {
+    static int failures = 0;
+    return failures;
+}
+
+#define CHECK(expr)                                                                       \
+    do {                                                                                  \
+        if (!(expr)) {                                                                    \
+            std::fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #expr); \
+            ++test_failures();                                                            \
+        }                                                                                 \
+    } while (0)
+
+inline int test_result(const char* name) {
+    if (test_failures() > 0) {
+        std::fprintf(stderr, "%s: %d check(s) failed\n", name, test_failures());
+        return 1;
+    }
+    std::printf("%s: ok\n", name);
+    return 0;
+}
+
+// "0388da..." -> 字节，写已知答案用
+inline std::vector<uint8_t> hex_bytes(const std::string& hex) {
+    std::vector<uint8_t> bytes;
+    for (size_t i = 0; i + 1 < hex.size(); i += 2) {
+        bytes.push_back((uint8_t)std::stoul(hex.substr(i, 2), nullptr, 16));
+    }
+    return bytes;
+}
+
+// 可以压缩的测试数据：像 CSV 一样的行
+inline std::string sample_text(size_t size) {
+    std::string text;
+    for (unsigned row = 0; text.size() < size; ++row) {
+        text += std::to_string(row) + ",2026-10-18 12:" + std::to_string(row % 60) + ",user" +
+                std::to_string(row % 97) + ",OK," + std::to_string(row * 7919 % 10007) + "\n";
+    }
+    text.resize(size);
+    return text;
+}
+
+// 不可压缩的测试数据（xorshift，结果固定）
+inline std::string sample_random(size_t size, uint64_t seed = 0x9e3779b97f4a7c15ull) {
+    std::string data(size, '\0');
+    for (size_t i = 0; i < size; ++i) {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        data[i] = (char)(seed >> 24);
+    }
+    return data;
+}
+
+#endif // TESTUTIL_H
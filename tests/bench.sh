@@ -0,0 +1,34 @@
+#!/bin/sh
+# 编译 tests/ 并运行吞吐量测量，结果同时写到 bench_output.txt。
+# 不带参数时跑下面这组对比；带参数时原样传给 transfer_bench，只跑那一次，例如 tests/bench.sh --copy
+set -e
+root=$(cd "$(dirname "$0")/.." && pwd)
+build="$root/build-bench"
+cmake -S "$root/tests" -B "$build" -DCMAKE_BUILD_TYPE=Release >/dev/null
+cmake --build "$build" --target transfer_bench >/dev/null
+bench="$build/transfer_bench"
+if [ $# -gt 0 ]; then
+    "$bench" "$@" | tee "$root/bench_output.txt"
+    exit 0
+fi
+{
+    echo "== sendfile vs read + send"
+    "$bench"
+    "$bench" --copy
+    echo "== chunk size"
+    for kb in 16 32 64 128 256 512 1024; do
+        "$bench" --chunk-kb $kb
+        "$bench" --chunk-kb $kb --copy
+    done
+    if "$bench" --help 2>&1 | grep -q -- --encrypt; then
+        echo "== encrypted transfer (per CPU-second lines: each side's own CPU time)"
+        "$bench" --encrypt
+        "$bench" --encrypt --copy
+    fi
+    echo "== chat latency during a saturating transfer"
+    "$bench" --latency
+    echo "== broadcast chat, server --write-tick off vs 1000 us"
+    for clients in 20 50 200; do
+        "$bench" --broadcast $clients
+    done
+} | tee "$root/bench_output.txt"
@@ -0,0 +1,65 @@
+// ChunkSizer：给出的数据块大小都是 2 的幂，在上限以内，能按小块对齐、整除分片；
+// 按实测吞吐量调整时也不越界
+#include <algorithm>
+#include <unistd.h>
+#include "ChunkSizer.h"
+#include "PieceMap.h"
+#include "TestUtil.h"
+
+static bool aligned(uint32_t size, uint32_t max) {
+    return size >= MIN_CHUNK_SIZE && size <= max && (size & (size - 1)) == 0 &&
+           size % PieceMap::PIECE_BLOCK_SIZE == 0 && FILE_PIECE_SIZE % size == 0;
+}
+
+static void test_limits() {
+    // 上限和固定大小不是 2 的幂时向下取整
+    const uint32_t limits[] = {0, 1, MIN_CHUNK_SIZE, 48 * 1024, 100000, MAX_CHUNK_SIZE, 3000000, UINT32_MAX};
+    for (uint32_t max_chunk : limits) {
+        uint32_t max = std::max(MIN_CHUNK_SIZE, std::min(max_chunk ? max_chunk : INITIAL_CHUNK_SIZE, MAX_CHUNK_SIZE));
+        for (uint32_t fixed : {0u, 1u, 40000u, 200000u, UINT32_MAX}) {
+            ChunkSizer sizer(max_chunk, fixed);
+            CHECK(aligned(sizer.size(), max));
+        }
+    }
+    CHECK(ChunkSizer(48 * 1024).size() == 32 * 1024);
+    CHECK(ChunkSizer(MAX_CHUNK_SIZE, 200000).size() == 128 * 1024);
+    CHECK(ChunkSizer(0).size() == INITIAL_CHUNK_SIZE);
+}
+
+// 发完一个测量窗口（至少 8 个数据块、50ms）
+static void send_window(ChunkSizer& sizer, size_t bytes_per_chunk) {
+    for (int i = 0; i < 7; ++i) {
+        sizer.on_sent(-1, bytes_per_chunk); // 不是 socket，取不到 RTT，只按时间算窗口
+    }
+    usleep(60 * 1000);
+    sizer.on_sent(-1, bytes_per_chunk);
+}
+
+static void test_adapt() {
+    ChunkSizer sizer(MAX_CHUNK_SIZE);
+    CHECK(sizer.size() == INITIAL_CHUNK_SIZE);
+    send_window(sizer, sizer.size());
+    CHECK(sizer.size() == 2 * INITIAL_CHUNK_SIZE); // 第一个窗口之后先往大调
+    send_window(sizer, sizer.size() / 4);          // 明显变慢：掉头往小调
+    CHECK(sizer.size() == INITIAL_CHUNK_SIZE);
+    for (int i = 0; i < 4; ++i) {
+        send_window(sizer, sizer.size());
+        CHECK(aligned(sizer.size(), MAX_CHUNK_SIZE));
+    }
+
+    // 上限很小时调不上去
+    ChunkSizer small(MIN_CHUNK_SIZE);
+    send_window(small, small.size());
+    CHECK(small.size() == MIN_CHUNK_SIZE);
+
+    // 固定大小不调整
+    ChunkSizer fixed(MAX_CHUNK_SIZE, 256 * 1024);
+    send_window(fixed, fixed.size());
+    CHECK(fixed.size() == 256 * 1024);
+}
+
+int main() {
+    test_limits();
+    test_adapt();
+    return test_result("chunk_sizer_test");
+}
@@ -0,0 +1,185 @@
+// FrameCipher：AES-128-GCM 的已知答案，记录加密后能解开，被改、重放的记录解不开；
+// 两端用同样的 HELLO 派生出能互通的密钥，HELLO 不一样就不通；发送队列加密写出的帧 FrameReader 能读回来。
+// 找到 OpenSSL（HAVE_OPENSSL）才编译
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/socket.h>
+#include "FrameCipher.h"
+#include "ProtocolV2.h"
+#include "SendQueue.h"
+#include "TestUtil.h"
+
+// 加密一个记录，返回 记录头 + 密文 + 校验码
+static std::string seal(RecordCipher& cipher, std::string content) {
+    std::string record(RECORD_HEADER, '\0');
+    CHECK(cipher.begin_seal(content.size(), &record[0]));
+    CHECK(cipher.update(&content[0], content.size()));
+    char tag[RECORD_TAG];
+    CHECK(cipher.finish(tag));
+    return record + content + std::string(tag, sizeof(tag));
+}
+
+// 解开 seal 的结果，校验不过返回 false
+static bool open_record(RecordCipher& cipher, std::string record, std::string& content) {
+    size_t length = 0;
+    if (record.size() < RECORD_HEADER + RECORD_TAG || !cipher.begin_open(record.data(), length) ||
+        length != record.size() - RECORD_HEADER - RECORD_TAG) {
+        return false;
+    }
+    content = record.substr(RECORD_HEADER, length);
+    // 分两次 update，和 FrameReader 分段读到的情况一样
+    size_t half = length / 2;
+    return cipher.update(&content[0], half) && cipher.update(&content[half], length - half) &&
+           cipher.finish(&record[RECORD_HEADER + length]);
+}
+
+static void test_known_answer() {
+    // NIST GCM 测试向量（全 0 的密钥和 IV，16 字节 0）：记录头作为附加数据只影响校验码，不影响密文
+    uint8_t key[CIPHER_KEY_SIZE] = {};
+    uint8_t iv[CIPHER_IV_SIZE] = {};
+    RecordCipher cipher(key, iv, true);
+    CHECK(cipher.ok());
+    std::string record = seal(cipher, std::string(16, '\0'));
+    CHECK(record.substr(0, RECORD_HEADER) == std::string("\x10\0\0\0", 4));
+    std::string ciphertext = record.substr(RECORD_HEADER, 16);
+    CHECK(std::vector<uint8_t>(ciphertext.begin(), ciphertext.end()) == hex_bytes("0388dace60b6a392f328c2b971b2fe78"));
+    // 第二个记录的 nonce 换了，同样的内容密文不同
+    CHECK(seal(cipher, std::string(16, '\0')).substr(RECORD_HEADER, 16) != ciphertext);
+}
+
+static void test_records() {
+    uint8_t key[CIPHER_KEY_SIZE];
+    uint8_t iv[CIPHER_IV_SIZE];
+    for (size_t i = 0; i < sizeof(key); ++i) key[i] = (uint8_t)(i * 7 + 1);
+    for (size_t i = 0; i < sizeof(iv); ++i) iv[i] = (uint8_t)(i * 13 + 5);
+
+    RecordCipher sealer(key, iv, true);
+    RecordCipher opener(key, iv, false);
+    std::vector<std::string> contents = {"", "hello", sample_text(1000), sample_random(SEAL_CHUNK + 3)};
+    std::vector<std::string> records;
+    for (const std::string& content : contents) {
+        records.push_back(seal(sealer, content));
+        std::string opened;
+        CHECK(open_record(opener, records.back(), opened));
+        CHECK(opened == content);
+    }
+
+    // 改了密文或者校验码都解不开
+    RecordCipher tampered(key, iv, true);
+    std::string record = seal(tampered, "attack at dawn");
+    for (size_t pos : {RECORD_HEADER + 3, record.size() - 1}) {
+        RecordCipher fresh(key, iv, false);
+        std::string changed = record;
+        changed[pos] ^= 1;
+        std::string opened;
+        CHECK(!open_record(fresh, changed, opened));
+    }
+    RecordCipher fresh(key, iv, false);
+    std::string opened;
+    CHECK(open_record(fresh, record, opened));
+    // 重放：同一个记录第二次收到时序号已经变了
+    CHECK(!open_record(fresh, record, opened));
+
+    // 记录长度有上限
+    char header[RECORD_HEADER];
+    CHECK(!sealer.begin_seal(RECORD_LIMIT + 1, header));
+    size_t length = 0;
+    CHECK(!opener.begin_open("\xff\xff\xff\xff", length));
+}
+
+static void test_key_exchange() {
+    HelloTranscript transcript = {};
+    transcript.client = {PROTOCOL_VERSION, 0x1f};
+    transcript.server = {PROTOCOL_VERSION, 0x17};
+
+    KeyExchange client;
+    KeyExchange server;
+    CHECK(client.ok() && server.ok());
+    std::unique_ptr<RecordCipher> client_send, client_receive, server_send, server_receive;
+    CHECK(client.derive(server.public_key(), true, &transcript, sizeof(transcript), client_send, client_receive));
+    CHECK(server.derive(client.public_key(), false, &transcript, sizeof(transcript), server_send, server_receive));
+    std::string opened;
+    CHECK(open_record(*server_receive, seal(*client_send, "to server"), opened) && opened == "to server");
+    CHECK(open_record(*client_receive, seal(*server_send, "to client"), opened) && opened == "to client");
+    // 两个方向的密钥不同，发出去的东西原样弹回来解不开
+    CHECK(!open_record(*client_receive, seal(*client_send, "echo"), opened));
+
+    // 中间人改了 HELLO：两边派生的密钥对不上
+    HelloTranscript changed = transcript;
+    changed.client.features &= ~FEATURE_BUNDLE;
+    KeyExchange client2;
+    KeyExchange server2;
+    CHECK(client2.derive(server2.public_key(), true, &transcript, sizeof(transcript), client_send, client_receive));
+    CHECK(server2.derive(client2.public_key(), false, &changed, sizeof(changed), server_send, server_receive));
+    CHECK(!open_record(*server_receive, seal(*client_send, "to server"), opened));
+
+    // 全 0 的公钥（小子群的点）算不出共享密钥
+    uint8_t zero_key[KEY_EXCHANGE_SIZE] = {};
+    KeyExchange client3;
+    CHECK(!client3.derive(zero_key, true, &transcript, sizeof(transcript), client_send, client_receive));
+}
+
+// 发送队列加密写出小包和文件数据，另一头的 FrameReader 解密读回来
+static void test_send_queue() {
+    int fds[2];
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    char path[] = "/tmp/cipher_testXXXXXX";
+    int file_fd = mkstemp(path);
+    CHECK(file_fd >= 0);
+    std::string file_data = sample_random(3 * SEAL_CHUNK + 1000);
+    CHECK(write(file_fd, file_data.data(), file_data.size()) == (ssize_t)file_data.size());
+
+    uint8_t key[CIPHER_KEY_SIZE] = {9};
+    uint8_t iv[CIPHER_IV_SIZE] = {3};
+    std::string received_chat;
+    std::string received_file;
+    std::thread reader_thread([&] {
+        FrameReader reader(fds[1]);
+        reader.set_cipher(std::unique_ptr<RecordCipher>(new RecordCipher(key, iv, false)));
+        for (int i = 0; i < 2; ++i) {
+            uint8_t type = 0;
+            uint32_t length = 0;
+            if (!reader.read_header(type, length)) {
+                return;
+            }
+            std::string body(length, '\0');
+            if (!reader.read(&body[0], length)) {
+                return;
+            }
+            if (type == MSG_CHAT) {
+                received_chat = body;
+            } else if (type == MSG_FILE_DATA && length >= sizeof(FileDataMsg)) {
+                received_file = body.substr(sizeof(FileDataMsg));
+            }
+        }
+    });
+
+    {
+        SendQueue outbox(fds[0]);
+        outbox.set_cipher(std::make_shared<RecordCipher>(key, iv, true));
+        CHECK(outbox.push(SEND_CHAT, make_text_package(MSG_CHAT, "secret")));
+        FileDataMsg data_msg = {1, 0, (uint32_t)file_data.size()};
+        std::vector<char> head(FILE_DATA_HEAD_MAX);
+        head.resize(encode_file_data_head(1, data_msg, head.data()));
+        CHECK(outbox.push_bulk("file", std::move(head), file_fd, 0, data_msg.data_len));
+        CHECK(outbox.flush("file"));
+    }
+    reader_thread.join();
+    CHECK(received_chat == "secret");
+    CHECK(received_file == file_data);
+
+    close(file_fd);
+    unlink(path);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+int main() {
+    test_known_answer();
+    test_records();
+    test_key_exchange();
+    test_send_queue();
+    return test_result("cipher_test");
+}
+
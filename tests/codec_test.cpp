@@ -0,0 +1,242 @@
+// v2 线路格式：varint 的已知编码和截断、v1/v2 帧头，用户编号在 v1 包体和 v2 帧之间来回转换不丢；
+// MessageLayout 生成的编解码：已知的编码结果，v1、v2 编码后解回来字段不变，截断的包体解码失败
+#include <string>
+#include <vector>
+#include "ChunkSizer.h"
+#include "MessageCodec.h"
+#include "ProtocolV2.h"
+#include "TestUtil.h"
+
+static std::vector<uint8_t> bytes_of(const std::vector<char>& data) {
+    return std::vector<uint8_t>(data.begin(), data.end());
+}
+
+static void test_varint() {
+    const uint64_t values[] = {0, 1, 127, 128, 300, 16383, 16384, UINT32_MAX, (uint64_t)1 << 63, UINT64_MAX};
+    for (uint64_t value : values) {
+        char buffer[16];
+        size_t size = put_varint(buffer, value) - buffer;
+        CHECK(size == varint_size(value));
+        CHECK(size <= varint_max_size(sizeof(value)));
+        BufferSource in(buffer, size);
+        uint64_t decoded = 0;
+        CHECK(get_varint(in, decoded));
+        CHECK(decoded == value);
+        CHECK(in.remaining() == 0);
+        // 少一个字节就解不出来
+        BufferSource truncated(buffer, size - 1);
+        CHECK(!get_varint(truncated, decoded));
+    }
+    char buffer[16];
+    CHECK(bytes_of(std::vector<char>(buffer, put_varint(buffer, 300))) == hex_bytes("ac02"));
+    CHECK(varint_size(UINT64_MAX) == 10);
+
+    // 超过 64 位的 varint 是坏数据
+    std::vector<char> overlong(11, (char)0x80);
+    overlong.back() = 0x01;
+    BufferSource in(overlong.data(), overlong.size());
+    uint64_t value = 0;
+    CHECK(!get_varint(in, value));
+}
+
+static void test_frame_header() {
+    for (int version : {1, 2}) {
+        char header[V2_MAX_HEADER];
+        size_t size = put_frame_header(version, MSG_CHAT, 70000, header);
+        CHECK(size == (version == 2 ? 1 + varint_size(70000) : sizeof(Header)));
+        BufferSource in(header, size);
+        uint8_t type = 0;
+        uint32_t length = 0;
+        CHECK(get_frame_header(in, version, type, length));
+        CHECK(type == MSG_CHAT);
+        CHECK(length == 70000);
+    }
+    // v2 的聊天包帧头只有 2 个字节
+    std::vector<char> chat = encode_text_package(2, MSG_CHAT, "hi");
+    CHECK(bytes_of(chat) == hex_bytes("0203006869"));
+    CHECK(bytes_of(make_text_package(MSG_CHAT, "hi")) == hex_bytes("02000000026869"));
+}
+
+// 完整的 v2 帧 -> v1 包体和用户编号
+static bool v2_frame_to_v1(const std::vector<char>& frame, uint8_t expected_type, std::vector<char>& body,
+                           uint32_t& user_id) {
+    BufferSource in(frame.data(), frame.size());
+    uint8_t type = 0;
+    uint32_t length = 0;
+    return get_frame_header(in, 2, type, length) && type == expected_type && length == in.remaining() &&
+           v2_decode_body(type, in.rest(), length, body, user_id);
+}
+
+static void test_user_ids() {
+    // 聊天：编号 300 + 文字
+    char frame[32];
+    std::vector<char> chat(frame, frame + encode_text_v2(MSG_CHAT, 300, "hi", 2, frame));
+    CHECK(bytes_of(chat) == hex_bytes("0204ac026869"));
+    uint32_t user_id = 0;
+    const char* text = nullptr;
+    size_t text_length = 0;
+    CHECK(decode_text_v2(chat.data() + 2, chat.size() - 2, user_id, text, text_length));
+    CHECK(user_id == 300 && std::string(text, text_length) == "hi");
+    // 超过 32 位的编号是坏数据
+    char bad[16];
+    size_t bad_size = put_varint(bad, (uint64_t)1 << 33) - bad;
+    CHECK(!decode_text_v2(bad, bad_size, user_id, text, text_length));
+
+    // 文件邀约：v1 里的发送者名字在 v2 里换成编号，转回 v1 时名字留空，由收方按编号填上
+    FileMsg file = {};
+    std::strcpy(file.sender, "alice");
+    file.sender_len = 5;
+    std::strcpy(file.filename, "report.csv");
+    file.filename_len = 10;
+    file.file_size = 123456789;
+    std::vector<char> v2;
+    CHECK(v2_encode_frame(MSG_FILE, (const char*)&file, sizeof(file), 7, v2));
+    CHECK(v2.size() < sizeof(Header) + sizeof(file));
+    std::vector<char> body;
+    CHECK(v2_frame_to_v1(v2, MSG_FILE, body, user_id));
+    CHECK(user_id == 7 && body.size() == sizeof(FileMsg));
+    FileMsg file_out;
+    std::memcpy(&file_out, body.data(), sizeof(file_out));
+    CHECK(file_out.sender_len == 0);
+    CHECK(std::string(file_out.filename, file_out.filename_len) == "report.csv");
+    CHECK(file_out.file_size == file.file_size);
+
+    // 进度：最大的编号也能来回
+    ProgressMsg progress = {};
+    progress.total_size = (uint64_t)5 << 40;
+    progress.received_size = 12345;
+    CHECK(v2_encode_frame(MSG_PROGRESS, (const char*)&progress, sizeof(progress), UINT32_MAX, v2));
+    CHECK(v2_frame_to_v1(v2, MSG_PROGRESS, body, user_id));
+    CHECK(user_id == UINT32_MAX);
+    ProgressMsg progress_out;
+    std::memcpy(&progress_out, body.data(), sizeof(progress_out));
+    CHECK(progress_out.total_size == progress.total_size && progress_out.received_size == 12345);
+
+    // 文件数据帧的固定开销只有几个字节
+    FileDataMsg data = {1, 0, (uint32_t)MAX_CHUNK_SIZE};
+    char head[FILE_DATA_HEAD_MAX];
+    CHECK(encode_file_data_head(2, data, head) <= 8);
+    CHECK(encode_file_data_head(1, data, head) == sizeof(Header) + sizeof(FileDataMsg));
+
+    // v1 包体太短、类型不认识
+    CHECK(!v2_encode_frame(MSG_FILE, (const char*)&file, sizeof(file) - 1, 7, v2));
+    CHECK(!v2_encode_frame(0xff, (const char*)&file, sizeof(file), 7, v2));
+}
+
+// 每种消息的字段描述和结构体对得上（漏了字段、有填充时 CheckedLayout 编译不过），
+// 编码缓冲区的大小编译期就能算出
+static_assert(CheckedLayout<FileMsg>::v1_size == sizeof(FileMsg), "");
+static_assert(CheckedLayout<FileDataMsg>::v1_size == sizeof(FileDataMsg), "");
+static_assert(CheckedLayout<ProgressMsg>::v1_size == sizeof(ProgressMsg), "");
+static_assert(CheckedLayout<FileStatusMsg>::v1_size == sizeof(FileStatusMsg), "");
+static_assert(CheckedLayout<FileRequestMsg>::v1_size == sizeof(FileRequestMsg), "");
+static_assert(v2_frame_capacity<CreditMsg>() <= 32, "");
+static_assert(FILE_DATA_HEAD_MAX == sizeof(Header) + sizeof(FileDataMsg), "");
+
+// 完整的包 -> 消息，v1 和 v2 都行
+template <typename Msg>
+static bool decode_package(int version, const std::vector<char>& package, uint8_t expected_type, Msg& msg,
+                           std::string& tail) {
+    BufferSource in(package.data(), package.size());
+    uint8_t type = 0;
+    uint32_t length = 0;
+    if (!get_frame_header(in, version, type, length) || type != expected_type || length != in.remaining()) {
+        return false;
+    }
+    const char* tail_data = nullptr;
+    if (version == 2) {
+        CodecContext ctx;
+        if (!decode_v2(in.rest(), length, msg, ctx)) {
+            return false;
+        }
+        tail_data = ctx.tail;
+    } else if (!decode_v1(in.rest(), length, msg, &tail_data)) {
+        return false;
+    }
+    tail.assign(tail_data ? tail_data : "", CheckedLayout<Msg>::tail_length(msg));
+    return true;
+}
+
+static void test_layouts() {
+    // 已知答案：额度包、HELLO
+    CreditMsg credit = {5, 300};
+    CHECK(bytes_of(encode_package(2, MSG_CREDIT, credit)) == hex_bytes("0d0305ac02"));
+    CHECK(bytes_of(encode_package(1, MSG_CREDIT, credit)) == hex_bytes("080000000d050000002c010000"));
+    HelloMsg hello = {2, 0x1f};
+    CHECK(bytes_of(make_package(MSG_HELLO, hello)) == hex_bytes("050000000e021f000000"));
+
+    for (int version : {1, 2}) {
+        std::string tail;
+
+        FileMsg file = {};
+        file.file_size = 123456789012ull;
+        std::memset(file.file_hash, 0xab, sizeof(file.file_hash));
+        std::strcpy(file.filename, "报告.csv");
+        file.filename_len = std::strlen(file.filename);
+        std::strcpy(file.sender, "alice");
+        file.sender_len = 5;
+        FileMsg file_out;
+        CHECK(decode_package(version, encode_package(version, MSG_FILE, file), MSG_FILE, file_out, tail));
+        CHECK(file_out.file_size == file.file_size);
+        CHECK(std::memcmp(file_out.file_hash, file.file_hash, sizeof(file.file_hash)) == 0);
+        CHECK(std::string(file_out.filename, file_out.filename_len) == "报告.csv");
+        // v2 不带名字，发送者由服务器按连接填
+        CHECK(file_out.sender_len == (version == 2 ? 0u : 5u));
+
+        FileStatusMsg status = {};
+        std::memset(status.file_hash, 0x11, sizeof(status.file_hash));
+        status.need_upload = 1;
+        status.max_chunk = MAX_CHUNK_SIZE;
+        status.transfer_id = 77;
+        status.window = 8 << 20;
+        const char bitmap[] = {0x0f, 0x00, 0x7f};
+        status.bitmap_len = sizeof(bitmap);
+        FileStatusMsg status_out;
+        std::vector<char> package = encode_package(version, MSG_FILE_STATUS, status, bitmap);
+        CHECK(decode_package(version, package, MSG_FILE_STATUS, status_out, tail));
+        CHECK(status_out.transfer_id == 77 && status_out.window == status.window && status_out.need_upload == 1);
+        CHECK(status_out.max_chunk == MAX_CHUNK_SIZE);
+        CHECK(tail == std::string(bitmap, sizeof(bitmap)));
+        // 位图被截掉一截
+        package.pop_back();
+        if (version == 1) {
+            package[0] -= 1; // v1 的帧头长度跟着改，否则帧头就对不上
+        } else {
+            package[1] -= 1;
+        }
+        CHECK(decode_package(version, package, MSG_FILE_STATUS, status_out, tail) == (version == 2));
+        if (version == 2) {
+            CHECK(tail.size() == sizeof(bitmap) - 1); // v2 的位图长度由包体长度算出
+        }
+
+        FileDataMsg data = {9, (uint64_t)5 << 32, 4};
+        FileDataMsg data_out;
+        CHECK(decode_package(version, encode_package(version, MSG_FILE_DATA, data, "DATA"), MSG_FILE_DATA, data_out,
+                             tail));
+        CHECK(data_out.transfer_id == 9 && data_out.offset == data.offset && data_out.data_len == 4);
+        CHECK(tail == "DATA");
+
+        KeyExchangeMsg key = {};
+        for (size_t i = 0; i < sizeof(key.public_key); ++i) {
+            key.public_key[i] = (uint8_t)i;
+        }
+        KeyExchangeMsg key_out;
+        CHECK(decode_package(version, encode_package(version, MSG_KEY_EXCHANGE, key), MSG_KEY_EXCHANGE, key_out, tail));
+        CHECK(std::memcmp(key.public_key, key_out.public_key, sizeof(key.public_key)) == 0);
+    }
+
+    // 包体太短
+    std::vector<char> short_body(sizeof(FileMsg) - 1);
+    FileMsg file;
+    CHECK(!decode_v1(short_body, file));
+    CodecContext ctx;
+    CHECK(!decode_v2(short_body.data(), 3, file, ctx));
+}
+
+int main() {
+    test_varint();
+    test_frame_header();
+    test_user_ids();
+    test_layouts();
+    return test_result("codec_test");
+}
@@ -0,0 +1,106 @@
+// FrameCompressor、ChunkCompressor：压缩后解回来和原来一样，跨包的压缩流越压越小，
+// 不可压缩的数据块不压，坏数据解压失败。找到 zlib（HAVE_ZLIB）才编译
+#include <string>
+#include <vector>
+#include "ChunkCompressor.h"
+#include "ChunkSizer.h"
+#include "FrameCompressor.h"
+#include "TestUtil.h"
+
+// 压缩流换出的帧 -> 原来的帧。没压（太短）的原样返回
+static bool inflate_frame(FrameDecompressor& decompressor, int version, const std::vector<char>& frame,
+                          std::vector<char>& original) {
+    BufferSource in(frame.data(), frame.size());
+    uint8_t type = 0;
+    uint32_t length = 0;
+    if (!get_frame_header(in, version, type, length) || length != in.remaining()) {
+        return false;
+    }
+    if (type != MSG_COMPRESSED) {
+        original = frame;
+        return true;
+    }
+    return decompressor.decompress(in.rest(), length, original);
+}
+
+static void test_frame_compressor() {
+    for (int version : {1, 2}) {
+        FrameCompressor compressor(version);
+        FrameDecompressor decompressor;
+        size_t raw_bytes = 0;
+        size_t wire_bytes = 0;
+        for (int i = 0; i < 200; ++i) {
+            std::string text = "Server: alice connected, 好的 收到 message number " + std::to_string(i % 7);
+            std::vector<char> original = encode_text_package(version, MSG_CHAT, text);
+            std::vector<char> frame = original;
+            CHECK(compressor.compress(frame));
+            raw_bytes += original.size();
+            wire_bytes += frame.size();
+            std::vector<char> inflated;
+            CHECK(inflate_frame(decompressor, version, frame, inflated));
+            CHECK(inflated == original);
+        }
+        // 字典和跨包的上下文让重复的聊天内容压得很小
+        CHECK(wire_bytes * 3 < raw_bytes);
+
+        // 太短的帧不压
+        std::vector<char> tiny = encode_text_package(version, MSG_CHAT, "hi");
+        std::vector<char> frame = tiny;
+        CHECK(compressor.compress(frame));
+        CHECK(frame == tiny);
+
+        // 不可压缩的大帧也能原样解回来
+        std::vector<char> original = encode_text_package(version, MSG_CHAT, sample_random(100000));
+        frame = original;
+        CHECK(compressor.compress(frame));
+        std::vector<char> inflated;
+        CHECK(inflate_frame(decompressor, version, frame, inflated));
+        CHECK(inflated == original);
+    }
+
+    // 坏数据：解压流从此不能再用
+    FrameDecompressor broken;
+    std::vector<char> out;
+    std::string garbage = "\xff\xfe\xfd\xfc\xfb\xfa";
+    CHECK(!broken.decompress(garbage.data(), garbage.size(), out));
+    CHECK(!broken.decompress("", 0, out));
+}
+
+static void test_chunk_compressor() {
+    std::string text = sample_text(256 * 1024);
+    std::string random = sample_random(256 * 1024);
+    ChunkCompressor compressor;
+    std::vector<char> packed;
+    // 一开始不压，先量链路的速度；之后隔几个窗口总会试一次压缩
+    bool compressed = false;
+    for (int window = 0; window < 100 && !compressed; ++window) {
+        compressed = compressor.compress(text.data(), text.size(), packed);
+        if (!compressed) {
+            compressor.on_sent(COMPRESS_WINDOW);
+        }
+    }
+    CHECK(compressed);
+    CHECK(packed.size() < text.size() / 2);
+    // 正在压缩的窗口里，不可压缩的数据块照样不压
+    std::vector<char> random_packed;
+    CHECK(!compressor.compress(random.data(), random.size(), random_packed));
+
+    ChunkDecompressor decompressor;
+    std::vector<char> out(MAX_CHUNK_SIZE);
+    size_t length = 0;
+    CHECK(decompressor.decompress(packed.data(), packed.size(), out.data(), out.size(), length));
+    CHECK(std::string(out.data(), length) == text);
+    // 每块单独解，同一个解压器可以接着用
+    CHECK(decompressor.decompress(packed.data(), packed.size(), out.data(), out.size(), length));
+    CHECK(length == text.size());
+    // 解出来超过容量、数据被截断、坏数据都失败
+    CHECK(!decompressor.decompress(packed.data(), packed.size(), out.data(), text.size() - 1, length));
+    CHECK(!decompressor.decompress(packed.data(), packed.size() / 2, out.data(), out.size(), length));
+    CHECK(!decompressor.decompress(random.data(), 1000, out.data(), out.size(), length));
+}
+
+int main() {
+    test_frame_compressor();
+    test_chunk_compressor();
+    return test_result("compress_test");
+}
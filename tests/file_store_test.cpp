@@ -0,0 +1,209 @@
+// FileStore：分块上传收齐后校验入库，读回来的内容和原文件一样；相同内容的数据块只存一份；
+// 哈希对不上的上传不入库；断线后续传只缺没收到的分片；几条连接同时写同一个上传；
+// 先写临时文件、后知道哈希的上传（老客户端发来的）
+#include <cstdlib>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include "FileStore.h"
+#include "TestUtil.h"
+
+static std::string hash_hex(const std::string& data) {
+    Sha256 sha;
+    sha.update(data.data(), data.size());
+    uint8_t digest[Sha256::DIGEST_SIZE];
+    sha.final(digest);
+    return Sha256::to_hex(digest);
+}
+
+// 按 chunk 大小把 data 全部写进上传，返回最后一次是否报告收齐
+static bool upload_all(FileStore& store, const std::string& file_hash, const std::string& data, size_t chunk) {
+    bool complete = false;
+    for (size_t offset = 0; offset < data.size(); offset += chunk) {
+        size_t len = std::min(chunk, data.size() - offset);
+        CHECK(!complete);
+        CHECK(store.write_chunk(file_hash, offset, data.data() + offset, len, complete));
+    }
+    return complete;
+}
+
+// 按清单把入库的文件拼回来
+static std::string read_stored(FileStore& store, const std::string& file_hash) {
+    StoreManifest manifest;
+    if (!store.load_manifest(file_hash, manifest)) {
+        return "";
+    }
+    std::string data;
+    std::vector<char> block;
+    for (const std::string& block_hash : manifest.blocks) {
+        if (!store.read_block(block_hash, block)) {
+            return "";
+        }
+        data.append(block.data(), block.size());
+    }
+    return data.size() == manifest.file_size ? data : "";
+}
+
+static void test_upload(const std::string& root) {
+    FileStore store(root);
+    // 两片半：最后一个数据块不满
+    std::string data = sample_random(2 * FILE_PIECE_SIZE + FILE_PIECE_SIZE / 2);
+    std::string file_hash = hash_hex(data);
+    CHECK(!store.has_file(file_hash));
+
+    std::vector<uint8_t> have;
+    CHECK(store.begin_upload(file_hash, data.size(), have));
+    CHECK(!store.begin_upload(file_hash, data.size(), have)); // 同一份内容同时只有一个上传者
+    bool complete = false;
+    CHECK(!store.write_chunk(file_hash, data.size(), "x", 1, complete)); // 超出文件
+    CHECK(!store.write_chunk(file_hash, UINT64_MAX, "x", 1, complete));
+    CHECK(upload_all(store, file_hash, data, 64 * 1024));
+    CHECK(store.upload_complete(file_hash));
+
+    // 收齐的分片可以从 spill 文件读，不用等入库
+    CHECK(store.wait_piece(file_hash, 1) == PIECE_READY);
+    std::vector<char> piece;
+    CHECK(store.read_spill(file_hash, 2, data.size(), piece));
+    CHECK(std::string(piece.data(), piece.size()) == data.substr(2 * FILE_PIECE_SIZE));
+
+    size_t new_blocks = 0;
+    CHECK(store.finish_upload(file_hash, &new_blocks));
+    CHECK(new_blocks == 3);
+    CHECK(store.has_file(file_hash));
+    CHECK(store.wait_piece(file_hash, 0) == PIECE_STORED);
+    CHECK(read_stored(store, file_hash) == data);
+
+    // 前两片相同、只有最后一片不同的文件：只存新的那一块
+    std::string changed = data;
+    changed.back() ^= 1;
+    std::string changed_hash = hash_hex(changed);
+    CHECK(store.begin_upload(changed_hash, changed.size(), have));
+    CHECK(upload_all(store, changed_hash, changed, FILE_PIECE_SIZE));
+    CHECK(store.finish_upload(changed_hash, &new_blocks));
+    CHECK(new_blocks == 1);
+    CHECK(read_stored(store, changed_hash) == changed);
+
+    // 内容和声明的哈希对不上：不入库
+    std::string wrong_hash = hash_hex("something else");
+    CHECK(store.begin_upload(wrong_hash, data.size(), have));
+    CHECK(upload_all(store, wrong_hash, data, FILE_PIECE_SIZE));
+    CHECK(!store.finish_upload(wrong_hash));
+    CHECK(!store.has_file(wrong_hash));
+    CHECK(store.wait_piece(wrong_hash, 0) == PIECE_GONE);
+
+    // 不是十六进制哈希的名字不接受（它会拼进路径）
+    CHECK(!store.begin_upload("../../etc/passwd", 10, have));
+}
+
+static void test_resume(const std::string& root) {
+    FileStore store(root);
+    std::string data = sample_text(3 * FILE_PIECE_SIZE);
+    std::string file_hash = hash_hex(data);
+    std::vector<uint8_t> have;
+    CHECK(store.begin_upload(file_hash, data.size(), have));
+    CHECK(!PieceMap::test_bit(have, 0));
+    bool complete = false;
+    CHECK(store.write_chunk(file_hash, FILE_PIECE_SIZE, data.data() + FILE_PIECE_SIZE, FILE_PIECE_SIZE, complete));
+    CHECK(!complete);
+    // 上传者断线：.part 和位图留着，重新开始时第 1 片已经有了
+    store.release_upload(file_hash);
+    CHECK(store.wait_piece(file_hash, 0) == PIECE_GONE);
+    CHECK(store.begin_upload(file_hash, data.size(), have));
+    CHECK(!PieceMap::test_bit(have, 0));
+    CHECK(PieceMap::test_bit(have, 1));
+    CHECK(!PieceMap::test_bit(have, 2));
+    CHECK(store.write_chunk(file_hash, 0, data.data(), FILE_PIECE_SIZE, complete));
+    CHECK(!complete);
+    CHECK(store.write_chunk(file_hash, 2 * FILE_PIECE_SIZE, data.data() + 2 * FILE_PIECE_SIZE, FILE_PIECE_SIZE,
+                            complete));
+    CHECK(complete);
+    CHECK(store.finish_upload(file_hash));
+    CHECK(read_stored(store, file_hash) == data);
+}
+
+// 几条并行连接各写一部分分片（写盘不持锁）：只有一次调用报告收齐，入库的内容完整
+static void test_parallel_writes(const std::string& root) {
+    FileStore store(root);
+    std::string data = sample_random(8 * FILE_PIECE_SIZE + 1000, 7);
+    std::string file_hash = hash_hex(data);
+    std::vector<uint8_t> have;
+    CHECK(store.begin_upload(file_hash, data.size(), have));
+    const size_t chunk = 64 * 1024;
+    const int streams = 4;
+    std::atomic<int> completions{0};
+    std::atomic<int> failures{0};
+    std::vector<std::thread> writers;
+    for (int stream = 0; stream < streams; ++stream) {
+        writers.emplace_back([&, stream] {
+            for (uint32_t piece = stream; piece < PieceMap::piece_count(data.size()); piece += streams) {
+                uint64_t end = std::min<uint64_t>(data.size(), (uint64_t)(piece + 1) * FILE_PIECE_SIZE);
+                for (uint64_t offset = (uint64_t)piece * FILE_PIECE_SIZE; offset < end; offset += chunk) {
+                    size_t len = (size_t)std::min<uint64_t>(chunk, end - offset);
+                    bool complete = false;
+                    if (!store.write_chunk(file_hash, offset, data.data() + offset, len, complete)) {
+                        ++failures;
+                    }
+                    completions += complete;
+                }
+            }
+        });
+    }
+    for (auto& writer : writers) {
+        writer.join();
+    }
+    CHECK(failures == 0);
+    CHECK(completions == 1);
+    CHECK(store.finish_upload(file_hash));
+    CHECK(read_stored(store, file_hash) == data);
+
+    // 断线和写盘同时发生：release_upload 等正在写的数据块写完再关 fd，之后的写入都被拒绝
+    std::string other = sample_random(4 * FILE_PIECE_SIZE, 11);
+    std::string other_hash = hash_hex(other);
+    CHECK(store.begin_upload(other_hash, other.size(), have));
+    std::atomic<bool> released{false};
+    std::thread writer([&] {
+        for (uint64_t offset = 0; offset < other.size(); offset += chunk) {
+            bool complete = false;
+            bool after_release = released;
+            bool written = store.write_chunk(other_hash, offset, other.data() + offset, chunk, complete);
+            if (after_release && written) {
+                ++failures;
+            }
+        }
+    });
+    std::this_thread::yield();
+    store.release_upload(other_hash);
+    released = true;
+    writer.join();
+    CHECK(failures == 0);
+}
+
+static void test_import(const std::string& root) {
+    FileStore store(root);
+    std::string data = sample_text(FILE_PIECE_SIZE + 123);
+    std::string file_hash = hash_hex(data);
+    for (const std::string& claimed : {hash_hex("not it"), file_hash, file_hash}) {
+        std::string path;
+        int fd = store.create_temp(path);
+        CHECK(fd >= 0);
+        CHECK(write(fd, data.data(), data.size()) == (ssize_t)data.size());
+        close(fd);
+        // 哈希对不上的不入库；已经有了的第二次什么都不做。临时文件都删掉
+        CHECK(store.import_file(path, claimed, data.size()) == (claimed == file_hash));
+        CHECK(access(path.c_str(), F_OK) != 0);
+    }
+    CHECK(read_stored(store, file_hash) == data);
+}
+
+int main() {
+    char dir[] = "/tmp/file_store_testXXXXXX";
+    CHECK(mkdtemp(dir) != nullptr);
+    test_upload(dir);
+    test_resume(dir);
+    test_parallel_writes(dir);
+    test_import(dir);
+    std::string command = std::string("rm -rf ") + dir;
+    CHECK(system(command.c_str()) == 0);
+    return test_result("file_store_test");
+}
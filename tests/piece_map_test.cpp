@@ -0,0 +1,120 @@
+// PieceMap：分块收齐一片、重复和不完整的数据块不计数、越界的范围拒绝、位图写盘后能重新加载；
+// 并行连接按 stripe_skip 分到的分片互不重叠，合起来正好是对方缺的那些
+#include <cstdlib>
+#include <string>
+#include <unistd.h>
+#include "PieceMap.h"
+#include "TestUtil.h"
+
+static const uint32_t PIECE = FILE_PIECE_SIZE;
+static const uint32_t BLOCK = PieceMap::PIECE_BLOCK_SIZE;
+
+static void test_piece_map(const std::string& dir) {
+    std::string path = dir + "/test.map";
+    uint8_t hash[32] = {1, 2, 3};
+    uint64_t size = 3 * (uint64_t)PIECE + PIECE / 2 + 100; // 4 片，最后一片不满，也不是小块的整数倍
+    CHECK(PieceMap::piece_count(size) == 4);
+    CHECK(PieceMap::piece_length(size, 3) == PIECE / 2 + 100);
+    CHECK(PieceMap::piece_count(0) == 0);
+
+    PieceMap map;
+    CHECK(map.open(path, hash, size));
+    CHECK(!map.complete());
+    CHECK(map.received_bytes() == 0);
+
+    // 一片分两半收，第二半收到时这一片收齐
+    CHECK(!map.add(0, PIECE / 2));
+    CHECK(map.add(PIECE / 2, PIECE / 2));
+    CHECK(map.has_piece(0));
+    CHECK(map.received_bytes() == PIECE);
+    // 收齐的片再收到不计数
+    CHECK(!map.add(0, PIECE));
+    CHECK(map.received_bytes() == PIECE);
+
+    // 不满一个小块的数据不记，同一小块收到两次只算一次
+    CHECK(!map.add(PIECE, BLOCK - 1));
+    CHECK(map.received_bytes() == PIECE);
+    CHECK(!map.add(PIECE, BLOCK));
+    CHECK(!map.add(PIECE, BLOCK));
+    CHECK(map.received_bytes() == PIECE + BLOCK);
+
+    // 超出文件的范围、offset + len 会溢出的范围都拒绝
+    CHECK(!map.add(size, 1));
+    CHECK(!map.add(size - 10, 11));
+    CHECK(!map.add(0, size + 1));
+    CHECK(!map.add(UINT64_MAX - 10, 100));
+    CHECK(!map.add((uint64_t)1 << 52, BLOCK)); // 片号截成 32 位后会落到第 0 片
+    CHECK(map.received_bytes() == PIECE + BLOCK);
+
+    CHECK(map.add(PIECE, PIECE));
+    CHECK(map.add(2 * (uint64_t)PIECE, PIECE));
+    CHECK(!map.complete());
+    CHECK(map.add(3 * (uint64_t)PIECE, PIECE / 2 + 100)); // 最后一片不满，最后一小块也不满
+    CHECK(map.complete());
+    CHECK(map.received_bytes() == size);
+    map.close();
+
+    // 位图写在磁盘上，重新加载后状态一样
+    PieceMap loaded;
+    CHECK(loaded.load(path));
+    CHECK(loaded.file_size() == size);
+    CHECK(std::memcmp(loaded.file_hash(), hash, sizeof(hash)) == 0);
+    CHECK(loaded.complete());
+    CHECK(loaded.received_bytes() == size);
+    loaded.close();
+
+    // 同一个位图文件换了大小（不是同一个文件）就从头开始
+    PieceMap reopened;
+    CHECK(reopened.open(path, hash, size + PIECE));
+    CHECK(!reopened.has_piece(0));
+    CHECK(reopened.received_bytes() == 0);
+    reopened.remove();
+    CHECK(access(path.c_str(), F_OK) != 0);
+
+    // 太大的文件不分配位图
+    PieceMap huge;
+    CHECK(!huge.open(path, hash, MAX_FILE_SIZE + 1));
+    CHECK(huge.open(path, hash, MAX_FILE_SIZE));
+    CHECK(PieceMap::piece_count(MAX_FILE_SIZE) == MAX_FILE_SIZE / PIECE);
+    huge.remove();
+
+    // 空文件一打开就是收齐的
+    PieceMap empty;
+    CHECK(empty.open(path, hash, 0));
+    CHECK(empty.complete());
+    CHECK(!empty.add(0, 0));
+    empty.remove();
+}
+
+static void test_stripe_skip() {
+    uint64_t size = 5 * (uint64_t)PIECE;
+    std::vector<uint8_t> have = {0x01}; // 第 0 片对方已经有了
+    std::vector<uint8_t> skip = PieceMap::stripe_skip(have, size, 1, 2);
+    // 第 1 条连接负责奇数片，跳过偶数片和对方已有的
+    CHECK(PieceMap::test_bit(skip, 0));
+    CHECK(!PieceMap::test_bit(skip, 1));
+    CHECK(PieceMap::test_bit(skip, 2));
+    CHECK(!PieceMap::test_bit(skip, 3));
+    CHECK(PieceMap::test_bit(skip, 4));
+    CHECK(PieceMap::stripe_skip(have, size, 0, 1) == have);
+
+    // 每一片正好由一条连接发（已有的谁都不发），连接数多于分片数也一样
+    for (uint32_t streams : {2u, 3u, 4u, 7u}) {
+        for (uint32_t piece = 0; piece < 5; ++piece) {
+            int senders = 0;
+            for (uint32_t stream = 0; stream < streams; ++stream) {
+                senders += !PieceMap::test_bit(PieceMap::stripe_skip(have, size, stream, streams), piece);
+            }
+            CHECK(senders == (piece == 0 ? 0 : 1));
+        }
+    }
+}
+
+int main() {
+    char dir[] = "/tmp/piece_map_testXXXXXX";
+    CHECK(mkdtemp(dir) != nullptr);
+    test_piece_map(dir);
+    rmdir(dir);
+    test_stripe_skip();
+    return test_result("piece_map_test");
+}
@@ -0,0 +1,52 @@
+// Sha256：FIPS 180-2 的已知答案，分段喂入和一次喂入结果相同，十六进制互转
+#include <string>
+#include "Sha256.h"
+#include "TestUtil.h"
+
+static std::string digest_hex(const std::string& data, size_t step) {
+    Sha256 sha;
+    for (size_t pos = 0; pos < data.size(); pos += step) {
+        sha.update(data.data() + pos, std::min(step, data.size() - pos));
+    }
+    uint8_t digest[Sha256::DIGEST_SIZE];
+    sha.final(digest);
+    return Sha256::to_hex(digest);
+}
+
+static std::string digest_hex(const std::string& data) {
+    return digest_hex(data, data.empty() ? 1 : data.size());
+}
+
+int main() {
+    CHECK(digest_hex("") == "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+    CHECK(digest_hex("abc") == "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+    CHECK(digest_hex("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq") ==
+          "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1");
+
+    std::string million(1000000, 'a');
+    const std::string expected = "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0";
+    CHECK(digest_hex(million) == expected);
+    // 跨 64 字节块边界的各种分段
+    for (size_t step : {1, 55, 63, 64, 65, 4096, 999999}) {
+        CHECK(digest_hex(million, step) == expected);
+    }
+
+    // reset 之后可以接着算下一个
+    Sha256 sha;
+    sha.update("xyz", 3);
+    sha.reset();
+    sha.update("abc", 3);
+    uint8_t digest[Sha256::DIGEST_SIZE];
+    sha.final(digest);
+    CHECK(Sha256::to_hex(digest) == digest_hex("abc"));
+
+    uint8_t parsed[Sha256::DIGEST_SIZE];
+    CHECK(Sha256::from_hex(expected, parsed));
+    CHECK(Sha256::to_hex(parsed) == expected);
+    CHECK(Sha256::from_hex("CDC76E5C9914FB9281A1C7E284D73E67F1809A48A497200E046D39CCC7112CD0", parsed));
+    CHECK(Sha256::to_hex(parsed) == expected);
+    CHECK(!Sha256::from_hex(expected.substr(2), parsed));
+    CHECK(!Sha256::from_hex("zz" + expected.substr(2), parsed));
+
+    return test_result("sha256_test");
+}
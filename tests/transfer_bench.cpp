@@ -0,0 +1,483 @@
+// 吞吐量测量，不是测试，不加进 ctest，由 tests/bench.sh 编译运行。
+// 在本机回环的 TCP 连接上用 SendQueue 发文件数据、FrameReader 收，和客户端上传走同一条路径。
+// 用法: transfer_bench [选项]
+//   --size-mb N   发送的数据量，默认 256
+//   --copy        数据块先 pread 进缓冲区再 send（客户端关掉 Zero Copy 时的路径），默认用 sendfile
+//   --chunk-kb N  数据块大小（KB），和 client_gui --chunk-kb 一样按 ChunkSizer 取到 16KB 到 1MB 之间的 2 的幂，默认 256
+//   --latency     测传文件时聊天消息的延迟：每 5ms 发一条带时间戳的聊天，收方读文件数据限速 --rate-mb，
+//                 模拟跑满的链路。聊天和文件数据走同一条连接（没有单独的数据连接时）、各走各的连接时各测一次，
+//                 报告 p50/p99
+//   --rate-mb N   --latency 时收方读文件数据的速度（MB/s），默认 100
+//   --encrypt     两头都加密（FEATURE_ENCRYPT 的记录），另外单独测一个核上加密、解密记录的速度。要找到 OpenSSL
+//   --broadcast N 测服务器的 --write-tick：N 个在线用户每人每 100ms 说一句话，每句广播给所有 N 个连接，
+//                 和服务器一样每个连接一个 SendQueue。合并发送关闭、打开（--tick-us）时各跑一次，
+//                 报告写 socket 的系统调用次数（SendQueue::write_calls）和聊天延迟的 p50/p99
+//   --tick-us N   --broadcast 时合并发送等多久（微秒），和 server --write-tick 一样，默认 1000
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include "ChunkSizer.h"
+#include "ProtocolV2.h"
+#include "SendQueue.h"
+#include "TestUtil.h"
+
+struct BenchOptions {
+    uint64_t size = 256ull << 20;
+    bool copy = false;
+    bool encrypt = false;
+    uint32_t chunk = 256 * 1024; // 每个数据块的大小
+    bool latency = false;
+    uint64_t rate = 100ull << 20; // --latency 时收方读文件数据的速度，字节/秒
+    int broadcast = 0;            // --broadcast 的在线用户数，0 表示不测
+    int tick_us = 1000;
+};
+
+static int64_t now_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+// 跑一次 fn，打印 bytes 字节用了多久、每秒多少 MB
+static void measure(const std::string& name, uint64_t bytes, const std::function<bool()>& fn) {
+    auto start = std::chrono::steady_clock::now();
+    bool ok = fn();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::printf("%-40s %8.1f MB/s  (%.0f MB in %.3f s)%s\n", name.c_str(), bytes / seconds / (1 << 20),
+                bytes / 1048576.0, seconds, ok ? "" : "  FAILED");
+}
+
+// 本机回环上的一对 TCP 连接
+static bool loopback_pair(int& sender, int& receiver) {
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    bool ok = listener >= 0 && bind(listener, (sockaddr*)&addr, sizeof(addr)) == 0 && listen(listener, 1) == 0 &&
+              getsockname(listener, (sockaddr*)&addr, &len) == 0;
+    sender = ok ? socket(AF_INET, SOCK_STREAM, 0) : -1;
+    ok = ok && sender >= 0 && connect(sender, (sockaddr*)&addr, sizeof(addr)) == 0;
+    receiver = ok ? accept(listener, nullptr, nullptr) : -1;
+    if (listener >= 0) {
+        close(listener);
+    }
+    return ok && receiver >= 0;
+}
+
+// RUSAGE_SELF 是整个进程，RUSAGE_THREAD 是调用的线程，单位秒
+static double cpu_seconds(int who) {
+    struct rusage usage;
+    getrusage(who, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+// 把 file_fd 的前 size 字节按 options.chunk 分块发过去，收方读出每个数据块。
+// receiver_cpu 不为空时填上收方线程用的 CPU 时间（秒）
+static bool send_file(int file_fd, const BenchOptions& options, double* receiver_cpu = nullptr) {
+    int sender = -1;
+    int receiver = -1;
+    if (!loopback_pair(sender, receiver)) {
+        return false;
+    }
+    uint64_t size = options.size;
+    uint64_t received = 0;
+    // 两个方向各用各的密钥，这里只有一个方向，随便取一个
+    const uint8_t key[CIPHER_KEY_SIZE] = {1};
+    const uint8_t iv[CIPHER_IV_SIZE] = {2};
+    std::thread reader_thread([&] {
+        FrameReader reader(receiver);
+        reader.set_version(2);
+#ifdef HAVE_OPENSSL
+        if (options.encrypt) {
+            reader.set_cipher(std::unique_ptr<RecordCipher>(new RecordCipher(key, iv, false)));
+        }
+#endif
+        std::vector<char> chunk(MAX_CHUNK_SIZE);
+        double cpu_start = cpu_seconds(RUSAGE_THREAD);
+        while (received < size) {
+            uint8_t type = 0;
+            uint32_t length = 0;
+            FileDataMsg data_msg;
+            if (!reader.read_header(type, length) || !v2_read_head(reader, length, data_msg) ||
+                data_msg.data_len > chunk.size() || !reader.read(chunk.data(), data_msg.data_len)) {
+                return;
+            }
+            received += data_msg.data_len;
+        }
+        if (receiver_cpu) {
+            *receiver_cpu = cpu_seconds(RUSAGE_THREAD) - cpu_start;
+        }
+    });
+    bool ok = true;
+    {
+        SendQueue outbox(sender);
+#ifdef HAVE_OPENSSL
+        if (options.encrypt) {
+            outbox.set_cipher(std::make_shared<RecordCipher>(key, iv, true));
+        }
+#endif
+        for (uint64_t offset = 0; offset < size && ok; offset += options.chunk) {
+            FileDataMsg data_msg = {1, offset, (uint32_t)std::min<uint64_t>(options.chunk, size - offset)};
+            std::vector<char> package(FILE_DATA_HEAD_MAX);
+            size_t head_size = encode_file_data_head(2, data_msg, package.data());
+            if (options.copy) {
+                package.resize(head_size + data_msg.data_len);
+                ok = pread(file_fd, package.data() + head_size, data_msg.data_len, offset) == (ssize_t)data_msg.data_len &&
+                     outbox.push_bulk("file", std::move(package), head_size);
+            } else {
+                package.resize(head_size);
+                ok = outbox.push_bulk("file", std::move(package), file_fd, offset, data_msg.data_len);
+            }
+        }
+        ok = ok && outbox.flush("file");
+    }
+    reader_thread.join();
+    close(sender);
+    close(receiver);
+    return ok && received == size;
+}
+
+#ifdef HAVE_OPENSSL
+// 一个核上把 size 字节按 SEAL_CHUNK 加密成记录、再解密回来的速度，不经过 socket
+static void cipher_speed(uint64_t size) {
+    const uint8_t key[CIPHER_KEY_SIZE] = {1};
+    const uint8_t iv[CIPHER_IV_SIZE] = {2};
+    std::string data = sample_random(SEAL_CHUNK);
+    char header[RECORD_HEADER];
+    char tag[RECORD_TAG];
+    RecordCipher seal(key, iv, true);
+    measure("seal records, one core", size, [&] {
+        for (uint64_t done = 0; done < size; done += data.size()) {
+            if (!seal.begin_seal(data.size(), header) || !seal.update(&data[0], data.size()) || !seal.finish(tag)) {
+                return false;
+            }
+        }
+        return true;
+    });
+    // 解密要校验码对得上：先加密出 size 字节的记录，再按顺序解开
+    size_t count = (size_t)(size / data.size());
+    std::vector<char> records(count * (RECORD_HEADER + data.size() + RECORD_TAG));
+    RecordCipher reseal(key, iv, true);
+    for (size_t i = 0; i < count; ++i) {
+        char* record = records.data() + i * (RECORD_HEADER + data.size() + RECORD_TAG);
+        std::memcpy(record + RECORD_HEADER, data.data(), data.size());
+        reseal.begin_seal(data.size(), record);
+        reseal.update(record + RECORD_HEADER, data.size());
+        reseal.finish(record + RECORD_HEADER + data.size());
+    }
+    RecordCipher open(key, iv, false);
+    measure("open records, one core", (uint64_t)count * data.size(), [&] {
+        for (size_t i = 0; i < count; ++i) {
+            char* record = records.data() + i * (RECORD_HEADER + data.size() + RECORD_TAG);
+            size_t length = 0;
+            if (!open.begin_open(record, length) || !open.update(record + RECORD_HEADER, length) ||
+                !open.finish(record + RECORD_HEADER + length)) {
+                return false;
+            }
+        }
+        return true;
+    });
+}
+#endif
+
+// 从 reader 读帧直到 done：聊天消息算出延迟放进 latencies，文件数据按 rate 限速地读（读得比发得慢，
+// 发送方的队列和两头的 socket 缓冲区都会塞满，和跑满的链路一样）
+static void read_frames(FrameReader& reader, uint64_t rate, std::atomic<bool>& done, std::vector<double>& latencies) {
+    std::vector<char> chunk(MAX_CHUNK_SIZE);
+    int64_t start = now_us();
+    uint64_t data_bytes = 0;
+    while (!done) {
+        uint8_t type = 0;
+        uint32_t length = 0;
+        if (!reader.read_header(type, length)) {
+            return;
+        }
+        if (type == MSG_CHAT) {
+            std::string body(length, '\0');
+            uint64_t user_id = 0;
+            BufferSource in(body.data(), body.size()); // v2 的聊天包体：发送者编号 + 文字
+            if (!reader.read(&body[0], length) || !get_varint(in, user_id)) {
+                return;
+            }
+            latencies.push_back((now_us() - std::stoll(std::string(in.rest(), in.remaining()))) / 1000.0);
+            continue;
+        }
+        FileDataMsg data_msg;
+        if (!v2_read_head(reader, length, data_msg) || data_msg.data_len > chunk.size() ||
+            !reader.read(chunk.data(), data_msg.data_len)) {
+            return;
+        }
+        data_bytes += data_msg.data_len;
+        int64_t due = start + (int64_t)(data_bytes * 1e6 / rate);
+        if (due > now_us()) {
+            usleep(due - now_us());
+        }
+    }
+}
+
+// 传文件的同时每 5ms 发一条聊天，返回每条聊天的延迟（毫秒）。
+// separate 为 true 时文件数据走单独的连接（数据连接），否则和聊天挤在同一条连接（登录连接）上
+static std::vector<double> chat_latency(int file_fd, const BenchOptions& options, bool separate) {
+    std::vector<double> latencies;
+    std::vector<double> data_latencies; // 数据连接上不发聊天，一直是空的
+    int control_sender = -1;
+    int control_receiver = -1;
+    int data_sender = -1;
+    int data_receiver = -1;
+    if (!loopback_pair(control_sender, control_receiver) ||
+        (separate && !loopback_pair(data_sender, data_receiver))) {
+        return latencies;
+    }
+    std::atomic<bool> done{false};
+    std::thread control_thread([&] {
+        FrameReader reader(control_receiver);
+        reader.set_version(2);
+        read_frames(reader, options.rate, done, latencies);
+    });
+    std::thread data_thread;
+    if (separate) {
+        data_thread = std::thread([&] {
+            FrameReader reader(data_receiver);
+            reader.set_version(2);
+            read_frames(reader, options.rate, done, data_latencies);
+        });
+    }
+
+    {
+        SendQueue control(control_sender);
+        std::unique_ptr<SendQueue> data(separate ? new SendQueue(data_sender) : nullptr);
+        SendQueue& bulk = separate ? *data : control;
+        std::atomic<bool> sent{false};
+        std::thread file_thread([&] {
+            for (uint64_t offset = 0; offset < options.size; offset += options.chunk) {
+                FileDataMsg data_msg = {1, offset, (uint32_t)std::min<uint64_t>(options.chunk, options.size - offset)};
+                std::vector<char> head(FILE_DATA_HEAD_MAX);
+                head.resize(encode_file_data_head(2, data_msg, head.data()));
+                if (!bulk.push_bulk("file", std::move(head), file_fd, offset, data_msg.data_len)) {
+                    break;
+                }
+            }
+            bulk.flush("file");
+            sent = true;
+        });
+        // 先让文件数据把队列和缓冲区塞满再开始发聊天
+        usleep(200 * 1000);
+        while (!sent) {
+            control.push(SEND_CHAT, encode_text_package(2, MSG_CHAT, std::to_string(now_us())));
+            usleep(5 * 1000);
+        }
+        file_thread.join();
+        usleep(200 * 1000); // 最后几条聊天到达
+        done = true;
+        // 关掉连接让读线程从 read_header 返回
+        shutdown(control_sender, SHUT_RDWR);
+        if (separate) {
+            shutdown(data_sender, SHUT_RDWR);
+        }
+    }
+    control_thread.join();
+    if (separate) {
+        data_thread.join();
+    }
+    for (int fd : {control_sender, control_receiver, data_sender, data_receiver}) {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    return latencies;
+}
+
+static void report_latency(const std::string& name, std::vector<double> latencies) {
+    if (latencies.empty()) {
+        std::printf("%-40s no chat messages received  FAILED\n", name.c_str());
+        return;
+    }
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&latencies](double p) {
+        return latencies[std::min(latencies.size() - 1, (size_t)(p * latencies.size()))];
+    };
+    std::printf("%-40s p50 %8.2f ms  p99 %8.2f ms  max %8.2f ms  (%zu chats)\n", name.c_str(), percentile(0.5),
+                percentile(0.99), latencies.back(), latencies.size());
+}
+
+// clients 个用户同时在线聊天，持续 seconds 秒：每人每 100ms 一句，每句放进所有连接的 SendQueue，
+// 和服务器 broadcast 一样；合并发送按 tick 设置，和服务器的 Connection 一样不套 MSG_BUNDLE。
+// 读线程算出每句的延迟；打印写 socket 的系统调用次数，返回延迟（毫秒）
+static std::vector<double> broadcast_latency(int clients, std::chrono::microseconds tick, double seconds) {
+    std::vector<int> senders(clients, -1);
+    std::vector<int> receivers(clients, -1);
+    std::vector<std::vector<double>> latencies(clients);
+    std::vector<std::thread> readers;
+    std::atomic<bool> done{false};
+    std::atomic<uint64_t> deliveries{0};
+    for (int i = 0; i < clients; ++i) {
+        if (!loopback_pair(senders[i], receivers[i])) {
+            std::perror("loopback_pair");
+            return {};
+        }
+        readers.emplace_back([&, i] {
+            FrameReader reader(receivers[i]);
+            reader.set_version(2);
+            read_frames(reader, 1, done, latencies[i]);
+        });
+    }
+
+    uint64_t writes = 0;
+    {
+        std::vector<std::unique_ptr<SendQueue>> outboxes;
+        for (int fd : senders) {
+            outboxes.emplace_back(new SendQueue(fd));
+            outboxes.back()->set_batching(tick, 0);
+        }
+        // 每个用户一个线程，起始时间错开，合起来每 100ms / clients 有一句
+        const int64_t period = 100 * 1000;
+        int64_t start = now_us();
+        std::vector<std::thread> chatters;
+        for (int user = 0; user < clients; ++user) {
+            chatters.emplace_back([&, user] {
+                for (int64_t due = start + period * user / clients; due < start + (int64_t)(seconds * 1e6);
+                     due += period) {
+                    if (due > now_us()) {
+                        usleep(due - now_us());
+                    }
+                    std::vector<char> package = encode_text_package(2, MSG_CHAT, std::to_string(now_us()));
+                    for (const auto& outbox : outboxes) {
+                        outbox->push(SEND_CHAT, std::vector<char>(package));
+                    }
+                    deliveries += outboxes.size();
+                }
+            });
+        }
+        for (auto& chatter : chatters) {
+            chatter.join();
+        }
+        usleep(200 * 1000); // 最后几句写出去、到达
+        for (const auto& outbox : outboxes) {
+            writes += outbox->write_calls();
+        }
+        done = true;
+        for (int fd : senders) {
+            shutdown(fd, SHUT_RDWR);
+        }
+    }
+    for (auto& reader : readers) {
+        reader.join();
+    }
+    std::vector<double> all;
+    for (int i = 0; i < clients; ++i) {
+        all.insert(all.end(), latencies[i].begin(), latencies[i].end());
+        close(senders[i]);
+        close(receivers[i]);
+    }
+    std::printf("write tick %5lld us: %8llu writes for %llu chat deliveries (%.2f per delivery)\n",
+                (long long)tick.count(), (unsigned long long)writes, (unsigned long long)deliveries.load(),
+                deliveries ? (double)writes / deliveries : 0.0);
+    return all;
+}
+
+static bool parse_options(int argc, char** argv, BenchOptions& options) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--size-mb" && i + 1 < argc) {
+            options.size = (uint64_t)std::max(1, atoi(argv[++i])) << 20;
+        } else if (arg == "--copy") {
+            options.copy = true;
+#ifdef HAVE_OPENSSL
+        } else if (arg == "--encrypt") {
+            options.encrypt = true;
+#endif
+        } else if (arg == "--chunk-kb" && i + 1 < argc) {
+            options.chunk = ChunkSizer(MAX_CHUNK_SIZE, std::max(1, atoi(argv[++i])) * 1024).size();
+        } else if (arg == "--latency") {
+            options.latency = true;
+        } else if (arg == "--rate-mb" && i + 1 < argc) {
+            options.rate = (uint64_t)std::max(1, atoi(argv[++i])) << 20;
+        } else if (arg == "--broadcast" && i + 1 < argc) {
+            options.broadcast = std::max(1, atoi(argv[++i]));
+        } else if (arg == "--tick-us" && i + 1 < argc) {
+            options.tick_us = std::max(1, atoi(argv[++i]));
+        } else {
+            std::fprintf(stderr,
+                         "Usage: %s [--size-mb N] [--copy] [--encrypt] [--chunk-kb N] [--latency [--rate-mb N]] "
+                         "[--broadcast N [--tick-us N]]\n",
+                         argv[0]);
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char** argv) {
+    BenchOptions options;
+    if (!parse_options(argc, argv, options)) {
+        return 1;
+    }
+    std::printf("CPUs: %u\n", std::thread::hardware_concurrency());
+    if (options.broadcast > 0) {
+        std::printf("%d clients, each chats every 100 ms, every chat goes to all %d connections\n", options.broadcast,
+                    options.broadcast);
+        report_latency("chat latency, write tick off", broadcast_latency(options.broadcast, {}, 3));
+        report_latency("chat latency, write tick " + std::to_string(options.tick_us) + " us",
+                       broadcast_latency(options.broadcast, std::chrono::microseconds(options.tick_us), 3));
+        return 0;
+    }
+
+    // 要发的文件：随机数据，写完就在页缓存里，测的是发送路径而不是磁盘
+    char path[] = "/tmp/transfer_benchXXXXXX";
+    int file_fd = mkstemp(path);
+    if (file_fd < 0) {
+        std::perror("mkstemp");
+        return 1;
+    }
+    unlink(path);
+    std::string random = sample_random(64 << 20);
+    for (uint64_t written = 0; written < options.size; written += random.size()) {
+        size_t part = (size_t)std::min<uint64_t>(random.size(), options.size - written);
+        if (pwrite(file_fd, random.data(), part, written) != (ssize_t)part) {
+            std::perror("pwrite");
+            return 1;
+        }
+    }
+    if (options.latency) {
+        std::printf("chat every 5 ms while sending %llu MB, receiver reads file data at %llu MB/s\n",
+                    (unsigned long long)(options.size >> 20), (unsigned long long)(options.rate >> 20));
+        report_latency("chat latency, shared connection", chat_latency(file_fd, options, false));
+        report_latency("chat latency, separate data connection", chat_latency(file_fd, options, true));
+        close(file_fd);
+        return 0;
+    }
+#ifdef HAVE_OPENSSL
+    if (options.encrypt) {
+        cipher_speed(options.size);
+    }
+#endif
+    send_file(file_fd, options); // 预热
+
+    std::string name = std::string("loopback send, ") + (options.copy ? "read + send" : "sendfile") +
+                       (options.encrypt ? " + encrypt" : "") + ", " + std::to_string(options.chunk / 1024) +
+                       " KB chunks";
+    double receiver_cpu = 0;
+    double process_cpu = cpu_seconds(RUSAGE_SELF);
+    measure(name, options.size, [&] { return send_file(file_fd, options, &receiver_cpu); });
+    // 单核的机器上两头抢一个核，总的速度看不出每一头要多少 CPU，按各自的 CPU 时间折算
+    double sender_cpu = cpu_seconds(RUSAGE_SELF) - process_cpu - receiver_cpu;
+    std::printf("%-40s %8.1f MB/s  (%.3f s)\n", "  per CPU-second, sending side", options.size / sender_cpu / (1 << 20),
+                sender_cpu);
+    std::printf("%-40s %8.1f MB/s  (%.3f s)\n", "  per CPU-second, receiving side",
+                options.size / receiver_cpu / (1 << 20), receiver_cpu);
+    close(file_fd);
+    return 0;
+}